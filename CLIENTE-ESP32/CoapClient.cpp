@@ -1,77 +1,355 @@
-#include "CoapClient.h"
-#include "Config.h"
-
-CoapClient::CoapClient() : _serverPort(0) {}
-
-void CoapClient::begin(const char* serverIp, uint16_t serverPort) {
-  _serverAddr.fromString(serverIp);
-  _serverPort = serverPort;
-  _udp.begin(0); // puerto efímero
-}
-
-uint16_t CoapClient::_nextMessageId() {
-  static uint16_t mid = 1000;
-  return ++mid;
-}
-
-void CoapClient::_randomToken(uint8_t* t, uint8_t& tlen) {
-  tlen = 4; // TKL=4
-  for (uint8_t i=0; i<tlen; ++i) t[i] = (uint8_t)random(0, 256);
-}
-
-bool CoapClient::postJson(const String& uriPath1, const String& uriPath2,
-                          const uint8_t* json, size_t len,
-                          uint32_t ackTimeoutMs, uint8_t maxRetransmit) {
-  CoapMessage msg;
-  msg.begin(CoapType::CON, CoapCode::POST);
-  uint16_t mid = _nextMessageId();
-  msg.setMessageId(mid);
-  uint8_t token[COAP_MAX_TOKEN_LEN]; uint8_t tLen = 0;
-  _randomToken(token, tLen);
-  msg.setToken(token, tLen);
-
-  // Uri-Path "sensors" y "env"
-  msg.addOption(OPT_URI_PATH, (const uint8_t*)uriPath1.c_str(), (uint8_t)uriPath1.length());
-  msg.addOption(OPT_URI_PATH, (const uint8_t*)uriPath2.c_str(), (uint8_t)uriPath2.length());
-
-  // Content-Format: 50 (application/json)
-  uint8_t cf = (uint8_t)COAP_CONTENT_FORMAT_JSON;
-  msg.addOption(OPT_CONTENT_FORMAT, &cf, 1);
-
-  msg.setPayload(json, len);
-
-  uint8_t buffer[COAP_MAX_MSG_LEN];
-  size_t mlen = msg.build(buffer, sizeof(buffer));
-  if (mlen == 0) return false;
-
-  uint8_t tries = 0;
-  uint32_t timeout = ackTimeoutMs;
-
-  while (true) {
-    // Enviar
-    _udp.beginPacket(_serverAddr, _serverPort);
-    _udp.write(buffer, mlen);
-    _udp.endPacket();
-
-    // Esperar ACK
-    uint32_t start = millis();
-    while ((millis() - start) < timeout) {
-      int packetSize = _udp.parsePacket();
-      if (packetSize > 0) {
-        uint8_t rx[COAP_MAX_MSG_LEN];
-        int rlen = _udp.read(rx, sizeof(rx));
-        if (rlen >= 4 && CoapMessage::isAckFor(rx, (size_t)rlen, mid)) {
-          return true; // ACK correcto
-        }
-      }
-      delay(5);
-    }
-
-    // Retransmitir si corresponde
-    if (tries >= maxRetransmit) {
-      return false;
-    }
-    tries++;
-    timeout = timeout * 2; // backoff exponencial simple
-  }
-}
+#include "CoapClient.h"
+
+CoapClient::CoapClient() : _serverPort(0), _mid(0), _stats(), _nextHandle(0),
+  _prepared(nullptr), _results(), _resultPos(0), _cb(nullptr), _cbCtx(nullptr), _reqCb(nullptr), _reqCtx(nullptr), _strong(), _weak(),
+  _rto(ACK_TIMEOUT_MS) {
+  for (uint8_t i=0; i<COAP_NSTART; ++i) _ex[i].state = CoapExchange::FREE;
+}
+
+void CoapClient::begin(const char* serverIp, uint16_t serverPort) {
+  _serverAddr.fromString(serverIp);
+  _serverPort = serverPort;
+  _udp.begin(COAP_LOCAL_PORT); // fijo para servir recursos; 0 = efímero
+  _mid = (uint16_t)random(0, 0x10000); // RFC 7252: MID inicial aleatorio
+  _stats.rtoMs = _rto;
+}
+
+uint16_t CoapClient::_nextMessageId() {
+  return ++_mid;
+}
+
+void CoapClient::_randomToken(uint8_t* t, uint8_t& tlen) {
+  tlen = COAP_CLIENT_TOKEN_LEN;
+  for (uint8_t i=0; i<tlen; ++i) t[i] = (uint8_t)random(0, 256);
+}
+
+size_t CoapClient::_buildPost(uint8_t* out, size_t cap, uint16_t mid,
+                              const uint8_t* token, uint8_t tLen,
+                              const char* p1, const char* p2,
+                              const uint8_t* json, size_t len) {
+  CoapMessage msg;
+  msg.begin(CoapType::CON, CoapCode::POST);
+  msg.setMessageId(mid);
+  msg.setToken(token, tLen);
+
+  // Uri-Path "sensors" y "env"
+  msg.addOption(OPT_URI_PATH, (const uint8_t*)p1, (uint8_t)strlen(p1));
+  msg.addOption(OPT_URI_PATH, (const uint8_t*)p2, (uint8_t)strlen(p2));
+
+  // Content-Format: 50 (application/json)
+  uint8_t cf = (uint8_t)COAP_CONTENT_FORMAT_JSON;
+  msg.addOption(OPT_CONTENT_FORMAT, &cf, 1);
+
+  msg.setPayload(json, len);
+  return msg.build(out, cap);
+}
+
+bool CoapClient::postJson(const String& uriPath1, const String& uriPath2,
+                          const uint8_t* json, size_t len,
+                          uint32_t ackTimeoutMs, uint8_t maxRetransmit) {
+  CoapHandle h;
+  while ((h = submit(uriPath1.c_str(), uriPath2.c_str(), json, len,
+                     ackTimeoutMs, maxRetransmit)) == COAP_INVALID_HANDLE) {
+    if (inFlight() == 0) return false; // no cabe, no es falta de ventana
+    poll(); delay(1);
+  }
+  while (status(h) == CoapStatus::PENDING) { poll(); delay(1); }
+  return status(h) == CoapStatus::ACKED;
+}
+
+// ================== API no bloqueante (hasta NSTART en vuelo) ==================
+
+CoapHandle CoapClient::submit(const char* uriPath1, const char* uriPath2,
+                              const uint8_t* json, size_t len,
+                              uint32_t ackTimeoutMs, uint8_t maxRetransmit) {
+  _prepared = nullptr;
+  CoapExchange* e = _freeSlot();
+  if (!e) return COAP_INVALID_HANDLE;
+
+  e->mid = _nextMessageId();
+  _randomToken(e->token, e->tokenLen);
+  e->len = _buildPost(e->buf, sizeof(e->buf), e->mid, e->token, e->tokenLen,
+                      uriPath1, uriPath2, json, len);
+  if (e->len == 0) return COAP_INVALID_HANDLE;
+  return _start(*e, ackTimeoutMs, maxRetransmit);
+}
+
+uint8_t* CoapClient::prepare(const CoapRequestTemplate& tpl, size_t& room) {
+  _prepared = nullptr;
+  CoapExchange* e = _freeSlot();
+  if (!e) return nullptr;
+
+  e->mid = _nextMessageId();
+  _randomToken(e->token, e->tokenLen);
+  if (tpl.tokenLength() != e->tokenLen) return nullptr;
+  e->len = tpl.instantiate(e->buf, sizeof(e->buf), e->mid, e->token);
+  if (e->len == 0) return nullptr;
+
+  _prepared = e;
+  room = sizeof(e->buf) - e->len;
+  return e->buf + e->len;
+}
+
+CoapHandle CoapClient::commit(size_t payloadLen, uint32_t ackTimeoutMs, uint8_t maxRetransmit) {
+  CoapExchange* e = _prepared;
+  _prepared = nullptr;
+  if (!e || payloadLen > sizeof(e->buf) - e->len) return COAP_INVALID_HANDLE;
+  // Sin payload no va el marcador 0xFF (RFC 7252 §3)
+  e->len = payloadLen ? e->len + payloadLen : e->len - 1;
+  return _start(*e, ackTimeoutMs, maxRetransmit);
+}
+
+CoapHandle CoapClient::_start(CoapExchange& e, uint32_t ackTimeoutMs, uint8_t maxRetransmit) {
+  if (++_nextHandle == COAP_INVALID_HANDLE) ++_nextHandle;
+  e.handle = _nextHandle;
+  e.state = CoapExchange::WAIT_ACK;
+  e.tries = 0;
+  e.maxTries = maxRetransmit;
+  e.timeout = _initialTimeout(ackTimeoutMs ? ackTimeoutMs : _rto);
+  e.firstSentAt = e.sentAt = millis();
+  _transmit(e);
+  _stats.sent++;
+  return e.handle;
+}
+
+CoapStatus CoapClient::status(CoapHandle h) const {
+  if (h == COAP_INVALID_HANDLE) return CoapStatus::UNKNOWN;
+  for (uint8_t i=0; i<COAP_NSTART; ++i)
+    if (_ex[i].state != CoapExchange::FREE && _ex[i].handle == h) return CoapStatus::PENDING;
+  for (uint8_t i=0; i<RESULT_HISTORY; ++i)
+    if (_results[i].h == h) return _results[i].st;
+  return CoapStatus::UNKNOWN;
+}
+
+uint8_t CoapClient::inFlight() const {
+  uint8_t n = 0;
+  for (uint8_t i=0; i<COAP_NSTART; ++i) if (_ex[i].state != CoapExchange::FREE) n++;
+  return n;
+}
+
+void CoapClient::poll() {
+  _receive();
+
+  // Temporizadores de cada intercambio (aritmética sin signo: soporta el desborde de millis())
+  uint32_t now = millis();
+  for (uint8_t i=0; i<COAP_NSTART; ++i) {
+    CoapExchange& e = _ex[i];
+    if (e.state == CoapExchange::WAIT_SEPARATE) {
+      if (now - e.sentAt >= SEPARATE_TIMEOUT_MS) _complete(e, false, 0, now);
+      continue;
+    }
+    if (e.state != CoapExchange::WAIT_ACK || now - e.sentAt < e.timeout) continue;
+    if (e.tries >= e.maxTries) { _complete(e, false, 0, now); continue; }
+    e.tries++;
+    e.timeout = _backoff(e.timeout);
+    e.sentAt = now;
+    _transmit(e);
+    _stats.retransmissions++;
+  }
+}
+
+void CoapClient::_receive() {
+  int packetSize;
+  while ((packetSize = _udp.parsePacket()) > 0) {
+    uint8_t rx[COAP_MAX_MSG_LEN];
+    int rlen = _udp.read(rx, sizeof(rx));
+    if (rlen < 4 || ((rx[0] >> 6) & 0x03) != 1) continue;
+
+    uint8_t  type = (rx[0] >> 4) & 0x03;
+    uint8_t  tkl  = rx[0] & 0x0F;
+    uint8_t  code = rx[1];
+    uint16_t mid  = ((uint16_t)rx[2] << 8) | rx[3];
+    if (tkl > COAP_MAX_TOKEN_LEN || 4 + tkl > rlen) continue;
+    uint32_t now = millis();
+
+    if (type == (uint8_t)CoapType::ACK || type == (uint8_t)CoapType::RST) {
+      CoapExchange* e = _findByMid(mid);
+      if (!e || e->state != CoapExchange::WAIT_ACK) continue;
+      if (type == (uint8_t)CoapType::RST) { _complete(*e, false, 0, now); continue; }
+      if (code == (uint8_t)CoapCode::EMPTY) {
+        // ACK vacío: el servidor responderá por separado; dejamos de retransmitir
+        e->state = CoapExchange::WAIT_SEPARATE;
+        e->sentAt = now;
+        continue;
+      }
+      _complete(*e, true, code, now, _maxAge(rx, (size_t)rlen, tkl));
+    } else if ((code >> 5) == 0 && code != (uint8_t)CoapCode::EMPTY) {
+      // Petición dirigida al dispositivo (clase 0.xx)
+      _handleRequest(rx, (size_t)rlen, type, mid, tkl);
+    } else {
+      // Respuesta separada (CON/NON): se asocia por token. Un CON sin
+      // intercambio que lo espere (o un ping, CON vacío) se rechaza con RST
+      // (RFC 7252 §4.2, §4.3)
+      CoapExchange* e = code != (uint8_t)CoapCode::EMPTY ? _findByToken(rx + 4, tkl) : nullptr;
+      if (type == (uint8_t)CoapType::CON) _sendEmpty(e ? CoapType::ACK : CoapType::RST, mid);
+      if (e) _complete(*e, true, code, now, _maxAge(rx, (size_t)rlen, tkl));
+    }
+  }
+}
+
+// Siguiente opción a partir de i (justo tras el token o la opción anterior).
+// Devuelve false al llegar al payload o al final, o con bad si está mal formada.
+static bool nextOption(const uint8_t* rx, size_t rlen, size_t& i, uint16_t& num,
+                       const uint8_t*& val, uint32_t& len, bool& bad) {
+  if (i >= rlen || rx[i] == 0xFF) return false;
+  uint32_t d = rx[i] >> 4, l = rx[i] & 0x0F;
+  i++;
+  uint32_t* f[2] = { &d, &l };
+  for (uint8_t k=0; k<2; ++k) {
+    if (*f[k] == 13)      { if (i + 1 > rlen) bad = true; else *f[k] = 13 + rx[i++]; }
+    else if (*f[k] == 14) { if (i + 2 > rlen) bad = true; else { *f[k] = 269 + ((uint32_t)rx[i] << 8 | rx[i+1]); i += 2; } }
+    else if (*f[k] == 15) bad = true;
+  }
+  if (bad || i + l > rlen) { bad = true; return false; }
+  num += (uint16_t)d;
+  val = rx + i; len = l;
+  i += l;
+  return true;
+}
+
+// Max-Age de una respuesta en segundos, o -1 si no lleva
+int32_t CoapClient::_maxAge(const uint8_t* rx, size_t rlen, uint8_t tkl) {
+  size_t i = 4 + tkl;
+  uint16_t num = 0;
+  const uint8_t* v;
+  uint32_t l;
+  bool bad = false;
+  while (nextOption(rx, rlen, i, num, v, l, bad)) {
+    if (num < OPT_MAX_AGE) continue;
+    if (num > OPT_MAX_AGE || l > 4) break;
+    uint32_t age = 0;
+    for (uint32_t k=0; k<l; ++k) age = age << 8 | v[k];
+    return age > 0x7FFFFFFF ? 0x7FFFFFFF : (int32_t)age;
+  }
+  return -1;
+}
+
+void CoapClient::_handleRequest(const uint8_t* rx, size_t rlen, uint8_t type,
+                                uint16_t mid, uint8_t tkl) {
+  // Sólo interesa Uri-Path; el resto de opciones se salta
+  char path[48];
+  size_t pl = 0;
+  const uint8_t* payload = nullptr;
+  size_t plen = 0;
+  bool bad = false;
+  uint16_t num = 0;
+  size_t i = 4 + tkl;
+  const uint8_t* v;
+  uint32_t l;
+  while (nextOption(rx, rlen, i, num, v, l, bad)) {
+    if (num == OPT_URI_PATH) {
+      if (pl && pl + 1 < sizeof(path)) path[pl++] = '/';
+      for (uint32_t k=0; k<l && pl + 1 < sizeof(path); ++k) path[pl++] = (char)v[k];
+    }
+  }
+  if (!bad && i < rlen) { payload = rx + i + 1; plen = rlen - i - 1; }
+  path[pl] = 0;
+
+  uint8_t body[128];
+  size_t  blen = 0;
+  uint8_t rcode = (uint8_t)CoapCode::NOT_FOUND_404;
+  if (bad) rcode = (uint8_t)CoapCode::BAD_REQUEST_400;
+  else if (_reqCb) rcode = _reqCb(rx[1], path, payload, plen, body, sizeof(body), blen, _reqCtx);
+
+  CoapMessage m;
+  m.begin(type == (uint8_t)CoapType::CON ? CoapType::ACK : CoapType::NON, (CoapCode)rcode);
+  m.setMessageId(type == (uint8_t)CoapType::CON ? mid : _nextMessageId());
+  m.setToken(rx + 4, tkl);
+  uint8_t cf = (uint8_t)COAP_CONTENT_FORMAT_JSON;
+  if (blen) { m.addOption(OPT_CONTENT_FORMAT, &cf, 1); m.setPayload(body, blen); }
+  uint8_t out[4 + COAP_MAX_TOKEN_LEN + 8 + sizeof(body)];
+  size_t n = m.build(out, sizeof(out));
+  if (!n) return;
+  // Al que preguntó, que no tiene por qué ser nuestro servidor
+  _udp.beginPacket(_udp.remoteIP(), _udp.remotePort());
+  _udp.write(out, n);
+  _udp.endPacket();
+}
+
+void CoapClient::_complete(CoapExchange& e, bool ok, uint8_t code, uint32_t now, int32_t maxAge) {
+  if (ok) {
+    _stats.acked++;
+    // RTT fuerte si no hubo retransmisión; débil (desde el primer envío) si hubo pocas
+    if (e.state == CoapExchange::WAIT_ACK) {
+      if (e.tries == 0)      _updateRto(now - e.firstSentAt, true);
+      else if (e.tries <= 2) _updateRto(now - e.firstSentAt, false);
+    }
+  } else {
+    _stats.failed++;
+  }
+  e.state = CoapExchange::FREE;
+
+  CoapStatus st = ok ? CoapStatus::ACKED : CoapStatus::FAILED;
+  _results[_resultPos] = { e.handle, st };
+  _resultPos = (uint8_t)((_resultPos + 1) % RESULT_HISTORY);
+  if (_cb) _cb(e.handle, st, code, maxAge, _cbCtx);
+}
+
+void CoapClient::_transmit(const CoapExchange& e) {
+  _udp.beginPacket(_serverAddr, _serverPort);
+  _udp.write(e.buf, e.len);
+  _udp.endPacket();
+}
+
+// ACK o RST vacío al remitente del paquete que se está procesando
+void CoapClient::_sendEmpty(CoapType type, uint16_t mid) {
+  uint8_t m[4] = { (uint8_t)((1 << 6) | ((uint8_t)type << 4)), 0,
+                   (uint8_t)(mid >> 8), (uint8_t)(mid & 0xFF) };
+  _udp.beginPacket(_udp.remoteIP(), _udp.remotePort());
+  _udp.write(m, sizeof(m));
+  _udp.endPacket();
+}
+
+CoapExchange* CoapClient::_freeSlot() {
+  for (uint8_t i=0; i<COAP_NSTART; ++i) if (_ex[i].state == CoapExchange::FREE) return &_ex[i];
+  return nullptr;
+}
+
+CoapExchange* CoapClient::_findByMid(uint16_t mid) {
+  for (uint8_t i=0; i<COAP_NSTART; ++i)
+    if (_ex[i].state != CoapExchange::FREE && _ex[i].mid == mid) return &_ex[i];
+  return nullptr;
+}
+
+CoapExchange* CoapClient::_findByToken(const uint8_t* tok, uint8_t tkl) {
+  for (uint8_t i=0; i<COAP_NSTART; ++i)
+    if (_ex[i].state != CoapExchange::FREE && _ex[i].tokenLen == tkl &&
+        memcmp(_ex[i].token, tok, tkl) == 0) return &_ex[i];
+  return nullptr;
+}
+
+// RFC 7252 §4.2: timeout inicial aleatorio en [RTO, RTO * ACK_RANDOM_FACTOR]
+uint32_t CoapClient::_initialTimeout(uint32_t base) const {
+  return base + (uint32_t)random(0, (long)(base * (ACK_RANDOM_FACTOR_PCT - 100) / 100) + 1);
+}
+
+uint32_t CoapClient::_backoff(uint32_t timeout) const {
+#if COAP_USE_COCOA
+  // Backoff variable de CoCoA: más agresivo con RTO pequeños, más suave con grandes
+  if (_rto < 1000) return timeout * 3;
+  if (_rto > 3000) return timeout * 3 / 2;
+#endif
+  return timeout * 2;
+}
+
+// CoCoA: RTTVAR/SRTT al estilo RFC 6298 con K=4 (fuerte) o K=1 (débil),
+// y RTO = 0.5*E_fuerte + 0.5*RTO  /  0.25*E_débil + 0.75*RTO
+void CoapClient::_updateRto(uint32_t rtt, bool strong) {
+#if COAP_USE_COCOA
+  RttEstimator& est = strong ? _strong : _weak;
+  if (!est.valid) {
+    est.srtt = rtt; est.rttvar = rtt / 2; est.valid = true;
+  } else {
+    uint32_t diff = est.srtt > rtt ? est.srtt - rtt : rtt - est.srtt;
+    est.rttvar = (3 * est.rttvar + diff) / 4;
+    est.srtt   = (7 * est.srtt + rtt) / 8;
+  }
+  uint32_t e = est.srtt + (strong ? 4 : 1) * est.rttvar;
+  _rto = strong ? (e + _rto) / 2 : (e + 3 * _rto) / 4;
+  if (_rto < 100) _rto = 100;
+  if (_rto > 60000) _rto = 60000;
+  _stats.rtoMs = _rto;
+#else
+  (void)rtt; (void)strong;
+#endif
+}
@@ -1,23 +1,139 @@
-#pragma once
-#include <Arduino.h>
-#include <WiFiUdp.h>
-#include "CoapTypes.h"
-#include "CoapMessage.h"
-
-class CoapClient {
-public:
-  CoapClient();
-  void begin(const char* serverIp, uint16_t serverPort);
-  // Envía POST CON /sensors/env con content-format JSON y espera ACK con reintentos
-  bool postJson(const String& uriPath1, const String& uriPath2,
-                const uint8_t* json, size_t len,
-                uint32_t ackTimeoutMs, uint8_t maxRetransmit);
-
-private:
-  WiFiUDP _udp;
-  IPAddress _serverAddr;
-  uint16_t _serverPort;
-
-  uint16_t _nextMessageId();
-  void _randomToken(uint8_t* t, uint8_t& tlen);
-};
+#pragma once
+#include <Arduino.h>
+#include <WiFiUdp.h>
+#include "CoapTypes.h"
+#include "CoapMessage.h"
+#include "Config.h"
+
+// Intercambio CON en vuelo: se identifica por MID (ACK/RST) y por token
+// (respuesta separada). Guarda el paquete ya codificado para retransmitir.
+struct CoapExchange {
+  enum State : uint8_t { FREE = 0, WAIT_ACK, WAIT_SEPARATE };
+  State    state;
+  uint16_t mid;
+  uint8_t  token[COAP_MAX_TOKEN_LEN];
+  uint8_t  tokenLen;
+  uint8_t  buf[COAP_MAX_MSG_LEN];
+  size_t   len;
+  uint32_t firstSentAt;  // para medir RTT
+  uint32_t sentAt;       // último (re)envío
+  uint32_t timeout;      // RTO vigente de este intercambio
+  uint8_t  tries;        // retransmisiones hechas
+  uint8_t  maxTries;
+  uint16_t handle;
+};
+
+// Identificador de un envío. COAP_INVALID_HANDLE si no se aceptó.
+typedef uint16_t CoapHandle;
+static const CoapHandle COAP_INVALID_HANDLE = 0;
+
+enum class CoapStatus : uint8_t { UNKNOWN = 0, PENDING, ACKED, FAILED };
+
+// Se invoca desde poll() al terminar cada envío. ACKED sólo dice que hubo
+// respuesta: code es su código (0 si no hubo o si el servidor respondió con
+// RST) y el llamador decide según la clase (2.xx entregado, 4.xx rechazado,
+// 5.xx reintentar). maxAge = Max-Age de la respuesta en segundos, -1 si no
+// lleva; en un 5.03 es cuánto esperar antes de reintentar.
+typedef void (*CoapResultCallback)(CoapHandle h, CoapStatus st, uint8_t code, int32_t maxAge, void* ctx);
+
+// Petición entrante (el dispositivo también sirve recursos, p. ej. PUT
+// /config/report). path va sin '/' inicial ("config/report"). El manejador
+// escribe el payload de la respuesta en resp (hasta respCap bytes, JSON) y
+// devuelve el código; la respuesta va en el ACK (CON) o como NON.
+typedef uint8_t (*CoapRequestHandler)(uint8_t method, const char* path,
+                                      const uint8_t* payload, size_t len,
+                                      uint8_t* resp, size_t respCap, size_t& respLen,
+                                      void* ctx);
+
+struct CoapClientStats {
+  uint32_t sent;
+  uint32_t acked;
+  uint32_t failed;
+  uint32_t retransmissions;
+  uint32_t rtoMs;        // RTO base actual (fijo o estimado)
+};
+
+class CoapClient {
+public:
+  CoapClient();
+  void begin(const char* serverIp, uint16_t serverPort);
+  // Envía POST CON /sensors/env con content-format JSON y espera ACK con reintentos.
+  // Bloquea hasta terminar; es submit() + poll() en bucle.
+  bool postJson(const String& uriPath1, const String& uriPath2,
+                const uint8_t* json, size_t len,
+                uint32_t ackTimeoutMs, uint8_t maxRetransmit);
+
+  // Encola un POST CON y lo envía sin esperar (hasta COAP_NSTART en vuelo).
+  // ackTimeoutMs = 0 usa el RTO del cliente (fijo o CoCoA).
+  // Devuelve COAP_INVALID_HANDLE si la ventana está llena o el mensaje no cabe.
+  CoapHandle submit(const char* uriPath1, const char* uriPath2,
+                    const uint8_t* json, size_t len,
+                    uint32_t ackTimeoutMs = 0, uint8_t maxRetransmit = MAX_RETRANSMIT);
+  // Envío sin copias: prepare() reserva un slot, copia la plantilla (parcheando
+  // MID y token) y devuelve dónde escribir el payload y cuánto cabe (nullptr si
+  // la ventana está llena). commit() lo envía; cancel() descarta lo preparado.
+  uint8_t*   prepare(const CoapRequestTemplate& tpl, size_t& room);
+  CoapHandle commit(size_t payloadLen,
+                    uint32_t ackTimeoutMs = 0, uint8_t maxRetransmit = MAX_RETRANSMIT);
+  void       cancel() { _prepared = nullptr; }
+
+  // Procesa respuestas recibidas y vence temporizadores según millis(). No bloquea;
+  // llamarlo en cada vuelta de loop().
+  void poll();
+  // PENDING mientras esté en vuelo; ACKED/FAILED para los últimos resultados.
+  CoapStatus status(CoapHandle h) const;
+  void onResult(CoapResultCallback cb, void* ctx = nullptr) { _cb = cb; _cbCtx = ctx; }
+  // Sin manejador, toda petición recibe 4.04
+  void onRequest(CoapRequestHandler cb, void* ctx = nullptr) { _reqCb = cb; _reqCtx = ctx; }
+
+  uint8_t inFlight() const;
+  const CoapClientStats& stats() const { return _stats; }
+
+private:
+  WiFiUDP _udp;
+  IPAddress _serverAddr;
+  uint16_t _serverPort;
+  uint16_t _mid;
+
+  CoapExchange    _ex[COAP_NSTART];
+  CoapClientStats _stats;
+  uint16_t        _nextHandle;
+  CoapExchange*   _prepared;
+
+  // Resultados recientes para status() una vez liberado el slot
+  struct Result { CoapHandle h; CoapStatus st; };
+  static const uint8_t RESULT_HISTORY = 8;
+  Result  _results[RESULT_HISTORY];
+  uint8_t _resultPos;
+
+  CoapResultCallback _cb;
+  void*              _cbCtx;
+  CoapRequestHandler _reqCb;
+  void*              _reqCtx;
+
+  // Estimadores CoCoA (RTT fuerte = sin retransmisión, débil = con ellas)
+  struct RttEstimator { bool valid; uint32_t srtt; uint32_t rttvar; };
+  RttEstimator _strong, _weak;
+  uint32_t     _rto;
+
+  uint16_t _nextMessageId();
+  void _randomToken(uint8_t* t, uint8_t& tlen);
+
+  CoapExchange* _freeSlot();
+  CoapExchange* _findByMid(uint16_t mid);
+  CoapExchange* _findByToken(const uint8_t* tok, uint8_t tkl);
+  size_t _buildPost(uint8_t* out, size_t cap, uint16_t mid,
+                    const uint8_t* token, uint8_t tLen,
+                    const char* p1, const char* p2,
+                    const uint8_t* json, size_t len);
+  CoapHandle _start(CoapExchange& e, uint32_t ackTimeoutMs, uint8_t maxRetransmit);
+  void _transmit(const CoapExchange& e);
+  void _sendEmpty(CoapType type, uint16_t mid);
+  void _receive();
+  void _handleRequest(const uint8_t* rx, size_t rlen, uint8_t type, uint16_t mid, uint8_t tkl);
+  void _complete(CoapExchange& e, bool ok, uint8_t code, uint32_t now, int32_t maxAge = -1);
+  static int32_t _maxAge(const uint8_t* rx, size_t rlen, uint8_t tkl);
+  uint32_t _initialTimeout(uint32_t base) const;
+  uint32_t _backoff(uint32_t timeout) const;
+  void _updateRto(uint32_t rtt, bool strong);
+};
@@ -1,122 +1,156 @@
-#include "CoapMessage.h"
-
-CoapMessage::CoapMessage() : m_type(CoapType::CON), m_code(CoapCode::EMPTY),
-  m_tokenLen(0), m_messageId(0), m_optCount(0), m_payload(nullptr), m_payloadLen(0) {}
-
-void CoapMessage::begin(CoapType type, CoapCode code) {
-  m_type = type; m_code = code;
-  m_tokenLen = 0; m_optCount = 0; m_payload = nullptr; m_payloadLen = 0;
-}
-
-void CoapMessage::setMessageId(uint16_t mid) { m_messageId = mid; }
-
-void CoapMessage::setToken(const uint8_t* t, uint8_t tlen) {
-  if (t && tlen <= COAP_MAX_TOKEN_LEN) {
-    memcpy(m_token, t, tlen);
-    m_tokenLen = tlen;
-  } else {
-    m_tokenLen = 0;
-  }
-}
-
-bool CoapMessage::addOption(uint16_t number, const uint8_t* val, uint8_t len) {
-  if (m_optCount >= 4 || len > 64) return false;
-  m_options[m_optCount].number = number;
-  m_options[m_optCount].length = len;
-  if (len > 0 && val) memcpy(m_options[m_optCount].value, val, len);
-  m_optCount++;
-  return true;
-}
-
-bool CoapMessage::setPayload(const uint8_t* data, size_t len) {
-  m_payload = data; m_payloadLen = len;
-  return true;
-}
-
-bool CoapMessage::encodeOption(uint8_t*& p, size_t& remaining, uint16_t& runningDelta,
-                               uint16_t number, const uint8_t* val, uint8_t len) {
-  uint16_t delta = number - runningDelta;
-  if (delta >= 13 || len >= 13) return false; // implementación mínima (nuestros opts <13)
-
-  if (remaining < (size_t)(1 + len)) return false;
-  uint8_t byte = (uint8_t)((delta << 4) | (len & 0x0F));
-  *p++ = byte; remaining--;
-
-  if (len > 0) {
-    if (remaining < len) return false;
-    memcpy(p, val, len);
-    p += len; remaining -= len;
-  }
-  runningDelta = number;
-  return true;
-}
-
-size_t CoapMessage::build(uint8_t* outBuf, size_t outLen) {
-  if (!outBuf || outLen < 4) return 0;
-
-  uint8_t* p = outBuf;
-  size_t remaining = outLen;
-
-  // Header: Ver=1 (2b), Type (2b), TKL (4b)
-  uint8_t ver = 1;
-  uint8_t tkl = m_tokenLen & 0x0F;
-  uint8_t first = (uint8_t)((ver << 6) | (((uint8_t)m_type & 0x03) << 4) | tkl);
-  *p++ = first; remaining--;
-
-  // Code
-  *p++ = (uint8_t)m_code; remaining--;
-
-  // Message ID (big-endian)
-  *p++ = (uint8_t)((m_messageId >> 8) & 0xFF); remaining--;
-  *p++ = (uint8_t)(m_messageId & 0xFF); remaining--;
-
-  // Token
-  if (m_tokenLen > 0) {
-    if (remaining < m_tokenLen) return 0;
-    memcpy(p, m_token, m_tokenLen);
-    p += m_tokenLen; remaining -= m_tokenLen;
-  }
-
-  // Opciones (en orden creciente)
-  // Ordenamos simple por burbuja (máx 4 opciones)
-  for (uint8_t i=0; i<m_optCount; ++i) {
-    for (uint8_t j=i+1; j<m_optCount; ++j) {
-      if (m_options[j].number < m_options[i].number) {
-        CoapOptionKV tmp = m_options[i];
-        m_options[i] = m_options[j];
-        m_options[j] = tmp;
-      }
-    }
-  }
-
-  uint16_t runningDelta = 0;
-  for (uint8_t i=0; i<m_optCount; ++i) {
-    if (!encodeOption(p, remaining, runningDelta,
-                      m_options[i].number, m_options[i].value, m_options[i].length)) {
-      return 0;
-    }
-  }
-
-  // Payload (si hay)
-  if (m_payload && m_payloadLen > 0) {
-    if (remaining < (1 + m_payloadLen)) return 0;
-    *p++ = 0xFF; // payload marker
-    remaining--;
-    memcpy(p, m_payload, m_payloadLen);
-    p += m_payloadLen;
-    remaining -= m_payloadLen;
-  }
-
-  return (size_t)(p - outBuf);
-}
-
-bool CoapMessage::isAckFor(const uint8_t* buf, size_t len, uint16_t expectedMid) {
-  if (!buf || len < 4) return false;
-  uint8_t first = buf[0];
-  uint8_t ver = (first >> 6) & 0x03;
-  uint8_t type = (first >> 4) & 0x03;
-  if (ver != 1) return false;
-  if (type != (uint8_t)CoapType::ACK) return false;
-  uint16_t mid = ((uint16_t)buf[2] << 8) | buf[3];
-  return (mid == expectedMid);
-}
+#include "CoapMessage.h"
+
+CoapMessage::CoapMessage() : m_type(CoapType::CON), m_code(CoapCode::EMPTY),
+  m_tokenLen(0), m_messageId(0), m_optCount(0), m_payload(nullptr), m_payloadLen(0) {}
+
+void CoapMessage::begin(CoapType type, CoapCode code) {
+  m_type = type; m_code = code;
+  m_tokenLen = 0; m_optCount = 0; m_payload = nullptr; m_payloadLen = 0;
+}
+
+void CoapMessage::setMessageId(uint16_t mid) { m_messageId = mid; }
+
+void CoapMessage::setToken(const uint8_t* t, uint8_t tlen) {
+  if (t && tlen <= COAP_MAX_TOKEN_LEN) {
+    memcpy(m_token, t, tlen);
+    m_tokenLen = tlen;
+  } else {
+    m_tokenLen = 0;
+  }
+}
+
+bool CoapMessage::addOption(uint16_t number, const uint8_t* val, uint16_t len) {
+  if (m_optCount >= COAP_MAX_OPTIONS || (len > 0 && !val)) return false;
+  // Inserción ordenada: build() ya no tiene que ordenar
+  uint8_t i = m_optCount;
+  while (i > 0 && m_options[i-1].number > number) {
+    m_options[i] = m_options[i-1];
+    --i;
+  }
+  m_options[i].number = number;
+  m_options[i].value  = val;
+  m_options[i].length = len;
+  m_optCount++;
+  return true;
+}
+
+bool CoapMessage::setPayload(const uint8_t* data, size_t len) {
+  m_payload = data; m_payloadLen = len;
+  return true;
+}
+
+// Nibble de delta/longitud con extensión de 1 byte (13) o 2 bytes (14), RFC 7252 §3.1
+static uint8_t optNibble(uint16_t v, uint8_t* ext, uint8_t& extLen) {
+  if (v < 13)  { extLen = 0; return (uint8_t)v; }
+  if (v < 269) { ext[0] = (uint8_t)(v - 13); extLen = 1; return 13; }
+  uint16_t e = (uint16_t)(v - 269);
+  ext[0] = (uint8_t)(e >> 8); ext[1] = (uint8_t)(e & 0xFF); extLen = 2;
+  return 14;
+}
+
+bool CoapMessage::encodeOption(uint8_t*& p, size_t& remaining, uint16_t& runningDelta,
+                               uint16_t number, const uint8_t* val, uint16_t len) {
+  uint8_t dExt[2], lExt[2], dLen, lLen;
+  uint8_t dN = optNibble((uint16_t)(number - runningDelta), dExt, dLen);
+  uint8_t lN = optNibble(len, lExt, lLen);
+
+  if (remaining < (size_t)(1 + dLen + lLen + len)) return false;
+  *p++ = (uint8_t)((dN << 4) | lN); remaining--;
+  memcpy(p, dExt, dLen); p += dLen; remaining -= dLen;
+  memcpy(p, lExt, lLen); p += lLen; remaining -= lLen;
+
+  if (len > 0) {
+    if (remaining < len) return false;
+    memcpy(p, val, len);
+    p += len; remaining -= len;
+  }
+  runningDelta = number;
+  return true;
+}
+
+size_t CoapMessage::build(uint8_t* outBuf, size_t outLen) {
+  if (!outBuf || outLen < 4) return 0;
+
+  uint8_t* p = outBuf;
+  size_t remaining = outLen;
+
+  // Header: Ver=1 (2b), Type (2b), TKL (4b)
+  uint8_t ver = 1;
+  uint8_t tkl = m_tokenLen & 0x0F;
+  uint8_t first = (uint8_t)((ver << 6) | (((uint8_t)m_type & 0x03) << 4) | tkl);
+  *p++ = first; remaining--;
+
+  // Code
+  *p++ = (uint8_t)m_code; remaining--;
+
+  // Message ID (big-endian)
+  *p++ = (uint8_t)((m_messageId >> 8) & 0xFF); remaining--;
+  *p++ = (uint8_t)(m_messageId & 0xFF); remaining--;
+
+  // Token
+  if (m_tokenLen > 0) {
+    if (remaining < m_tokenLen) return 0;
+    memcpy(p, m_token, m_tokenLen);
+    p += m_tokenLen; remaining -= m_tokenLen;
+  }
+
+  // Opciones (ya en orden creciente, ver addOption)
+  uint16_t runningDelta = 0;
+  for (uint8_t i=0; i<m_optCount; ++i) {
+    if (!encodeOption(p, remaining, runningDelta,
+                      m_options[i].number, m_options[i].value, m_options[i].length)) {
+      return 0;
+    }
+  }
+
+  // Payload (si hay)
+  if (m_payload && m_payloadLen > 0) {
+    if (remaining < (1 + m_payloadLen)) return 0;
+    *p++ = 0xFF; // payload marker
+    remaining--;
+    memcpy(p, m_payload, m_payloadLen);
+    p += m_payloadLen;
+    remaining -= m_payloadLen;
+  }
+
+  return (size_t)(p - outBuf);
+}
+
+bool CoapMessage::isAckFor(const uint8_t* buf, size_t len, uint16_t expectedMid) {
+  if (!buf || len < 4) return false;
+  uint8_t first = buf[0];
+  uint8_t ver = (first >> 6) & 0x03;
+  uint8_t type = (first >> 4) & 0x03;
+  if (ver != 1) return false;
+  if (type != (uint8_t)CoapType::ACK) return false;
+  uint16_t mid = ((uint16_t)buf[2] << 8) | buf[3];
+  return (mid == expectedMid);
+}
+
+// ================== Plantilla precodificada ==================
+
+CoapRequestTemplate::CoapRequestTemplate() : m_len(0), m_tokenLen(0) {}
+
+bool CoapRequestTemplate::compile(CoapMessage& msg, uint8_t tokenLen) {
+  if (tokenLen > COAP_MAX_TOKEN_LEN) return false;
+  uint8_t zeros[COAP_MAX_TOKEN_LEN] = {0};
+  msg.setMessageId(0);
+  msg.setToken(zeros, tokenLen);
+  msg.setPayload(nullptr, 0);
+  size_t n = msg.build(m_prefix, sizeof(m_prefix) - 1);
+  if (n == 0) { m_len = 0; return false; }
+  m_prefix[n++] = 0xFF; // marcador de payload
+  m_len = n;
+  m_tokenLen = tokenLen;
+  return true;
+}
+
+size_t CoapRequestTemplate::instantiate(uint8_t* out, size_t cap, uint16_t mid,
+                                        const uint8_t* token) const {
+  if (m_len == 0 || cap < m_len) return 0;
+  memcpy(out, m_prefix, m_len);
+  out[2] = (uint8_t)(mid >> 8);
+  out[3] = (uint8_t)(mid & 0xFF);
+  if (m_tokenLen) memcpy(out + 4, token, m_tokenLen);
+  return m_len;
+}
@@ -1,44 +1,68 @@
-#pragma once
-#include <Arduino.h>
-#include "CoapTypes.h"
-
-struct CoapOptionKV {
-  uint16_t number;
-  uint8_t  value[64];
-  uint8_t  length;
-};
-
-class CoapMessage {
-public:
-  CoapMessage();
-
-  void begin(CoapType type, CoapCode code);
-  void setMessageId(uint16_t mid);
-  void setToken(const uint8_t* t, uint8_t tlen);
-
-  bool addOption(uint16_t number, const uint8_t* val, uint8_t len);
-  bool setPayload(const uint8_t* data, size_t len);
-
-  // Construye el buffer final listo para enviar por UDP
-  // Devuelve longitud en bytes o 0 si error.
-  size_t build(uint8_t* outBuf, size_t outLen);
-
-  // Simple parser para detectar ACK y MID
-  static bool isAckFor(const uint8_t* buf, size_t len, uint16_t expectedMid);
-
-private:
-  CoapType  m_type;
-  CoapCode  m_code;
-  uint8_t   m_token[COAP_MAX_TOKEN_LEN];
-  uint8_t   m_tokenLen;
-  uint16_t  m_messageId;
-
-  CoapOptionKV m_options[4];
-  uint8_t      m_optCount;
-
-  const uint8_t* m_payload;
-  size_t         m_payloadLen;
-
-  bool encodeOption(uint8_t*& p, size_t& remaining, uint16_t& runningDelta,
-                    uint16_t number, const uint8_t* val, uint8_t len);
-};
+#pragma once
+#include <Arduino.h>
+#include "CoapTypes.h"
+
+// Opción como vista: el valor no se copia, debe seguir vivo hasta build().
+struct CoapOptionKV {
+  uint16_t       number;
+  const uint8_t* value;
+  uint16_t       length;
+};
+
+class CoapMessage {
+public:
+  CoapMessage();
+
+  void begin(CoapType type, CoapCode code);
+  void setMessageId(uint16_t mid);
+  void setToken(const uint8_t* t, uint8_t tlen);
+
+  // Inserta en orden de número (estable: opciones repetidas conservan su orden)
+  bool addOption(uint16_t number, const uint8_t* val, uint16_t len);
+  bool setPayload(const uint8_t* data, size_t len);
+
+  // Construye el buffer final listo para enviar por UDP
+  // Devuelve longitud en bytes o 0 si error.
+  size_t build(uint8_t* outBuf, size_t outLen);
+
+  // Simple parser para detectar ACK y MID
+  static bool isAckFor(const uint8_t* buf, size_t len, uint16_t expectedMid);
+
+private:
+  CoapType  m_type;
+  CoapCode  m_code;
+  uint8_t   m_token[COAP_MAX_TOKEN_LEN];
+  uint8_t   m_tokenLen;
+  uint16_t  m_messageId;
+
+  CoapOptionKV m_options[COAP_MAX_OPTIONS];
+  uint8_t      m_optCount;
+
+  const uint8_t* m_payload;
+  size_t         m_payloadLen;
+
+  bool encodeOption(uint8_t*& p, size_t& remaining, uint16_t& runningDelta,
+                    uint16_t number, const uint8_t* val, uint16_t len);
+};
+
+// Petición precodificada: cabecera + token + opciones + marcador 0xFF se codifican
+// una sola vez; en cada envío sólo se copian y se parchean MID y token, y el
+// payload se escribe directamente detrás.
+class CoapRequestTemplate {
+public:
+  CoapRequestTemplate();
+  // msg aporta tipo, código y opciones; tokenLen es el TKL que se parcheará
+  bool compile(CoapMessage& msg, uint8_t tokenLen);
+
+  // Copia el prefijo en out con MID y token. Devuelve bytes escritos
+  // (incluido el 0xFF final) o 0 si no cabe.
+  size_t instantiate(uint8_t* out, size_t cap, uint16_t mid, const uint8_t* token) const;
+
+  size_t  prefixLength() const { return m_len; }
+  uint8_t tokenLength() const { return m_tokenLen; }
+
+private:
+  uint8_t m_prefix[COAP_TEMPLATE_MAX_LEN];
+  size_t  m_len;
+  uint8_t m_tokenLen;
+};
@@ -1,20 +1,50 @@
-#pragma once
-
-//WiFi Wokwi
-#define WIFI_SSID      "Wokwi-GUEST"
-#define WIFI_PASSWORD  ""
-
-//Servidor CoAP
-#define COAP_SERVER_IP   "192.168.1.100"   // IP DEL SERVIDOR
-#define COAP_SERVER_PORT 5683              // Puerto del servidor CoAP
-
-#define COAP_URI_PATH_1  "sensors"
-#define COAP_URI_PATH_2  "env"
-#define COAP_CONTENT_FORMAT_JSON 50
-
-#define POST_PERIOD_MS       5000   // Enviar cada 5 s
-#define ACK_TIMEOUT_MS       2000
-#define MAX_RETRANSMIT       4
-
-//Identidad del dispositivo
-#define DEVICE_NAME          "esp32-sim"
+#pragma once
+
+//WiFi Wokwi
+#define WIFI_SSID      "Wokwi-GUEST"
+#define WIFI_PASSWORD  ""
+
+//Servidor CoAP
+#define COAP_SERVER_IP   "192.168.1.100"   // IP DEL SERVIDOR
+#define COAP_SERVER_PORT 5683              // Puerto del servidor CoAP
+
+#define COAP_URI_PATH_1  "sensors"
+#define COAP_URI_PATH_2  "env"
+#define COAP_CONTENT_FORMAT_JSON 50
+
+#define POST_PERIOD_MS       5000   // Muestrear cada 5 s (se envía según la política de reporte)
+#define ACK_TIMEOUT_MS       2000
+#define MAX_RETRANSMIT       4
+#define ACK_RANDOM_FACTOR_PCT 150   // RFC 7252: timeout inicial en [ACK_TIMEOUT, ACK_TIMEOUT*1.5]
+#define SEPARATE_TIMEOUT_MS  10000  // espera de respuesta separada tras ACK vacío
+
+//Intercambios simultáneos (NSTART). Con 1 se comporta como stop-and-wait.
+#define COAP_NSTART          4
+//Estimación de RTO tipo CoCoA en lugar del ACK_TIMEOUT fijo (0 = desactivado)
+#define COAP_USE_COCOA       1
+
+//Buffer offline (store-and-forward): las lecturas se encolan y se envían en lotes
+#define OFFLINE_RING_SIZE          64     // lecturas en RAM
+#define OFFLINE_BATCH_MAX          10     // lecturas por POST al vaciar el backlog
+#define OFFLINE_DRAIN_INTERVAL_MS  1000   // separación entre lotes mientras hay backlog
+#define OFFLINE_RETRY_MS           15000  // espera tras un fallo (+ jitter aleatorio de hasta la mitad)
+#define OFFLINE_MAX_AGE_CAP_S      600    // tope al Max-Age de un 5.03 (espera antes de reintentar)
+#define OFFLINE_SPILL_NVS          0      // 1 = volcar a NVS cuando el ring se llena
+#define OFFLINE_NVS_BLOCKS         32     // bloques de OFFLINE_BATCH_MAX lecturas en NVS
+
+//Reporte por excepción: sólo se envía una lectura si t o h se alejan de la
+//última enviada al menos el umbral, o si lleva REPORT_HEARTBEAT_MS sin enviar.
+//Umbrales a 0 = enviar todas las lecturas. Cambiable en marcha con
+//PUT coap://<dispositivo>/config/report {"dt":0.2,"dh":1,"hb":60000}
+#define REPORT_DELTA_T       0.2f   // °C
+#define REPORT_DELTA_H       1.0f   // % HR
+#define REPORT_HEARTBEAT_MS  60000  // máximo silencio (0 = sin latido)
+#define REPORT_CONFIG_PATH   "config/report"
+
+//Puerto UDP local: fijo para poder recibir peticiones (0 = efímero, sin recursos)
+#ifndef COAP_LOCAL_PORT
+#define COAP_LOCAL_PORT      5683
+#endif
+
+//Identidad del dispositivo
+#define DEVICE_NAME          "esp32-sim"
@@ -0,0 +1,37 @@
+#include "JsonWriter.h"
+
+void JsonWriter::_put(char c) {
+  if (_len < _cap) _buf[_len++] = (uint8_t)c;
+  else _ok = false;
+}
+
+JsonWriter& JsonWriter::raw(const char* s) {
+  while (*s) _put(*s++);
+  return *this;
+}
+
+JsonWriter& JsonWriter::u32(uint32_t v) {
+  char tmp[10]; uint8_t n = 0;
+  do { tmp[n++] = (char)('0' + v % 10); v /= 10; } while (v);
+  while (n) _put(tmp[--n]);
+  return *this;
+}
+
+JsonWriter& JsonWriter::fixed(float v, uint8_t decimals) {
+  if (decimals > 6) decimals = 6;
+  uint32_t scale = 1;
+  for (uint8_t i=0; i<decimals; ++i) scale *= 10;
+  // Fuera de rango para entero de 32 bits escalado: no es una lectura válida
+  if (isnan(v) || isinf(v) || fabsf(v) >= 4.0e9f / (float)scale) return raw("null");
+
+  bool neg = v < 0;
+  uint32_t scaled = (uint32_t)((neg ? -v : v) * (float)scale + 0.5f);
+  if (neg && scaled) _put('-');  // sin "-0.00"
+  u32(scaled / scale);
+  if (decimals) {
+    _put('.');
+    uint32_t frac = scaled % scale;
+    for (uint32_t d = scale / 10; d > 0; d /= 10) { _put((char)('0' + frac / d)); frac %= d; }
+  }
+  return *this;
+}
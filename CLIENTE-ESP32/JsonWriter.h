@@ -0,0 +1,25 @@
+#pragma once
+#include <Arduino.h>
+
+// Escritor JSON mínimo sobre un buffer fijo (p. ej. el payload del paquete CoAP).
+// Sin String, sin printf y sin heap. Si algo no cabe, ok() pasa a false.
+class JsonWriter {
+public:
+  JsonWriter(uint8_t* buf, size_t cap) : _buf(buf), _cap(cap), _len(0), _ok(true) {}
+
+  JsonWriter& raw(const char* s);
+  JsonWriter& u32(uint32_t v);
+  // Número con 'decimals' decimales (redondeado); NaN/Inf -> null
+  JsonWriter& fixed(float v, uint8_t decimals);
+
+  bool   ok() const { return _ok; }
+  size_t length() const { return _len; }
+
+private:
+  uint8_t* _buf;
+  size_t   _cap;
+  size_t   _len;
+  bool     _ok;
+
+  void _put(char c);
+};
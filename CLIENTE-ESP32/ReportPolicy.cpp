@@ -0,0 +1,57 @@
+#include "ReportPolicy.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+ReportPolicy::ReportPolicy()
+  : _cfg{ REPORT_DELTA_T, REPORT_DELTA_H, REPORT_HEARTBEAT_MS }, _has(false),
+    _lastT(0), _lastH(0), _lastAt(0), _sent(0), _suppressed(0) {}
+
+bool ReportPolicy::shouldReport(float t, float h, uint32_t now) {
+  bool send = !_has
+           || fabsf(t - _lastT) >= _cfg.deltaT
+           || fabsf(h - _lastH) >= _cfg.deltaH
+           || (_cfg.heartbeatMs && now - _lastAt >= _cfg.heartbeatMs);
+  if (!send) { _suppressed++; return false; }
+  _has = true; _lastT = t; _lastH = h; _lastAt = now;
+  _sent++;
+  return true;
+}
+
+// "key": número en un objeto JSON plano. true si estaba.
+static bool findNumber(const char* js, const char* key, float& out) {
+  char pat[8];
+  snprintf(pat, sizeof(pat), "\"%s\"", key);
+  const char* p = strstr(js, pat);
+  if (!p) return false;
+  p += strlen(pat);
+  while (*p == ' ') p++;
+  if (*p++ != ':') return false;
+  char* end;
+  float v = strtof(p, &end);
+  if (end == p) return false;
+  out = v;
+  return true;
+}
+
+bool ReportPolicy::configure(const uint8_t* json, size_t len) {
+  char buf[96];
+  if (!json || len >= sizeof(buf)) return false;
+  memcpy(buf, json, len);
+  buf[len] = 0;
+
+  ReportConfig c = _cfg;
+  bool any = false;
+  float v;
+  if (findNumber(buf, "dt", v)) { if (v < 0) return false; c.deltaT = v; any = true; }
+  if (findNumber(buf, "dh", v)) { if (v < 0) return false; c.deltaH = v; any = true; }
+  if (findNumber(buf, "hb", v)) { if (v < 0) return false; c.heartbeatMs = (uint32_t)v; any = true; }
+  if (any) _cfg = c;
+  return any;
+}
+
+void ReportPolicy::writeJson(JsonWriter& w) const {
+  w.raw("{\"dt\":").fixed(_cfg.deltaT, 2).raw(",\"dh\":").fixed(_cfg.deltaH, 2)
+   .raw(",\"hb\":").u32(_cfg.heartbeatMs)
+   .raw(",\"sent\":").u32(_sent).raw(",\"suppressed\":").u32(_suppressed).raw("}");
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <Arduino.h>
+#include "Config.h"
+#include "JsonWriter.h"
+
+struct ReportConfig {
+  float    deltaT;        // °C
+  float    deltaH;        // % HR
+  uint32_t heartbeatMs;   // 0 = sin latido
+};
+
+// Reporte por excepción (deadband + latido) alrededor de SensorProvider::read().
+// La referencia es la última lectura *enviada*, no la anterior: una deriva lenta
+// acaba cruzando el umbral y no se pierde ningún cambio significativo.
+class ReportPolicy {
+public:
+  ReportPolicy();
+  void begin(const ReportConfig& c) { _cfg = c; _has = false; }
+
+  // true si hay que enviar esta lectura (y pasa a ser la referencia)
+  bool shouldReport(float t, float h, uint32_t now);
+
+  // Cambio remoto: JSON plano con cualquiera de "dt", "dh", "hb".
+  // false si no trae ninguno o algún valor es negativo (no se cambia nada).
+  bool configure(const uint8_t* json, size_t len);
+  void writeJson(JsonWriter& w) const;
+
+  const ReportConfig& config() const { return _cfg; }
+  uint32_t sent() const { return _sent; }
+  uint32_t suppressed() const { return _suppressed; }
+
+private:
+  ReportConfig _cfg;
+  bool     _has;
+  float    _lastT, _lastH;
+  uint32_t _lastAt;
+  uint32_t _sent, _suppressed;
+};
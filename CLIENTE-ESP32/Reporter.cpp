@@ -0,0 +1,96 @@
+#include "Reporter.h"
+
+Reporter::Reporter() : _coap(nullptr), _backlog(nullptr), _tpl(nullptr), _device(""),
+  _batch(COAP_INVALID_HANDLE), _batchLen(0), _payload(nullptr), _payloadLen(0),
+  _nextDrain(0), _stats() {}
+
+void Reporter::begin(CoapClient& coap, SampleBuffer& backlog, const CoapRequestTemplate& tpl,
+                     const char* device) {
+  _coap = &coap; _backlog = &backlog; _tpl = &tpl; _device = device;
+  _batch = COAP_INVALID_HANDLE;
+  _batchLen = 0;
+  _nextDrain = millis();
+}
+
+static void writeReading(JsonWriter& w, const StoredSample& s) {
+  w.raw("\"t\":").fixed(s.t, 2).raw(",\"h\":").fixed(s.h, 2).raw(",\"ts\":").u32(s.ts);
+}
+
+void Reporter::buildJson(JsonWriter& w, const char* device, const StoredSample* s, size_t n) {
+  w.raw("{\"device\":\"").raw(device).raw("\",");
+  if (n == 1) {
+    writeReading(w, s[0]);
+  } else {
+    w.raw("\"batch\":[");
+    for (size_t i=0; i<n; ++i) {
+      w.raw(i ? ",{" : "{");
+      writeReading(w, s[i]);
+      w.raw("}");
+    }
+    w.raw("]");
+  }
+  w.raw("}");
+}
+
+size_t Reporter::drain(uint32_t now) {
+  if (_batch != COAP_INVALID_HANDLE || _backlog->size() == 0) return 0;
+  if ((int32_t)(now - _nextDrain) < 0) return 0;
+
+  size_t room;
+  uint8_t* payload = _coap->prepare(*_tpl, room);
+  if (!payload) return 0; // ventana llena
+
+  StoredSample batch[OFFLINE_BATCH_MAX];
+  size_t n = _backlog->peek(batch, OFFLINE_BATCH_MAX), len;
+  for (;;) {
+    JsonWriter w(payload, room);
+    buildJson(w, _device, batch, n);
+    if (w.ok()) { len = w.length(); break; }
+    // No cabe en el paquete: se reintenta con la mitad. Si ni una lectura
+    // cabe, se descarta (cuenta en dropped()) para no atascar el backlog
+    if (n == 1) { _coap->cancel(); _backlog->discard(); return 0; }
+    n = _backlog->peek(batch, n / 2);
+  }
+
+  _batch = _coap->commit(len);
+  if (_batch == COAP_INVALID_HANDLE) { _backlog->release(); return 0; }
+  _batchLen = n;
+  _payload = payload; _payloadLen = len;
+  return n;
+}
+
+ReportOutcome Reporter::onResult(CoapHandle h, CoapStatus st, uint8_t code, int32_t maxAge,
+                                 uint32_t now) {
+  if (h == COAP_INVALID_HANDLE || h != _batch) return ReportOutcome::NONE;
+  _batch = COAP_INVALID_HANDLE;
+  uint8_t cls = code >> 5;
+  if (st == CoapStatus::ACKED && cls == 2) {
+    _backlog->drop();
+    _stats.batchesOk++;
+    _stats.readingsOk += (uint32_t)_batchLen;
+    // Con backlog pendiente se vacía a ritmo controlado, no de golpe
+    _nextDrain = _backlog->size() ? now + OFFLINE_DRAIN_INTERVAL_MS : now;
+    return ReportOutcome::DELIVERED;
+  }
+  if (st == CoapStatus::ACKED && cls == 4 && code != (uint8_t)CoapCode::TOO_MANY_REQUESTS_429) {
+    _backlog->discard();
+    _stats.batchesRejected++;
+    _nextDrain = _backlog->size() ? now + OFFLINE_DRAIN_INTERVAL_MS : now;
+    return ReportOutcome::REJECTED;
+  }
+  _backlog->release();
+  if (st == CoapStatus::ACKED && maxAge >= 0) {
+    // Servidor saturado (5.03 con Max-Age): se vuelve cuando dice, con jitter
+    // de hasta la mitad para que la flota no vuelva a la vez
+    uint32_t ms = (uint32_t)(maxAge < OFFLINE_MAX_AGE_CAP_S ? maxAge : OFFLINE_MAX_AGE_CAP_S) * 1000u;
+    _nextDrain = now + ms + (uint32_t)random(0, ms / 2 + 1);
+    _stats.batchesDeferred++;
+    return ReportOutcome::DEFERRED;
+  }
+  // Servidor inalcanzable o error sin Max-Age. Reintento con jitter para que
+  // una flota no reconecte a la vez.
+  _nextDrain = now + OFFLINE_RETRY_MS + (uint32_t)random(0, OFFLINE_RETRY_MS / 2);
+  if (st == CoapStatus::ACKED) _stats.batchesDeferred++;
+  else _stats.batchesFailed++;
+  return st == CoapStatus::ACKED ? ReportOutcome::DEFERRED : ReportOutcome::FAILED;
+}
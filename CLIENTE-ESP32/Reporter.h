@@ -0,0 +1,62 @@
+#pragma once
+#include <Arduino.h>
+#include "Config.h"
+#include "CoapClient.h"
+#include "SampleBuffer.h"
+#include "JsonWriter.h"
+
+// Qué pasó con el lote en vuelo (onResult)
+enum class ReportOutcome : uint8_t {
+  NONE = 0,   // el resultado no era del lote
+  DELIVERED,  // 2.xx: confirmado y quitado del backlog
+  REJECTED,   // 4.xx: quitado y contado en dropped() (reenviarlo daría lo mismo)
+  DEFERRED,   // 5.xx / 4.29: sigue en el backlog; reintento según Max-Age
+  FAILED      // sin respuesta (o RST): sigue en el backlog; reintento con backoff
+};
+
+struct ReporterStats {
+  uint32_t batchesOk, batchesRejected, batchesDeferred, batchesFailed;
+  uint32_t readingsOk;   // sólo las confirmadas con 2.xx
+};
+
+// Vaciado del backlog hacia el servidor: arma cada lote en JSON directamente
+// sobre el POST preparado y decide, según el código de la respuesta, si se
+// confirma, se descarta o se reintenta. Un lote en vuelo como mucho, para
+// conservar el orden y no duplicar. Lo usan el firmware y la flota del host.
+class Reporter {
+public:
+  Reporter();
+  // device debe seguir vivo mientras se use el Reporter (no se copia)
+  void begin(CoapClient& coap, SampleBuffer& backlog, const CoapRequestTemplate& tpl,
+              const char* device);
+
+  // Envía el siguiente lote si no hay otro en vuelo y ya toca. Devuelve las
+  // lecturas enviadas (0 si no se envió nada).
+  size_t drain(uint32_t now);
+  // Llamar desde el CoapResultCallback del cliente
+  ReportOutcome onResult(CoapHandle h, CoapStatus st, uint8_t code, int32_t maxAge, uint32_t now);
+
+  bool       busy() const { return _batch != COAP_INVALID_HANDLE; }
+  size_t     batchLen() const { return _batchLen; }
+  // JSON del último lote enviado (válido mientras siga en vuelo)
+  const char* payload(size_t& len) const { len = _payloadLen; return (const char*)_payload; }
+  // Próximo envío permitido: tras un fallo o un 5.03, cuándo se reintenta
+  uint32_t   nextDrain() const { return _nextDrain; }
+  const ReporterStats& stats() const { return _stats; }
+
+  // Una lectura: {"device","t","h","ts"}; varias:
+  // {"device":..,"batch":[{"t","h","ts"},...]}
+  static void buildJson(JsonWriter& w, const char* device, const StoredSample* s, size_t n);
+
+private:
+  CoapClient*                _coap;
+  SampleBuffer*              _backlog;
+  const CoapRequestTemplate* _tpl;
+  const char*                _device;
+  CoapHandle     _batch;
+  size_t         _batchLen;
+  const uint8_t* _payload;
+  size_t         _payloadLen;
+  uint32_t       _nextDrain;
+  ReporterStats  _stats;
+};
@@ -0,0 +1,162 @@
+#include "SampleBuffer.h"
+
+SampleBuffer::SampleBuffer() : _head(0), _count(0), _inflight(0), _dropped(0)
+#if OFFLINE_SPILL_NVS
+  , _spillHead(0), _spillCount(0), _spillOff(0), _peekedNvs(0), _older(0)
+#endif
+{}
+
+void SampleBuffer::begin() {
+#if OFFLINE_SPILL_NVS
+  // Los bloques sobreviven a un reinicio: recuperar dónde quedó la cola
+  _nvs.begin("offline", false);
+  _spillHead  = _nvs.getUShort("head", 0);
+  _spillCount = _nvs.getUShort("cnt", 0);
+  _spillOff   = _nvs.getUShort("off", 0);
+  if (_spillHead >= OFFLINE_NVS_BLOCKS || _spillCount > OFFLINE_NVS_BLOCKS ||
+      _spillOff >= OFFLINE_BATCH_MAX || (!_spillCount && _spillOff)) {
+    _spillHead = 0; _spillCount = 0; _spillOff = 0; _saveMeta();
+  }
+#endif
+}
+
+void SampleBuffer::push(const StoredSample& s) {
+  if (_count == OFFLINE_RING_SIZE) {
+#if OFFLINE_SPILL_NVS
+    _spillOldest();
+#else
+    // Sin NVS: se pierde la más antigua que no esté en vuelo
+    _evictAfterPinned(1);
+    _dropped++;
+#endif
+  }
+  _ring[(_head + _count) % OFFLINE_RING_SIZE] = s;
+  _count++;
+}
+
+// Cabeza del ring que no se puede desalojar ni volcar: el lote en vuelo y,
+// con NVS, las lecturas que quedaron por delante de lo volcado
+size_t SampleBuffer::_pinned() const {
+#if OFFLINE_SPILL_NVS
+  if (_older > _inflight) return _older;
+#endif
+  return _inflight;
+}
+
+// Quita las k lecturas que siguen a la cabeza fijada: ésta se corre k
+// posiciones hacia delante para seguir siendo la cabeza (como mucho un lote)
+void SampleBuffer::_evictAfterPinned(size_t k) {
+  for (size_t i=_pinned(); i-- > 0; )
+    _ring[(_head + i + k) % OFFLINE_RING_SIZE] = _ring[(_head + i) % OFFLINE_RING_SIZE];
+  _head = (_head + k) % OFFLINE_RING_SIZE;
+  _count -= k;
+}
+
+size_t SampleBuffer::peek(StoredSample* out, size_t max) {
+  _inflight = 0;
+#if OFFLINE_SPILL_NVS
+  _peekedNvs = 0;
+  if (_spillCount > 0 && !_older) {
+    // Lo volcado a NVS es más antiguo que lo que hay en RAM. Del bloque más
+    // antiguo se salta lo ya confirmado por lotes más pequeños
+    char key[8]; snprintf(key, sizeof(key), "b%u", _spillHead);
+    StoredSample blk[OFFLINE_BATCH_MAX];
+    size_t got = _nvs.getBytes(key, blk, sizeof(blk)) / sizeof(StoredSample);
+    size_t left = got > _spillOff ? got - _spillOff : 0;
+    size_t n = left < max ? left : max;
+    memcpy(out, blk + _spillOff, n * sizeof(StoredSample));
+    _peekedNvs = n;
+    return n;
+  }
+#endif
+  size_t n = _count < max ? _count : max;
+#if OFFLINE_SPILL_NVS
+  if (_older && n > _older) n = _older;   // no adelantar a lo que hay en NVS
+#endif
+  for (size_t i=0; i<n; ++i) out[i] = _ring[(_head + i) % OFFLINE_RING_SIZE];
+  _inflight = n;
+  return n;
+}
+
+void SampleBuffer::drop() {
+#if OFFLINE_SPILL_NVS
+  if (_peekedNvs) {
+    // El bloque NVS se libera cuando se ha confirmado entero
+    _spillOff = (uint16_t)(_spillOff + _peekedNvs);
+    _peekedNvs = 0;
+    if (_spillOff >= OFFLINE_BATCH_MAX) {
+      _spillHead = (uint16_t)((_spillHead + 1) % OFFLINE_NVS_BLOCKS);
+      _spillCount--;
+      _spillOff = 0;
+    }
+    _saveMeta();
+    return;
+  }
+#endif
+  _head = (_head + _inflight) % OFFLINE_RING_SIZE;
+  _count -= _inflight;
+#if OFFLINE_SPILL_NVS
+  _older = _older > _inflight ? _older - _inflight : 0;
+#endif
+  _inflight = 0;
+}
+
+void SampleBuffer::discard() {
+#if OFFLINE_SPILL_NVS
+  _dropped += (uint32_t)(_peekedNvs ? _peekedNvs : _inflight);
+#else
+  _dropped += (uint32_t)_inflight;
+#endif
+  drop();
+}
+
+void SampleBuffer::release() {
+  _inflight = 0;
+#if OFFLINE_SPILL_NVS
+  _peekedNvs = 0;
+#endif
+}
+
+size_t SampleBuffer::size() const {
+#if OFFLINE_SPILL_NVS
+  return _count + (size_t)_spillCount * OFFLINE_BATCH_MAX - _spillOff;
+#else
+  return _count;
+#endif
+}
+
+#if OFFLINE_SPILL_NVS
+void SampleBuffer::_spillOldest() {
+  if (_spillCount == OFFLINE_NVS_BLOCKS) {
+    if (_peekedNvs) {
+      // El bloque NVS más antiguo está en vuelo: se pierde el de RAM en su lugar
+      _evictAfterPinned(OFFLINE_BATCH_MAX);
+      _dropped += OFFLINE_BATCH_MAX;
+      return;
+    }
+    // NVS también lleno: se descarta el bloque más antiguo (lo que quede de él)
+    _spillHead = (uint16_t)((_spillHead + 1) % OFFLINE_NVS_BLOCKS);
+    _spillCount--;
+    _dropped += OFFLINE_BATCH_MAX - _spillOff;
+    _spillOff = 0;
+  }
+  // Se vuelca el bloque que sigue a la cabeza fijada. Si NVS estaba vacío,
+  // ésta pasa a ser más antigua que todo lo volcado y peek() la sirve antes
+  size_t pin = _pinned();
+  if (_spillCount == 0) _older = pin;
+  StoredSample blk[OFFLINE_BATCH_MAX];
+  for (size_t i=0; i<OFFLINE_BATCH_MAX; ++i) blk[i] = _ring[(_head + pin + i) % OFFLINE_RING_SIZE];
+  char key[8];
+  snprintf(key, sizeof(key), "b%u", (unsigned)((_spillHead + _spillCount) % OFFLINE_NVS_BLOCKS));
+  _nvs.putBytes(key, blk, sizeof(blk));
+  _spillCount++;
+  _saveMeta();
+  _evictAfterPinned(OFFLINE_BATCH_MAX);
+}
+
+void SampleBuffer::_saveMeta() {
+  _nvs.putUShort("head", _spillHead);
+  _nvs.putUShort("cnt", _spillCount);
+  _nvs.putUShort("off", _spillOff);
+}
+#endif
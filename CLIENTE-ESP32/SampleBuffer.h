@@ -0,0 +1,64 @@
+#pragma once
+#include <Arduino.h>
+#include "Config.h"
+#if OFFLINE_SPILL_NVS
+#include <Preferences.h>
+#endif
+
+static_assert(OFFLINE_RING_SIZE > OFFLINE_BATCH_MAX, "el ring debe admitir un lote en vuelo y algo más");
+#if OFFLINE_SPILL_NVS
+// Al volcar con un lote en vuelo se vuelca el bloque siguiente
+static_assert(OFFLINE_RING_SIZE >= 2 * OFFLINE_BATCH_MAX, "el ring debe admitir un lote en vuelo y otro a volcar");
+#endif
+
+// Lectura compacta para el buffer offline (sin String: nada en el heap)
+struct StoredSample {
+  float    t;
+  float    h;
+  uint32_t ts;
+};
+
+// Ring fijo en RAM para store-and-forward. Con OFFLINE_SPILL_NVS, cuando el
+// ring se llena las lecturas más antiguas se vuelcan a NVS en bloques de
+// OFFLINE_BATCH_MAX en vez de descartarse; se vacían primero (orden FIFO).
+class SampleBuffer {
+public:
+  SampleBuffer();
+  void begin();
+
+  // Con el ring lleno se pierde (o se vuelca) la más antigua que no esté en vuelo
+  void   push(const StoredSample& s);
+  // Copia hasta max lecturas (las más antiguas) sin quitarlas y las marca en
+  // vuelo: push() ya no las desaloja ni las vuelca. Devuelve cuántas.
+  size_t peek(StoredSample* out, size_t max);
+  // Quita exactamente las lecturas del último peek() (ya confirmadas)
+  void   drop();
+  // El servidor rechazó el lote (4.xx): se quitan como drop(), pero cuentan
+  // como perdidas en dropped()
+  void   discard();
+  // El envío falló: siguen en cola, pero dejan de estar protegidas
+  void   release();
+
+  size_t   size() const;     // RAM + NVS
+  uint32_t dropped() const { return _dropped; }
+
+private:
+  StoredSample _ring[OFFLINE_RING_SIZE];
+  size_t   _head;     // índice de la más antigua
+  size_t   _count;
+  size_t   _inflight; // las primeras _inflight del ring están en vuelo
+  uint32_t _dropped;
+  size_t _pinned() const;
+  void   _evictAfterPinned(size_t k);
+
+#if OFFLINE_SPILL_NVS
+  Preferences _nvs;
+  uint16_t _spillHead;   // bloque NVS más antiguo
+  uint16_t _spillCount;  // bloques ocupados
+  uint16_t _spillOff;    // lecturas ya confirmadas del bloque más antiguo
+  size_t   _peekedNvs;   // lecturas del último peek() servidas de NVS (0 = de RAM)
+  size_t   _older;       // lecturas de la cabeza del ring más antiguas que NVS
+  void _spillOldest();
+  void _saveMeta();
+#endif
+};
@@ -1,7 +1,8 @@
 #include "SensorProvider.h"
 
-void SensorProvider::begin(const String& deviceName) {
-  _device = deviceName;
+void SensorProvider::begin(const char* deviceName) {
+  strncpy(_device, deviceName, sizeof(_device) - 1);
+  _device[sizeof(_device) - 1] = 0;
 #ifdef USE_DHT22
   _dht.begin();
 #endif
@@ -12,16 +12,17 @@ struct EnvSample {
   float temperatureC;
   float humidity;
   uint32_t ts;
-  String device;
+  const char* device;   // apunta al id de SensorProvider: leer no toca el heap
 };
 
 class SensorProvider {
 public:
-  void begin(const String& deviceName);
+  void begin(const char* deviceName);   // se copia (hasta DEVICE_ID_MAX-1)
   EnvSample read();
 
 private:
-  String _device;
+  static const size_t DEVICE_ID_MAX = 32;
+  char _device[DEVICE_ID_MAX] = "";
 #ifdef USE_DHT22
   DHT _dht = DHT(DHT_PIN, DHT_TYPE);
 #endif
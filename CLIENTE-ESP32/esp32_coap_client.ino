@@ -1,73 +1,139 @@
-#include <WiFi.h>
-#include "Config.h"
-#include "CoapClient.h"
-#include "SensorProvider.h"
-
-CoapClient      coap;
-SensorProvider  sensors;
-
-uint32_t lastPost = 0;
-
-void connectWiFi() {
-  Serial.printf("[WiFi] Conectando a '%s'...\n", WIFI_SSID);
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-  uint32_t t0 = millis();
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(300);
-    Serial.print(".");
-    if (millis() - t0 > 20000) {
-      Serial.println("\n[WiFi] Timeout. Reintentando...");
-      t0 = millis();
-    }
-  }
-  Serial.printf("\n[WiFi] OK. IP: %s\n", WiFi.localIP().toString().c_str());
-}
-
-String buildJson(const EnvSample& s) {
-  // JSON compacto
-  String j = "{";
-  j += "\"device\":\"" + s.device + "\",";
-  j += "\"t\":" + String(s.temperatureC, 2) + ",";
-  j += "\"h\":" + String(s.humidity, 2) + ",";
-  j += "\"ts\":" + String(s.ts);
-  j += "}";
-  return j;
-}
-
-void setup() {
-  Serial.begin(115200);
-  delay(200);
-  Serial.println("\n==== ESP32 CoAP Client (Wokwi) ====");
-
-  connectWiFi();
-
-  sensors.begin(DEVICE_NAME);
-  coap.begin(COAP_SERVER_IP, COAP_SERVER_PORT);
-
-  Serial.printf("[CoAP] Enviará POST a coap://%s:%u/%s/%s cada %ums\n",
-    COAP_SERVER_IP, COAP_SERVER_PORT, COAP_URI_PATH_1, COAP_URI_PATH_2, POST_PERIOD_MS);
-}
-
-void loop() {
-  if (millis() - lastPost >= POST_PERIOD_MS) {
-    lastPost = millis();
-
-    EnvSample s = sensors.read();
-    String json = buildJson(s);
-    Serial.printf("[CoAP] POST -> %s/%s : %s\n", COAP_URI_PATH_1, COAP_URI_PATH_2, json.c_str());
-
-    bool ok = coap.postJson(COAP_URI_PATH_1, COAP_URI_PATH_2,
-                            (const uint8_t*)json.c_str(), json.length(),
-                            ACK_TIMEOUT_MS, MAX_RETRANSMIT);
-
-    if (ok) {
-      Serial.println("[CoAP] ACK recibido ✔");
-    } else {
-      Serial.println("[CoAP] Sin ACK tras reintentos ✖");
-    }
-  }
-
-
-  delay(10);
-}
+#include <WiFi.h>
+#include "Config.h"
+#include "CoapClient.h"
+#include "SensorProvider.h"
+#include "SampleBuffer.h"
+#include "JsonWriter.h"
+#include "ReportPolicy.h"
+#include "Reporter.h"
+
+CoapClient      coap;
+SensorProvider  sensors;
+SampleBuffer    backlog;
+ReportPolicy    policy;
+Reporter        reporter;     // vacía el backlog en lotes (uno en vuelo)
+
+uint32_t lastPost = 0;
+
+// POST CON /sensors/env con Content-Format JSON, codificado una vez en setup()
+CoapRequestTemplate postTpl;
+
+void connectWiFi() {
+  Serial.printf("[WiFi] Conectando a '%s'...\n", WIFI_SSID);
+  WiFi.mode(WIFI_STA);
+  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+  uint32_t t0 = millis();
+  while (WiFi.status() != WL_CONNECTED) {
+    delay(300);
+    Serial.print(".");
+    if (millis() - t0 > 20000) {
+      Serial.println("\n[WiFi] Timeout. Reintentando...");
+      t0 = millis();
+    }
+  }
+  Serial.printf("\n[WiFi] OK. IP: %s\n", WiFi.localIP().toString().c_str());
+}
+
+// Envía el siguiente lote del backlog si no hay otro en vuelo y ya toca
+void drainBacklog(uint32_t now) {
+  size_t n = reporter.drain(now);
+  if (!n) return;
+  size_t len;
+  const char* json = reporter.payload(len);
+  Serial.printf("[CoAP] POST -> %s/%s (%u lecturas, backlog=%u) : %.*s\n",
+                COAP_URI_PATH_1, COAP_URI_PATH_2, (unsigned)n, (unsigned)backlog.size(),
+                (int)len, json);
+}
+
+void onCoapResult(CoapHandle h, CoapStatus st, uint8_t code, int32_t maxAge, void*) {
+  size_t n = reporter.batchLen();
+  uint32_t now = millis();
+  switch (reporter.onResult(h, st, code, maxAge, now)) {
+  case ReportOutcome::DELIVERED:
+    Serial.printf("[CoAP] #%u ACK recibido ✔ (%u.%02u, RTO=%ums)\n",
+                  h, code >> 5, code & 0x1F, coap.stats().rtoMs);
+    break;
+  case ReportOutcome::REJECTED:
+    Serial.printf("[CoAP] #%u Rechazado ✖ (%u.%02u): %u lecturas perdidas\n",
+                  h, code >> 5, code & 0x1F, (unsigned)n);
+    break;
+  case ReportOutcome::DEFERRED:
+    Serial.printf("[CoAP] #%u Servidor ocupado (%u.%02u), reintento en %ums (backlog=%u)\n",
+                  h, code >> 5, code & 0x1F, (unsigned)(reporter.nextDrain() - now),
+                  (unsigned)backlog.size());
+    break;
+  case ReportOutcome::FAILED:
+    // Servidor inalcanzable: las lecturas siguen en el backlog
+    Serial.printf("[CoAP] #%u Sin ACK tras reintentos ✖ (backlog=%u)\n",
+                  h, (unsigned)backlog.size());
+    break;
+  case ReportOutcome::NONE:
+    break;
+  }
+}
+
+// Recurso /config/report: GET devuelve la política y sus contadores, PUT la cambia
+uint8_t onCoapRequest(uint8_t method, const char* path, const uint8_t* payload, size_t len,
+                      uint8_t* resp, size_t cap, size_t& respLen, void*) {
+  if (strcmp(path, REPORT_CONFIG_PATH) != 0) return (uint8_t)CoapCode::NOT_FOUND_404;
+  if (method == (uint8_t)CoapCode::PUT) {
+    if (!policy.configure(payload, len)) return (uint8_t)CoapCode::BAD_REQUEST_400;
+    const ReportConfig& c = policy.config();
+    Serial.printf("[Report] Nueva política: dt=%.2f dh=%.2f hb=%ums\n", c.deltaT, c.deltaH, c.heartbeatMs);
+  } else if (method != (uint8_t)CoapCode::GET) {
+    return (uint8_t)CoapCode::METHOD_NOT_ALLOWED_405;
+  }
+  JsonWriter w(resp, cap);
+  policy.writeJson(w);
+  respLen = w.ok() ? w.length() : 0;
+  return method == (uint8_t)CoapCode::PUT ? (uint8_t)CoapCode::CHANGED_204 : (uint8_t)CoapCode::CONTENT_205;
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(200);
+  Serial.println("\n==== ESP32 CoAP Client (Wokwi) ====");
+
+  connectWiFi();
+
+  sensors.begin(DEVICE_NAME);
+  backlog.begin();
+  coap.begin(COAP_SERVER_IP, COAP_SERVER_PORT);
+  coap.onResult(onCoapResult);
+  coap.onRequest(onCoapRequest);
+  policy.begin({ REPORT_DELTA_T, REPORT_DELTA_H, REPORT_HEARTBEAT_MS });
+
+  CoapMessage m;
+  uint8_t cf = COAP_CONTENT_FORMAT_JSON;
+  m.begin(CoapType::CON, CoapCode::POST);
+  m.addOption(OPT_URI_PATH, (const uint8_t*)COAP_URI_PATH_1, strlen(COAP_URI_PATH_1));
+  m.addOption(OPT_URI_PATH, (const uint8_t*)COAP_URI_PATH_2, strlen(COAP_URI_PATH_2));
+  m.addOption(OPT_CONTENT_FORMAT, &cf, 1);
+  postTpl.compile(m, COAP_CLIENT_TOKEN_LEN);
+  reporter.begin(coap, backlog, postTpl, DEVICE_NAME);
+
+  Serial.printf("[CoAP] Muestreo cada %ums; POST a coap://%s:%u/%s/%s si |dt|>=%.2f, |dh|>=%.2f o tras %ums\n",
+    POST_PERIOD_MS, COAP_SERVER_IP, COAP_SERVER_PORT, COAP_URI_PATH_1, COAP_URI_PATH_2,
+    REPORT_DELTA_T, REPORT_DELTA_H, REPORT_HEARTBEAT_MS);
+}
+
+void loop() {
+  uint32_t now = millis();
+  if (now - lastPost >= POST_PERIOD_MS) {
+    // Periodo fijo basado en millis(): se avanza la referencia en vez de tomar
+    // millis(), así el muestreo no deriva. Si se perdió más de un periodo, resincroniza.
+    lastPost += POST_PERIOD_MS;
+    if (now - lastPost >= POST_PERIOD_MS) lastPost = now;
+
+    // Sólo las lecturas que cambian lo bastante (o el latido) pasan al backlog;
+    // sin caídas se envían enseguida, solas
+    EnvSample s = sensors.read();
+    if (policy.shouldReport(s.temperatureC, s.humidity, now))
+      backlog.push({ s.temperatureC, s.humidity, s.ts });
+  }
+
+  // No bloquea: el resultado llega a onCoapResult() desde poll()
+  drainBacklog(now);
+  coap.poll();
+  delay(1);
+}
@@ -0,0 +1,52 @@
+#pragma once
+// Shim mínimo de Arduino para compilar la librería del cliente en Linux.
+// Sólo lo que usan CoapClient, CoapMessage, JsonWriter, ReportPolicy,
+// Reporter, SampleBuffer y SensorProvider; el .ino no se compila en host.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "host.h"
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+// Como el String de Arduino: buffer propio en el heap (malloc/realloc), así
+// las copias que hace la librería aparecen en las cuentas de host_heap().
+class String {
+public:
+  String(const char* s = "");
+  String(const String& o);
+  String& operator=(const String& o);
+  ~String();
+
+  const char* c_str() const { return _buf ? _buf : ""; }
+  size_t length() const { return _len; }
+  bool operator==(const char* s) const { return strcmp(c_str(), s) == 0; }
+  String& operator+=(const char* s);
+
+private:
+  char*  _buf;
+  size_t _len;
+  void _set(const char* s, size_t n);
+};
+
+// IPv4 en orden de red, como sockaddr_in
+class IPAddress {
+public:
+  IPAddress() : _addr(0) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+  bool fromString(const char* s);
+  String toString() const;
+  uint32_t raw() const { return _addr; }
+  static IPAddress fromRaw(uint32_t a) { IPAddress ip; ip._addr = a; return ip; }
+
+private:
+  uint32_t _addr;
+};
@@ -0,0 +1,13 @@
+#pragma once
+// Sin sensor en host: las lecturas son NaN y SensorProvider usa su señal sintética
+#include <Arduino.h>
+
+#define DHT22 22
+
+class DHT {
+public:
+  DHT(uint8_t pin, uint8_t type) { (void)pin; (void)type; }
+  void  begin() {}
+  float readTemperature() { return NAN; }
+  float readHumidity() { return NAN; }
+};
@@ -0,0 +1,38 @@
+#pragma once
+// WiFiUDP sobre un socket UDP POSIX no bloqueante. Todo lo que sale pasa por
+// el emulador de enlace (pérdidas y retardo, ver host.h).
+#include <Arduino.h>
+#include <netinet/in.h>
+
+class WiFiUDP {
+public:
+  WiFiUDP();
+  ~WiFiUDP();
+  uint8_t begin(uint16_t port);   // 0 = puerto efímero
+  void    stop();
+
+  int    beginPacket(IPAddress ip, uint16_t port);
+  size_t write(const uint8_t* buf, size_t n);
+  size_t write(uint8_t b) { return write(&b, 1); }
+  int    endPacket();
+
+  int       parsePacket();        // tamaño del siguiente datagrama o 0
+  int       read(uint8_t* buf, size_t n);
+  int       available() const { return _rxLen - _rxPos; }
+  IPAddress remoteIP() const { return IPAddress::fromRaw(_rxFrom.sin_addr.s_addr); }
+  uint16_t  remotePort() const { return ntohs(_rxFrom.sin_port); }
+
+  // Para host_udp_wait(): marca el socket como legible
+  int  fd() const { return _fd; }
+  void markReadable() { _readable = true; }
+
+private:
+  int         _fd;
+  bool        _readable;
+  sockaddr_in _txTo;
+  uint8_t     _tx[1500];
+  size_t      _txLen;
+  sockaddr_in _rxFrom;
+  uint8_t     _rx[1500];
+  int         _rxLen, _rxPos;
+};
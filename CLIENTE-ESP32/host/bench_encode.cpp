@@ -0,0 +1,136 @@
+// bench_encode.cpp — Coste de codificación y uso de heap de la librería del cliente.
+//   esp32_bench [-n ITER]
+// Cada caso se repite ITER veces con el reloj en modo manual (sin esperas) y
+// se informa ns/op, operaciones/s y reservas de heap por operación.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "CoapClient.h"
+#include "SensorProvider.h"
+#include "ReportPolicy.h"
+#include "JsonWriter.h"
+
+static volatile size_t sink;   // que el compilador no se salte los bucles
+
+static double now_s() {
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+typedef void (*case_fn)(long i);
+
+static void run(const char* name, case_fn fn, long iters) {
+  fn(0);   // calentamiento (y reservas perezosas fuera de la cuenta)
+  host_heap_reset_peak();
+  HostHeap h0 = host_heap();
+  double t0 = now_s();
+  for (long i = 0; i < iters; ++i) fn(i);
+  double dt = now_s() - t0;
+  const HostHeap& h1 = host_heap();
+  printf("%-34s %9.1f ns/op %10.0f op/s %6.2f alloc/op %7lld B pico\n",
+         name, dt * 1e9 / (double)iters, (double)iters / dt,
+         (double)(h1.allocs - h0.allocs) / (double)iters, (long long)(h1.peak - h0.live));
+}
+
+// ---------------------------------------------------------------- casos
+
+static uint8_t out[COAP_MAX_MSG_LEN];
+static const uint8_t token[4] = { 0xde, 0xad, 0xbe, 0xef };
+static uint8_t cf = COAP_CONTENT_FORMAT_JSON;
+static const char json[] = "{\"device\":\"esp32-sim\",\"t\":24.13,\"h\":51.20,\"ts\":123456}";
+
+static void c_message_build(long i) {
+  CoapMessage m;
+  m.begin(CoapType::CON, CoapCode::POST);
+  m.setMessageId((uint16_t)i);
+  m.setToken(token, sizeof token);
+  m.addOption(OPT_URI_PATH, (const uint8_t*)COAP_URI_PATH_1, strlen(COAP_URI_PATH_1));
+  m.addOption(OPT_URI_PATH, (const uint8_t*)COAP_URI_PATH_2, strlen(COAP_URI_PATH_2));
+  m.addOption(OPT_CONTENT_FORMAT, &cf, 1);
+  m.setPayload((const uint8_t*)json, sizeof json - 1);
+  sink = m.build(out, sizeof out);
+}
+
+static CoapRequestTemplate tpl;
+
+static void c_template_json(long i) {
+  size_t n = tpl.instantiate(out, sizeof out, (uint16_t)i, token);
+  JsonWriter w(out + n, sizeof out - n);
+  w.raw("{\"device\":\"" DEVICE_NAME "\",\"t\":").fixed(24.0f + (float)(i & 255) / 100.0f, 2)
+   .raw(",\"h\":").fixed(51.2f, 2).raw(",\"ts\":").u32((uint32_t)i).raw("}");
+  sink = n + w.length();
+}
+
+static SensorProvider sensors;
+
+static void c_sensor_read(long i) {
+  (void)i;
+  host_clock_advance(POST_PERIOD_MS);
+  EnvSample s = sensors.read();
+  sink = (size_t)s.device[0];
+}
+
+static ReportPolicy policy;
+
+static void c_policy(long i) {
+  float t = 24.0f + 2.0f * sinf((float)i / 500.0f);
+  sink = policy.shouldReport(t, 50.0f, (uint32_t)i * POST_PERIOD_MS);
+}
+
+// Camino completo del firmware: prepare + JSON + commit (envío real por UDP con
+// el enlace al 100 % de pérdidas) + poll. Sin retransmisiones: al llenarse la
+// ventana se adelanta el reloj y poll() da los intercambios por fallidos.
+static CoapClient client;
+
+static void c_client_submit(long i) {
+  size_t room;
+  uint8_t* p = client.prepare(tpl, room);
+  if (!p) {
+    host_clock_advance(60000);
+    client.poll();
+    p = client.prepare(tpl, room);
+  }
+  JsonWriter w(p, room);
+  w.raw("{\"device\":\"" DEVICE_NAME "\",\"t\":").fixed(24.13f, 2)
+   .raw(",\"h\":").fixed(51.2f, 2).raw(",\"ts\":").u32((uint32_t)i).raw("}");
+  sink = client.commit(w.length(), 0, 0);
+  client.poll();
+}
+
+int main(int argc, char** argv) {
+  long iters = 1000000;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) iters = atol(argv[++i]);
+    else { fprintf(stderr, "Uso: %s [-n ITER]\n", argv[0]); return 2; }
+  }
+  host_clock_manual(0);
+
+  CoapMessage m;
+  m.begin(CoapType::CON, CoapCode::POST);
+  m.addOption(OPT_URI_PATH, (const uint8_t*)COAP_URI_PATH_1, strlen(COAP_URI_PATH_1));
+  m.addOption(OPT_URI_PATH, (const uint8_t*)COAP_URI_PATH_2, strlen(COAP_URI_PATH_2));
+  m.addOption(OPT_CONTENT_FORMAT, &cf, 1);
+  tpl.compile(m, COAP_CLIENT_TOKEN_LEN);
+  sensors.begin(DEVICE_NAME);
+  policy.begin({ REPORT_DELTA_T, REPORT_DELTA_H, REPORT_HEARTBEAT_MS });
+
+  printf("sizeof: CoapClient=%zu CoapExchange=%zu CoapMessage=%zu CoapRequestTemplate=%zu\n",
+         sizeof(CoapClient), sizeof(CoapExchange), sizeof(CoapMessage), sizeof(CoapRequestTemplate));
+  printf("iteraciones: %ld\n", iters);
+
+  run("CoapMessage::build", c_message_build, iters);
+  run("plantilla + JsonWriter", c_template_json, iters);
+  run("SensorProvider::read", c_sensor_read, iters);
+  run("ReportPolicy::shouldReport", c_policy, iters);
+
+  HostLink drop = { 1.0, 0, 0 };
+  host_link_set(drop);
+  client.begin("127.0.0.1", 9);
+  run("CoapClient prepare+commit+poll", c_client_submit, iters);
+  const CoapClientStats& st = client.stats();
+  printf("cliente: %u enviados, %u fallidos\n", st.sent, st.failed);
+  printf("enlace: %llu descartados, %llu enviados\n",
+         (unsigned long long)host_link_stats().dropped, (unsigned long long)host_link_stats().sent);
+  return 0;
+}
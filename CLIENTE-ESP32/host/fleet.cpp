@@ -0,0 +1,181 @@
+// fleet.cpp — Flota de clientes simulados contra el servidor local.
+//   esp32_fleet [-n N] [-s IP] [-p PORT] [-t SEG] [-x VELOCIDAD]
+//               [--loss P] [--delay MS] [--jitter MS] [--all]
+// Cada dispositivo tiene su CoapClient (socket propio), ReportPolicy,
+// SampleBuffer y Reporter, con el mismo ciclo que el .ino: muestrear cada
+// POST_PERIOD_MS, filtrar por la política, encolar y vaciar el backlog en
+// lotes con el mismo Reporter del firmware. Sólo cuenta como entregado lo
+// confirmado con 2.xx. Todo en un hilo; el reloj simulado corre VELOCIDAD
+// veces más rápido que el real.
+// Servidor: ./server PORT server.log, sin --rate (el limitador por IP agruparía
+// a toda la flota, que sale de 127.0.0.1).
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "CoapClient.h"
+#include "SampleBuffer.h"
+#include "ReportPolicy.h"
+#include "Reporter.h"
+
+static CoapRequestTemplate postTpl;
+
+struct Device {
+  CoapClient   coap;
+  SampleBuffer backlog;
+  ReportPolicy policy;
+  Reporter     reporter;
+  char         name[16];
+  float        phase;       // desfase de la señal, por dispositivo
+  uint32_t     lastPost;
+  uint32_t     samples;
+
+  void begin(uint32_t i, const char* ip, uint16_t port, bool all, uint32_t now);
+  void loop(uint32_t now, bool sampling);
+  bool idle() const { return coap.inFlight() == 0 && backlog.size() == 0; }
+};
+
+static void onResult(CoapHandle h, CoapStatus st, uint8_t code, int32_t maxAge, void* ctx) {
+  ((Device*)ctx)->reporter.onResult(h, st, code, maxAge, millis());
+}
+
+void Device::begin(uint32_t i, const char* ip, uint16_t port, bool all, uint32_t now) {
+  snprintf(name, sizeof name, "esp32-%04u", (unsigned)i);
+  phase = (float)random(0, 62832) / 10000.0f;
+  // Arranques repartidos en un periodo: una flota real no muestrea a la vez
+  lastPost = now - (uint32_t)random(0, POST_PERIOD_MS);
+  samples = 0;
+  backlog.begin();
+  coap.begin(ip, port);
+  coap.onResult(onResult, this);
+  reporter.begin(coap, backlog, postTpl, name);
+  if (all) policy.begin({ 0, 0, 0 });
+  else     policy.begin({ REPORT_DELTA_T, REPORT_DELTA_H, REPORT_HEARTBEAT_MS });
+}
+
+void Device::loop(uint32_t now, bool sampling) {
+  if (sampling && now - lastPost >= POST_PERIOD_MS) {
+    lastPost += POST_PERIOD_MS;
+    if (now - lastPost >= POST_PERIOD_MS) lastPost = now;
+    // Deriva lenta + ruido de cuantización del DHT22 (0.1 °C / 0.1 %)
+    float x = (float)now / 600000.0f + phase;
+    float t = 24.0f + 2.0f * sinf(x) + 0.1f * (float)random(-1, 2);
+    float h = 50.0f + 5.0f * cosf(x * 0.9f) + 0.1f * (float)random(-1, 2);
+    samples++;
+    if (policy.shouldReport(t, h, now)) backlog.push({ t, h, now });
+  }
+  reporter.drain(now);
+  coap.poll();
+}
+
+static double now_s() {
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void usage(const char* p) {
+  fprintf(stderr,
+    "Uso: %s [-n N] [-s IP] [-p PORT] [-t SEG] [-x VELOCIDAD]\n"
+    "          [--loss P] [--delay MS] [--jitter MS] [--all]\n"
+    "  -t       duración simulada del muestreo (120 s)\n"
+    "  -x       reloj simulado / real (10)\n"
+    "  --all    sin reporte por excepción: se envían todas las lecturas\n", p);
+}
+
+int main(int argc, char** argv) {
+  uint32_t n = 1000, secs = 120;
+  const char* ip = "127.0.0.1";
+  uint16_t port = COAP_SERVER_PORT;
+  double speed = 10;
+  HostLink link = { 0, 0, 0 };
+  bool all = false;
+  for (int i = 1; i < argc; ++i) {
+    const char* a = argv[i];
+    bool v = i + 1 < argc;
+    if      (!strcmp(a, "-n") && v)       n = (uint32_t)atol(argv[++i]);
+    else if (!strcmp(a, "-s") && v)       ip = argv[++i];
+    else if (!strcmp(a, "-p") && v)       port = (uint16_t)atoi(argv[++i]);
+    else if (!strcmp(a, "-t") && v)       secs = (uint32_t)atol(argv[++i]);
+    else if (!strcmp(a, "-x") && v)       speed = atof(argv[++i]);
+    else if (!strcmp(a, "--loss") && v)   link.loss = atof(argv[++i]);
+    else if (!strcmp(a, "--delay") && v)  link.delayMs = (uint32_t)atol(argv[++i]);
+    else if (!strcmp(a, "--jitter") && v) link.jitterMs = (uint32_t)atol(argv[++i]);
+    else if (!strcmp(a, "--all"))         all = true;
+    else { usage(argv[0]); return 2; }
+  }
+  if (!n || speed <= 0 || link.loss < 0 || link.loss > 1) { usage(argv[0]); return 2; }
+
+  randomSeed(12345);
+  host_clock_real(speed);
+  host_link_set(link);
+
+  CoapMessage m;
+  uint8_t cf = COAP_CONTENT_FORMAT_JSON;
+  m.begin(CoapType::CON, CoapCode::POST);
+  m.addOption(OPT_URI_PATH, (const uint8_t*)COAP_URI_PATH_1, strlen(COAP_URI_PATH_1));
+  m.addOption(OPT_URI_PATH, (const uint8_t*)COAP_URI_PATH_2, strlen(COAP_URI_PATH_2));
+  m.addOption(OPT_CONTENT_FORMAT, &cf, 1);
+  postTpl.compile(m, COAP_CLIENT_TOKEN_LEN);
+
+  int64_t heap0 = host_heap().live;
+  Device* dev = new Device[n];
+  uint32_t start = millis();
+  for (uint32_t i=0; i<n; ++i) dev[i].begin(i, ip, port, all, start);
+  int64_t perDev = (host_heap().live - heap0) / (int64_t)n;
+  printf("%u dispositivos -> %s:%u, %u s simulados a x%.0f, pérdida %.0f%%, retardo %u+%u ms%s\n",
+         (unsigned)n, ip, port, (unsigned)secs, speed, link.loss * 100, link.delayMs, link.jitterMs,
+         all ? ", sin deadband" : "");
+  printf("memoria: %lld B por dispositivo (sizeof Device=%zu)\n", (long long)perDev, sizeof(Device));
+
+  // Muestreo durante secs; luego se dejan vaciar los backlogs (máx. 120 s simulados)
+  double t0 = now_s();
+  uint32_t stopAt = start + secs * 1000u, giveUp = stopAt + 120000u;
+  for (;;) {
+    uint32_t now = millis();
+    bool sampling = (int32_t)(now - stopAt) < 0;
+    bool busy = false;
+    for (uint32_t i=0; i<n; ++i) {
+      dev[i].loop(now, sampling);
+      if (!sampling && !busy && !dev[i].idle()) busy = true;
+    }
+    if (!sampling && (!busy || (int32_t)(now - giveUp) >= 0)) break;
+    host_udp_wait(1);
+  }
+  double real = now_s() - t0;
+  uint32_t simMs = millis() - start;
+
+  uint64_t samples = 0, reported = 0, ok = 0, rejected = 0, deferred = 0, failed = 0;
+  uint64_t readings = 0, pending = 0, dropped = 0;
+  uint64_t sent = 0, acked = 0, cfail = 0, rtx = 0, rto = 0;
+  for (uint32_t i=0; i<n; ++i) {
+    Device& d = dev[i];
+    samples += d.samples; reported += d.policy.sent();
+    const ReporterStats& r = d.reporter.stats();
+    ok += r.batchesOk; rejected += r.batchesRejected; deferred += r.batchesDeferred;
+    failed += r.batchesFailed; readings += r.readingsOk;
+    pending += d.backlog.size(); dropped += d.backlog.dropped();
+    const CoapClientStats& s = d.coap.stats();
+    sent += s.sent; acked += s.acked; cfail += s.failed; rtx += s.retransmissions; rto += s.rtoMs;
+  }
+  const HostLinkStats& ls = host_link_stats();
+  printf("tiempo: %.2f s reales, %.1f s simulados\n", real, simMs / 1000.0);
+  printf("lecturas: %llu muestreadas, %llu a reportar (%.1f%%), %llu confirmadas, %llu pendientes, %llu descartadas\n",
+         (unsigned long long)samples, (unsigned long long)reported,
+         samples ? 100.0 * reported / samples : 0.0, (unsigned long long)readings,
+         (unsigned long long)pending, (unsigned long long)dropped);
+  printf("lotes: %llu confirmados (2.xx), %llu rechazados (4.xx), %llu aplazados (5.xx), %llu sin respuesta\n",
+         (unsigned long long)ok, (unsigned long long)rejected, (unsigned long long)deferred,
+         (unsigned long long)failed);
+  printf("CoAP: %llu CON, %llu ACK, %llu fallidos, %llu retransmisiones (%.2f por CON), RTO medio %llu ms\n",
+         (unsigned long long)sent, (unsigned long long)acked, (unsigned long long)cfail,
+         (unsigned long long)rtx, sent ? (double)rtx / sent : 0.0, (unsigned long long)(rto / n));
+  printf("enlace: %llu datagramas enviados, %llu recibidos, %llu perdidos, %llu retrasados\n",
+         (unsigned long long)ls.sent, (unsigned long long)ls.received,
+         (unsigned long long)ls.dropped, (unsigned long long)ls.delayed);
+  printf("tasa: %.0f POST/s reales; %.1f datagramas por dispositivo y hora simulada\n",
+         real > 0 ? (double)(sent + rtx) / real : 0.0,
+         simMs ? (double)(ls.sent + ls.dropped) / n * 3600000.0 / simMs : 0.0);
+  delete[] dev;
+  // Lecturas sin entregar (pendientes o perdidas, incluidos los lotes rechazados)
+  return pending || dropped || readings != reported ? 1 : 0;
+}
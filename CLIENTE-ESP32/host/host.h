@@ -0,0 +1,43 @@
+#pragma once
+// Control del entorno simulado del build host (reloj, enlace, heap).
+#include <stdint.h>
+
+// Reloj de millis()/delay():
+//  - real: tiempo monotónico multiplicado por speed (speed=60 -> 1 s real = 1 min simulado)
+//  - manual: sólo avanza con host_clock_advance() o delay(); para medir sin esperas
+void     host_clock_real(double speed);
+void     host_clock_manual(uint32_t startMs);
+void     host_clock_advance(uint32_t ms);
+
+// Emulador de enlace, igual para todos los sockets. Cada datagrama (en ambos
+// sentidos) se pierde con probabilidad loss; los que salen se retrasan
+// delayMs + [0, jitterMs] ms de reloj simulado (pueden llegar desordenados).
+struct HostLink {
+  double   loss;
+  uint32_t delayMs;
+  uint32_t jitterMs;
+};
+struct HostLinkStats {
+  uint64_t sent;        // datagramas entregados al socket
+  uint64_t received;
+  uint64_t dropped;     // perdidos a propósito (salida + entrada)
+  uint64_t delayed;
+  uint64_t overflow;    // la línea de retardo estaba llena: se enviaron sin retardo
+};
+void                 host_link_set(const HostLink& l);
+const HostLinkStats& host_link_stats();
+
+// Espera hasta timeoutMs (reales) a que algún WiFiUDP tenga datos y los marca;
+// a partir de la primera llamada parsePacket() sólo lee sockets marcados, así
+// miles de clientes no cuestan una llamada al sistema cada uno por vuelta.
+int host_udp_wait(int timeoutMs);
+
+// Heap: new/delete y el String del shim pasan por aquí
+struct HostHeap {
+  uint64_t allocs;
+  uint64_t frees;
+  int64_t  live;        // bytes vivos
+  int64_t  peak;
+};
+const HostHeap& host_heap();
+void            host_heap_reset_peak();
@@ -0,0 +1,340 @@
+// Implementación del shim: reloj, aleatorios, String/IPAddress, WiFiUDP sobre
+// POSIX, emulador de enlace y cuentas de heap. Un solo hilo.
+#include "Arduino.h"
+#include "WiFiUdp.h"
+#include <new>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <malloc.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// ---------------------------------------------------------------- heap
+
+static HostHeap g_heap;
+
+static void* heap_alloc(size_t n) {
+  void* p = malloc(n ? n : 1);
+  if (!p) return nullptr;
+  g_heap.allocs++;
+  g_heap.live += (int64_t)malloc_usable_size(p);
+  if (g_heap.live > g_heap.peak) g_heap.peak = g_heap.live;
+  return p;
+}
+
+static void heap_free(void* p) {
+  if (!p) return;
+  g_heap.frees++;
+  g_heap.live -= (int64_t)malloc_usable_size(p);
+  free(p);
+}
+
+static void* heap_realloc(void* p, size_t n) {
+  if (!p) return heap_alloc(n);
+  int64_t before = (int64_t)malloc_usable_size(p);
+  void* q = realloc(p, n);
+  if (!q) return nullptr;
+  g_heap.allocs++; g_heap.frees++;   // en el ESP32 también es liberar + reservar
+  g_heap.live += (int64_t)malloc_usable_size(q) - before;
+  if (g_heap.live > g_heap.peak) g_heap.peak = g_heap.live;
+  return q;
+}
+
+const HostHeap& host_heap() { return g_heap; }
+void host_heap_reset_peak() { g_heap.peak = g_heap.live; }
+
+void* operator new(size_t n) {
+  void* p = heap_alloc(n);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](size_t n) { return operator new(n); }
+void operator delete(void* p) noexcept { heap_free(p); }
+void operator delete[](void* p) noexcept { heap_free(p); }
+void operator delete(void* p, size_t) noexcept { heap_free(p); }
+void operator delete[](void* p, size_t) noexcept { heap_free(p); }
+
+// ---------------------------------------------------------------- reloj
+
+static bool     g_manual = false;
+static double   g_speed = 1.0;
+static uint64_t g_origin_us;      // monotónico real cuando se fijó el modo
+static uint64_t g_base_us;        // tiempo simulado en ese instante
+static uint64_t g_sim_us;         // modo manual
+
+static uint64_t mono_us() {
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000u + (uint64_t)ts.tv_nsec/1000u;
+}
+
+static uint64_t sim_us() {
+  if (g_manual) return g_sim_us;
+  if (!g_origin_us) g_origin_us = mono_us();
+  return g_base_us + (uint64_t)((double)(mono_us() - g_origin_us) * g_speed);
+}
+
+void host_clock_real(double speed) {
+  g_base_us = sim_us();
+  g_origin_us = mono_us();
+  g_speed = speed > 0 ? speed : 1.0;
+  g_manual = false;
+}
+
+void host_clock_manual(uint32_t startMs) {
+  g_sim_us = (uint64_t)startMs * 1000u;
+  g_manual = true;
+}
+
+void host_clock_advance(uint32_t ms) {
+  if (g_manual) g_sim_us += (uint64_t)ms * 1000u;
+}
+
+uint32_t millis() { return (uint32_t)(sim_us() / 1000u); }
+uint32_t micros() { return (uint32_t)sim_us(); }
+
+void delay(uint32_t ms) {
+  if (g_manual) { host_clock_advance(ms); return; }
+  uint64_t us = (uint64_t)((double)ms * 1000.0 / g_speed);
+  struct timespec ts = { (time_t)(us / 1000000u), (long)(us % 1000000u) * 1000L };
+  nanosleep(&ts, nullptr);
+}
+
+// ---------------------------------------------------------------- aleatorios
+
+// xorshift64*: reproducible con randomSeed(), como en la placa
+static uint64_t g_rng = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng_next() {
+  g_rng ^= g_rng >> 12; g_rng ^= g_rng << 25; g_rng ^= g_rng >> 27;
+  return g_rng * 0x2545F4914F6CDD1Dull;
+}
+
+void randomSeed(unsigned long seed) { g_rng = seed ? seed : 0x9E3779B97F4A7C15ull; }
+long random(long max) { return max > 0 ? (long)(rng_next() % (uint64_t)max) : 0; }
+long random(long min, long max) { return max > min ? min + random(max - min) : min; }
+
+// El enlace tiene su propia secuencia: cambiar la pérdida no altera MIDs ni tokens
+static uint64_t g_link_rng = 0xD1B54A32D192ED03ull;
+static double link_uniform() {
+  g_link_rng ^= g_link_rng >> 12; g_link_rng ^= g_link_rng << 25; g_link_rng ^= g_link_rng >> 27;
+  return (double)((g_link_rng * 0x2545F4914F6CDD1Dull) >> 11) / 9007199254740992.0;
+}
+
+// ---------------------------------------------------------------- String / IPAddress
+
+String::String(const char* s) : _buf(nullptr), _len(0) { _set(s, strlen(s)); }
+String::String(const String& o) : _buf(nullptr), _len(0) { _set(o.c_str(), o._len); }
+String::~String() { heap_free(_buf); }
+
+String& String::operator=(const String& o) {
+  if (this != &o) _set(o.c_str(), o._len);
+  return *this;
+}
+
+void String::_set(const char* s, size_t n) {
+  char* b = (char*)heap_realloc(_buf, n + 1);
+  if (!b) return;
+  memmove(b, s, n); b[n] = 0;
+  _buf = b; _len = n;
+}
+
+String& String::operator+=(const char* s) {
+  size_t n = strlen(s);
+  char* b = (char*)heap_realloc(_buf, _len + n + 1);
+  if (!b) return *this;
+  memcpy(b + _len, s, n + 1);
+  _buf = b; _len += n;
+  return *this;
+}
+
+IPAddress::IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+  uint8_t q[4] = { a, b, c, d };
+  memcpy(&_addr, q, 4);
+}
+
+bool IPAddress::fromString(const char* s) {
+  struct in_addr a;
+  if (inet_pton(AF_INET, s, &a) != 1) return false;
+  _addr = a.s_addr;
+  return true;
+}
+
+String IPAddress::toString() const {
+  char b[INET_ADDRSTRLEN];
+  struct in_addr a; a.s_addr = _addr;
+  inet_ntop(AF_INET, &a, b, sizeof b);
+  return String(b);
+}
+
+// ---------------------------------------------------------------- enlace
+
+static HostLink      g_link = { 0.0, 0, 0 };
+static HostLinkStats g_lstats;
+
+// Línea de retardo: array sin orden, se recorre sólo cuando vence el primero
+#define LINK_QUEUE 4096
+struct Delayed {
+  uint64_t    due;
+  int         fd;
+  sockaddr_in to;
+  uint16_t    len;
+  uint8_t     data[1500];
+};
+static Delayed  g_queue[LINK_QUEUE];
+static int      g_qlen = 0;
+static uint64_t g_qnext = UINT64_MAX;
+
+void host_link_set(const HostLink& l) { g_link = l; }
+const HostLinkStats& host_link_stats() { return g_lstats; }
+
+static void link_send(int fd, const sockaddr_in& to, const uint8_t* d, size_t n) {
+  if (sendto(fd, d, n, 0, (const sockaddr*)&to, sizeof to) >= 0) g_lstats.sent++;
+}
+
+static void link_pump() {
+  if (!g_qlen) return;
+  uint64_t now = sim_us();
+  if (now < g_qnext) return;
+  g_qnext = UINT64_MAX;
+  for (int i = 0; i < g_qlen; ) {
+    Delayed& q = g_queue[i];
+    if (q.due <= now) {
+      if (q.fd >= 0) link_send(q.fd, q.to, q.data, q.len);
+      g_queue[i] = g_queue[--g_qlen];
+      continue;
+    }
+    if (q.due < g_qnext) g_qnext = q.due;
+    ++i;
+  }
+}
+
+static void link_forget(int fd) {
+  for (int i = 0; i < g_qlen; ++i) if (g_queue[i].fd == fd) g_queue[i].fd = -1;
+}
+
+// ---------------------------------------------------------------- WiFiUDP
+
+// Registro de sockets abiertos para host_udp_wait() (malloc directo: no es
+// memoria de la librería y no debe salir en host_heap())
+static WiFiUDP** g_socks = nullptr;
+static int       g_nsocks = 0, g_capsocks = 0;
+static bool      g_waited = false;
+
+static void sock_add(WiFiUDP* u) {
+  if (g_nsocks == g_capsocks) {
+    g_capsocks = g_capsocks ? g_capsocks * 2 : 64;
+    g_socks = (WiFiUDP**)realloc(g_socks, (size_t)g_capsocks * sizeof *g_socks);
+  }
+  g_socks[g_nsocks++] = u;
+}
+
+static void sock_del(WiFiUDP* u) {
+  for (int i = 0; i < g_nsocks; ++i)
+    if (g_socks[i] == u) { g_socks[i] = g_socks[--g_nsocks]; return; }
+}
+
+int host_udp_wait(int timeoutMs) {
+  static struct pollfd* pf = nullptr;
+  static int cap = 0;
+  g_waited = true;
+  if (cap < g_nsocks) { cap = g_nsocks; pf = (struct pollfd*)realloc(pf, (size_t)cap * sizeof *pf); }
+  for (int i = 0; i < g_nsocks; ++i) { pf[i].fd = g_socks[i]->fd(); pf[i].events = POLLIN; pf[i].revents = 0; }
+  // Con paquetes retenidos no se duerme más allá del siguiente vencimiento
+  if (g_qlen && !g_manual) {
+    uint64_t now = sim_us();
+    int left = g_qnext > now ? (int)((double)(g_qnext - now) / 1000.0 / g_speed) : 0;
+    if (left < timeoutMs) timeoutMs = left;
+  }
+  int n = poll(pf, (nfds_t)g_nsocks, timeoutMs);
+  if (n <= 0) return 0;
+  for (int i = 0; i < g_nsocks; ++i) if (pf[i].revents & POLLIN) g_socks[i]->markReadable();
+  return n;
+}
+
+WiFiUDP::WiFiUDP() : _fd(-1), _readable(false), _txTo(), _txLen(0), _rxFrom(), _rxLen(0), _rxPos(0) {}
+WiFiUDP::~WiFiUDP() { stop(); }
+
+uint8_t WiFiUDP::begin(uint16_t port) {
+  stop();
+  _fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (_fd < 0) return 0;
+  fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+  // Sólo con puerto fijo: con 0 y SO_REUSEADDR Linux puede repetir el
+  // puerto efímero y dos clientes de la flota se robarían las respuestas
+  int on = 1;
+  if (port) setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+  sockaddr_in a = {};
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_ANY);
+  a.sin_port = htons(port);
+  if (bind(_fd, (sockaddr*)&a, sizeof a) < 0) { perror("WiFiUDP::begin"); close(_fd); _fd = -1; return 0; }
+  sock_add(this);
+  return 1;
+}
+
+void WiFiUDP::stop() {
+  if (_fd < 0) return;
+  sock_del(this);
+  link_forget(_fd);
+  close(_fd);
+  _fd = -1;
+}
+
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port) {
+  _txTo = sockaddr_in();
+  _txTo.sin_family = AF_INET;
+  _txTo.sin_addr.s_addr = ip.raw();
+  _txTo.sin_port = htons(port);
+  _txLen = 0;
+  return 1;
+}
+
+size_t WiFiUDP::write(const uint8_t* buf, size_t n) {
+  if (n > sizeof(_tx) - _txLen) n = sizeof(_tx) - _txLen;
+  memcpy(_tx + _txLen, buf, n);
+  _txLen += n;
+  return n;
+}
+
+int WiFiUDP::endPacket() {
+  link_pump();
+  if (_fd < 0) return 0;
+  // Como en la radio: un datagrama perdido se da por enviado
+  if (g_link.loss > 0 && link_uniform() < g_link.loss) { g_lstats.dropped++; return 1; }
+  uint32_t d = g_link.delayMs + (g_link.jitterMs ? (uint32_t)(link_uniform() * (g_link.jitterMs + 1)) : 0);
+  if (!d) { link_send(_fd, _txTo, _tx, _txLen); return 1; }
+  if (g_qlen == LINK_QUEUE) { g_lstats.overflow++; link_send(_fd, _txTo, _tx, _txLen); return 1; }
+  Delayed& q = g_queue[g_qlen++];
+  q.due = sim_us() + (uint64_t)d * 1000u;
+  q.fd = _fd; q.to = _txTo; q.len = (uint16_t)_txLen;
+  memcpy(q.data, _tx, _txLen);
+  if (q.due < g_qnext) g_qnext = q.due;
+  g_lstats.delayed++;
+  return 1;
+}
+
+int WiFiUDP::parsePacket() {
+  link_pump();
+  if (_fd < 0 || (g_waited && !_readable)) return 0;
+  for (;;) {
+    socklen_t sl = sizeof _rxFrom;
+    ssize_t n = recvfrom(_fd, _rx, sizeof _rx, 0, (sockaddr*)&_rxFrom, &sl);
+    if (n < 0) { _readable = false; _rxLen = _rxPos = 0; return 0; }
+    if (g_link.loss > 0 && link_uniform() < g_link.loss) { g_lstats.dropped++; continue; }
+    g_lstats.received++;
+    _rxLen = (int)n; _rxPos = 0;
+    return (int)n;
+  }
+}
+
+int WiFiUDP::read(uint8_t* buf, size_t n) {
+  int left = _rxLen - _rxPos;
+  if ((size_t)left > n) left = (int)n;
+  memcpy(buf, _rx + _rxPos, (size_t)left);
+  _rxPos += left;
+  return left;
+}
@@ -0,0 +1,123 @@
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+  #include <windows.h>
+#endif
+
+static const char magic[8] = { 'C','O','A','P','C','A','P','1' };
+
+#define CAP_BUF (64*1024)
+
+/* Los registros se acumulan en buf y sólo se escriben enteros: el fichero
+   siempre acaba en un límite de registro aunque el servidor muera. Un hilo
+   vuelca lo pendiente cada segundo para no perder la cola si no hay tráfico. */
+static FILE *cf = NULL;
+static uint8_t buf[CAP_BUF];
+static size_t blen = 0;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t wall_us(void){
+#ifdef _WIN32
+  return (uint64_t)time(NULL)*1000000u;
+#else
+  struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec*1000000u + (uint64_t)ts.tv_nsec/1000u;
+#endif
+}
+
+static void put_le(uint8_t *p, uint64_t v, int n){
+  for(int i=0;i<n;i++){ p[i] = (uint8_t)(v & 0xFF); v >>= 8; }
+}
+static uint64_t get_le(const uint8_t *p, int n){
+  uint64_t v = 0;
+  for(int i=n-1;i>=0;i--) v = (v<<8) | p[i];
+  return v;
+}
+
+/* con mtx tomado */
+static void flush_locked(void){
+  if(cf && blen){ fwrite(buf, 1, blen, cf); fflush(cf); }
+  blen = 0;
+}
+
+static void *flusher(void *arg){
+  (void)arg;
+  for(;;){
+#ifdef _WIN32
+    Sleep(1000);
+#else
+    struct timespec ts = { 1, 0 }; nanosleep(&ts, NULL);
+#endif
+    pthread_mutex_lock(&mtx);
+    if(!cf){ pthread_mutex_unlock(&mtx); break; }
+    flush_locked();
+    pthread_mutex_unlock(&mtx);
+  }
+  return NULL;
+}
+
+int capture_open(const char *path){
+  FILE *f = fopen(path, "wb");
+  if(!f) return -1;
+  uint8_t h[16];
+  memcpy(h, magic, 8);
+  put_le(h+8, CAP_VERSION, 4); put_le(h+12, 0, 4);
+  if(fwrite(h, 1, sizeof h, f)!=sizeof h){ fclose(f); return -1; }
+  setvbuf(f, NULL, _IONBF, 0);   /* el buffer es buf */
+  pthread_mutex_lock(&mtx);
+  cf = f; blen = 0;
+  pthread_mutex_unlock(&mtx);
+  pthread_t th;
+  if(pthread_create(&th, NULL, flusher, NULL)!=0){ capture_close(); return -1; }
+  pthread_detach(th);
+  return 0;
+}
+
+void capture_write(int dir, uint32_t ip, uint16_t port, const uint8_t *data, size_t n){
+  if(!cf) return;
+  if(n>sizeof(((cap_rec_t*)0)->data)) n = sizeof(((cap_rec_t*)0)->data);
+  uint8_t h[18];
+  put_le(h, wall_us(), 8);
+  memcpy(h+8, &ip, 4);
+  memcpy(h+12, &port, 2);
+  h[14] = (uint8_t)dir; h[15] = 0;
+  put_le(h+16, n, 2);
+  pthread_mutex_lock(&mtx);
+  if(cf){
+    if(blen+sizeof h+n>sizeof buf) flush_locked();
+    memcpy(buf+blen, h, sizeof h); blen += sizeof h;
+    memcpy(buf+blen, data, n); blen += n;
+  }
+  pthread_mutex_unlock(&mtx);
+}
+
+void capture_close(void){
+  pthread_mutex_lock(&mtx);
+  flush_locked();
+  if(cf){ fclose(cf); cf = NULL; }
+  pthread_mutex_unlock(&mtx);
+}
+
+int capture_read_header(FILE *f){
+  uint8_t h[16];
+  if(fread(h, 1, sizeof h, f)!=sizeof h || memcmp(h, magic, 8)!=0) return -1;
+  return get_le(h+8, 4)==CAP_VERSION ? 0 : -1;
+}
+
+int capture_next(FILE *f, cap_rec_t *r){
+  uint8_t h[18];
+  size_t got = fread(h, 1, sizeof h, f);
+  if(got==0) return 0;
+  if(got!=sizeof h) return -1;
+  r->ts_us = get_le(h, 8);
+  memcpy(&r->ip, h+8, 4);
+  memcpy(&r->port, h+12, 2);
+  r->dir = h[14];
+  r->len = (uint16_t)get_le(h+16, 2);
+  if(r->len>sizeof r->data) return -1;
+  if(fread(r->data, 1, r->len, f)!=r->len) return -1;
+  return 1;
+}
@@ -0,0 +1,39 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* Captura de tráfico crudo a fichero (servidor con --capture FILE).
+   Formato, todo little-endian:
+     cabecera  "COAPCAP1" + u32 versión + u32 reservado        (16 bytes)
+     registro  u64 ts_us (CLOCK_REALTIME) + u32 ip + u16 puerto
+               + u8 dir + u8 reservado + u16 len + len bytes    (18 + len)
+   ip y puerto se guardan tal cual vienen en sockaddr_in (orden de red).
+   Se guardan los datagramas entrantes y también las respuestas, para que
+   coap_replay pueda comparar los códigos. */
+
+#define CAP_VERSION 1
+#define CAP_IN      0
+#define CAP_OUT     1
+
+typedef struct {
+  uint64_t ts_us;
+  uint32_t ip;       /* orden de red */
+  uint16_t port;     /* orden de red */
+  uint8_t  dir;
+  uint16_t len;
+  uint8_t  data[1500];
+} cap_rec_t;
+
+/* Escritura (thread-safe). Sin capture_open, capture_write no hace nada. */
+int  capture_open(const char *path);   /* 0 si OK */
+void capture_write(int dir, uint32_t ip, uint16_t port, const uint8_t *buf, size_t n);
+void capture_close(void);
+
+/* Lectura: comprueba la cabecera; capture_next devuelve 1 por registro,
+   0 al final y -1 si el fichero está truncado o corrupto. */
+int capture_read_header(FILE *f);
+int capture_next(FILE *f, cap_rec_t *r);
+
+#endif
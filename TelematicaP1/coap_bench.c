@@ -0,0 +1,321 @@
+// coap_bench.c — Herramienta de medida sobre el códec compartido (coap_min).
+//   coap_bench codec [iters]                     -> ns/op de coap_parse y del codificador
+//   coap_bench store [iters]                     -> respuesta GET: store_get + codificar
+//                                                   vs. cuerpo precodificado del store
+//   coap_bench load <host> <port> <GET|POST|PUT|DELETE> <path> [opciones]
+//        -n N        peticiones totales (def 10000)
+//        -c C        peticiones en vuelo a la vez (def 16)
+//        -d JSON     payload (POST/PUT)
+//        --non       usar NON en vez de CON
+//        --proxy URI enviar por el proxy: Proxy-Uri = URI + path (p.ej. coap://127.0.0.1:5684)
+//        --tcp       CoAP sobre TCP (RFC 8323) por una conexión persistente; -c es
+//                    la ventana de pipelining. Mismo informe, para comparar con UDP.
+//   Resultado: peticiones/s, pérdidas y latencia p50/p90/p99/max.
+
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "coap_min.h"
+#include "store.h"
+
+static uint64_t now_ns(void){
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Codifica una petición con Uri-Path por segmentos y Content-Format JSON si hay payload.
+   Con proxy != NULL la ruta va en Proxy-Uri (proxy + path) en lugar de Uri-Path. */
+static void enc_req_body(coap_enc_t *e, const char *path, const char *body, const char *proxy){
+  const char *p = proxy ? "" : path;
+  while(*p && *p!='?'){
+    while(*p=='/') p++;
+    const char *q = p; while(*q && *q!='/' && *q!='?') q++;
+    if(q>p) coap_enc_opt(e, OPT_URI_PATH, p, (size_t)(q-p));
+    p = q;
+  }
+  if(body && body[0]) coap_enc_opt_uint(e, OPT_CONTENT_FORMAT, CF_APP_JSON);
+  if(*p=='?'){   /* path?a=1&b=2 -> una Uri-Query por parámetro */
+    for(p++; *p; ){
+      const char *q = p; while(*q && *q!='&') q++;
+      if(q>p) coap_enc_opt(e, OPT_URI_QUERY, p, (size_t)(q-p));
+      p = *q ? q+1 : q;
+    }
+  }
+  if(proxy){
+    char uri[512];
+    int ul = snprintf(uri, sizeof uri, "%s%s", proxy, path);
+    if(ul<0 || ul>=(int)sizeof uri){ e->err = 1; return; }
+    coap_enc_opt(e, OPT_PROXY_URI, uri, (size_t)ul);
+  }
+  if(body && body[0]) coap_enc_payload(e, body, strlen(body));
+}
+
+static size_t build_req(uint8_t *out, size_t cap, uint8_t type, uint8_t code, uint16_t mid,
+                        const uint8_t *tok, uint8_t tkl, const char *path, const char *body,
+                        const char *proxy){
+  coap_enc_t e;
+  coap_enc_init(&e, out, cap, type, code, mid, tok, tkl);
+  enc_req_body(&e, path, body, proxy);
+  return coap_enc_finish(&e);
+}
+
+/* Lo mismo en una trama TCP: opciones+payload primero, cabecera delante después */
+static size_t build_req_tcp(uint8_t *out, size_t cap, uint8_t code, const uint8_t *tok, uint8_t tkl,
+                            const char *path, const char *body, const char *proxy){
+  uint8_t tmp[1500]; coap_enc_t e;
+  coap_enc_begin(&e, tmp, sizeof tmp);
+  enc_req_body(&e, path, body, proxy);
+  size_t bl = coap_enc_finish(&e);
+  if(e.err) return 0;
+  size_t hl = coap_tcp_header(out, cap, code, tok, tkl, bl);
+  if(!hl || hl+bl>cap) return 0;
+  memcpy(out+hl, tmp, bl);
+  return hl+bl;
+}
+
+static int bench_codec(long iters){
+  uint8_t pkt[256], out[256]; uint8_t tok[4] = {1,2,3,4};
+  const char *body = "{\"device\":\"esp32-sim\",\"t\":23.51,\"h\":58.02,\"ts\":123456}";
+  size_t n = build_req(pkt, sizeof pkt, COAP_TYPE_CON, COAP_POST, 1, tok, 4, "/sensors/env", body, NULL);
+  coap_msg_t m; volatile size_t sink = 0;
+
+  uint64_t t0 = now_ns();
+  for(long i=0;i<iters;i++){ coap_parse(pkt, n, &m); sink += m.optc; }
+  uint64_t t1 = now_ns();
+  for(long i=0;i<iters;i++)
+    sink += build_req(out, sizeof out, COAP_TYPE_CON, COAP_POST, (uint16_t)i, tok, 4, "/sensors/env", body, NULL);
+  uint64_t t2 = now_ns();
+  for(long i=0;i<iters;i++)
+    sink += coap_build_msg(out, sizeof out, COAP_TYPE_ACK, COAP_2_05_CONTENT, (uint16_t)i, tok, 4, CF_APP_JSON, body);
+  uint64_t t3 = now_ns();
+  (void)sink;
+
+  printf("mensaje: %zu bytes, %ld iteraciones\n", n, iters);
+  printf("parse         %8.1f ns/op\n", (double)(t1-t0)/iters);
+  printf("encode req    %8.1f ns/op\n", (double)(t2-t1)/iters);
+  printf("encode reply  %8.1f ns/op\n", (double)(t3-t2)/iters);
+  return 0;
+}
+
+/* Camino GET anterior (copia del valor + codificación completa) frente al nuevo
+   (cabecera + token delante del cuerpo precodificado). Comprueba que coinciden. */
+static int bench_store(long iters){
+  const char *key = "/sensors/env";
+  const char *val = "{\"device\":\"esp32-sim\",\"t\":23.51,\"h\":58.02,\"ts\":123456}";
+  uint8_t tok[4] = {1,2,3,4}, a[1500], b[1500]; char tmp[1024];
+  volatile size_t sink = 0;
+  store_upsert(key, val);
+  /* El camino anterior tiene que llevar la misma ETag para dar la misma respuesta */
+  uint8_t etag[4]; int valid;
+  if(store_get_encoded(key, NULL, 0, b, (int)sizeof b, &valid)<5) return 1;
+  memcpy(etag, b+1, sizeof etag);
+
+  size_t na = 0, nb = 0;
+  uint64_t t0 = now_ns();
+  for(long i=0;i<iters;i++){
+    if(store_get(key, tmp, sizeof tmp)==0){
+      coap_enc_t e;
+      coap_enc_init(&e, a, sizeof a, COAP_TYPE_ACK, COAP_2_05_CONTENT, (uint16_t)i, tok, 4);
+      coap_enc_opt(&e, OPT_ETAG, etag, sizeof etag);
+      coap_enc_opt_uint(&e, OPT_CONTENT_FORMAT, CF_APP_JSON);
+      coap_enc_payload(&e, tmp, strlen(tmp));
+      na = coap_enc_finish(&e);
+    }
+    sink += na;
+  }
+  uint64_t t1 = now_ns();
+  for(long i=0;i<iters;i++){
+    coap_enc_t e;
+    coap_enc_init(&e, b, sizeof b, COAP_TYPE_ACK, COAP_2_05_CONTENT, (uint16_t)i, tok, 4);
+    int bl = store_get_encoded(key, NULL, 0, b+e.pos, (int)(sizeof b - e.pos), &valid);
+    nb = e.pos + (size_t)bl;
+    sink += nb;
+  }
+  uint64_t t2 = now_ns();
+  (void)sink;
+
+  printf("respuesta: %zu bytes, %ld iteraciones, idénticas: %s\n", nb, iters,
+         (na==nb && memcmp(a,b,na)==0) ? "sí" : "NO");
+  printf("store_get + coap_enc         %8.1f ns/op\n", (double)(t1-t0)/iters);
+  printf("store_get_encoded (precod.)  %8.1f ns/op\n", (double)(t2-t1)/iters);
+  return 0;
+}
+
+static int cmp_u32(const void *a, const void *b){
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x>y)-(x<y);
+}
+
+static void report(long total, long lost, double secs, int conc, const char *mode,
+                   uint32_t *lat, long nlat, const long *codes){
+  qsort(lat, (size_t)nlat, sizeof *lat, cmp_u32);
+  printf("%ld peticiones en %.3f s -> %.0f req/s (en vuelo=%d, %s)\n",
+         total, secs, (double)(total-lost)/secs, conc, mode);
+  printf("perdidas: %ld\n", lost);
+  if(nlat)
+    printf("latencia us: p50=%u p90=%u p99=%u max=%u\n",
+           lat[nlat/2], lat[nlat*9/10], lat[nlat*99/100], lat[nlat-1]);
+  for(int c=0;c<256;c++) if(codes[c]) printf("  %d.%02d: %ld\n", c>>5, c&0x1F, codes[c]);
+}
+
+/* Carga por TCP: ventana de conc peticiones en vuelo sobre una conexión;
+   las peticiones de cada ronda salen en un solo send. Token = nº de petición. */
+static int bench_load_tcp(struct sockaddr_in *dst, uint8_t code, const char *path,
+                          const char *body, const char *proxy, long total, int conc){
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  if(s<0 || connect(s,(struct sockaddr*)dst,sizeof *dst)<0){ perror("connect"); return 1; }
+  int one = 1;
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+  static uint8_t out[256*1024], in[256*1024];
+  static uint64_t sent_at[65536];
+  uint32_t *lat = (uint32_t*)malloc((size_t)total*sizeof *lat);
+  long sent = 0, done = 0, nlat = 0, codes[256] = {0};
+  size_t have = 0;
+  int inflight = 0;
+
+  size_t ol = coap_tcp_header(out, sizeof out, COAP_7_01_CSM, NULL, 0, 0);  /* CSM vacío */
+  uint64_t t0 = now_ns();
+  while(done<total){
+    while(inflight<conc && sent<total && ol+1600<sizeof out){
+      uint16_t k = (uint16_t)sent;
+      uint8_t tok[4] = { (uint8_t)(k>>8), (uint8_t)k, 0xBE, 0xEF };
+      size_t n = build_req_tcp(out+ol, sizeof out-ol, code, tok, 4, path, body, proxy);
+      if(!n){ fprintf(stderr,"petición demasiado grande\n"); return 1; }
+      sent_at[k] = now_ns();
+      ol += n; sent++; inflight++;
+    }
+    for(size_t off=0; off<ol; ){
+      ssize_t w = send(s, out+off, ol-off, MSG_NOSIGNAL);
+      if(w<=0){ perror("send"); return 1; }
+      off += (size_t)w;
+    }
+    ol = 0;
+
+    ssize_t r = recv(s, in+have, sizeof in-have, 0);
+    if(r<=0){ fprintf(stderr,"conexión cerrada por el servidor\n"); return 1; }
+    have += (size_t)r;
+    size_t off = 0, flen;
+    while(coap_tcp_frame_len(in+off, have-off, &flen)==0){
+      coap_msg_t m;
+      if(coap_parse_tcp(in+off, flen, &m)==0 && (m.h.code>>5)!=7 && m.h.tkl==4){
+        uint16_t k = (uint16_t)((m.h.token[0]<<8)|m.h.token[1]);
+        if(sent_at[k]){
+          lat[nlat++] = (uint32_t)((now_ns()-sent_at[k])/1000u);
+          codes[m.h.code]++;
+          sent_at[k] = 0; inflight--; done++;
+        }
+      }
+      off += flen;
+    }
+    memmove(in, in+off, have-off); have -= off;
+  }
+  double secs = (double)(now_ns()-t0)/1e9;
+  report(total, 0, secs, conc, "TCP", lat, nlat, codes);
+  free(lat); close(s);
+  return 0;
+}
+
+static int bench_load(int argc, char **argv){
+  if(argc<6){ fprintf(stderr,"Uso: %s load <host> <port> <METHOD> <path> [-n N] [-c C] [-d JSON] [--non] [--proxy URI] [--tcp]\n", argv[0]); return 1; }
+  const char *host = argv[2]; int port = atoi(argv[3]);
+  const char *meth = argv[4], *path = argv[5];
+  long total = 10000; int conc = 16, tcp = 0; const char *body = NULL, *proxy = NULL; uint8_t type = COAP_TYPE_CON;
+  for(int a=6;a<argc;a++){
+    if(!strcmp(argv[a],"-n") && a+1<argc) total = atol(argv[++a]);
+    else if(!strcmp(argv[a],"-c") && a+1<argc) conc = atoi(argv[++a]);
+    else if(!strcmp(argv[a],"-d") && a+1<argc) body = argv[++a];
+    else if(!strcmp(argv[a],"--non")) type = COAP_TYPE_NON;
+    else if(!strcmp(argv[a],"--proxy") && a+1<argc) proxy = argv[++a];
+    else if(!strcmp(argv[a],"--tcp")) tcp = 1;
+    else { fprintf(stderr,"Opción desconocida: %s\n", argv[a]); return 1; }
+  }
+  uint8_t code = !strcmp(meth,"GET")?COAP_GET : !strcmp(meth,"POST")?COAP_POST :
+                 !strcmp(meth,"PUT")?COAP_PUT : !strcmp(meth,"DELETE")?COAP_DELETE : 0;
+  if(!code || total<=0 || conc<=0 || conc>60000){ fprintf(stderr,"Parámetros inválidos\n"); return 1; }
+
+  struct sockaddr_in dst; memset(&dst,0,sizeof dst);
+  dst.sin_family = AF_INET; dst.sin_port = htons((uint16_t)port);
+  if(inet_pton(AF_INET, host, &dst.sin_addr)!=1){ fprintf(stderr,"host inválido\n"); return 1; }
+  if(tcp) return bench_load_tcp(&dst, code, path, body, proxy, total, conc);
+
+  int s = socket(AF_INET, SOCK_DGRAM, 0);
+  if(connect(s,(struct sockaddr*)&dst,sizeof dst)<0){ perror("connect"); return 1; }
+
+  /* estado por MID (= token): instante de envío (0 = libre) y si ya llegó
+     el ACK vacío de una respuesta separada */
+  static uint64_t sent_at[65536];
+  static uint8_t acked[65536];
+  uint32_t *lat = (uint32_t*)malloc((size_t)total*sizeof *lat);
+  long sent = 0, done = 0, lost = 0, nlat = 0, nsep = 0, codes[256] = {0};
+  int inflight = 0; uint16_t mid = (uint16_t)(now_ns() & 0xFFFF);
+  const uint64_t timeout_ns = 2000000000ull, sep_timeout_ns = 30000000000ull;
+  uint8_t pkt[1500], rx[1500];
+
+  uint64_t t0 = now_ns(), last_sweep = t0;
+  while(done < total){
+    while(inflight<conc && sent<total){
+      uint16_t m = mid++;
+      uint8_t tok[4] = { (uint8_t)(m>>8), (uint8_t)m, 0xBE, 0xEF };
+      size_t n = build_req(pkt, sizeof pkt, type, code, m, tok, 4, path, body, proxy);
+      if(!n){ fprintf(stderr,"petición demasiado grande\n"); return 1; }
+      sent_at[m] = now_ns(); acked[m] = 0;
+      send(s, pkt, n, 0);
+      sent++; inflight++;
+    }
+    struct pollfd pf = { s, POLLIN, 0 };
+    if(poll(&pf, 1, 50)>0){
+      ssize_t r;
+      while((r = recv(s, rx, sizeof rx, MSG_DONTWAIT))>0){
+        coap_msg_t m;
+        if(coap_parse(rx, (size_t)r, &m)<0) continue;
+        /* ACK vacío: la respuesta llegará aparte, se espera más */
+        if(m.h.type==COAP_TYPE_ACK && m.h.code==0){ if(sent_at[m.h.mid]) acked[m.h.mid] = 1; continue; }
+        /* respuesta separada (CON): se confirma y se empareja por token */
+        if(m.h.type==COAP_TYPE_CON){
+          uint8_t a[4] = { (COAP_VER<<6)|(COAP_TYPE_ACK<<4), 0, rx[2], rx[3] };
+          send(s, a, sizeof a, 0);
+        }
+        if(m.h.tkl!=4) continue;
+        uint16_t k = (uint16_t)((m.h.token[0]<<8)|m.h.token[1]);
+        if(!sent_at[k]) continue;
+        if(acked[k]) nsep++;
+        lat[nlat++] = (uint32_t)((now_ns()-sent_at[k])/1000u);
+        codes[m.h.code]++;
+        sent_at[k] = 0; inflight--; done++;
+      }
+    }
+    /* sin retransmisión: lo que supere el timeout cuenta como perdido */
+    uint64_t t = now_ns();
+    if(t-last_sweep > 100000000ull){
+      last_sweep = t;
+      for(int i=0;i<65536;i++) if(sent_at[i] && t-sent_at[i]>(acked[i] ? sep_timeout_ns : timeout_ns)){
+        sent_at[i] = 0; inflight--; done++; lost++;
+      }
+    }
+  }
+  double secs = (double)(now_ns()-t0)/1e9;
+
+  report(total, lost, secs, conc, type==COAP_TYPE_CON?"CON":"NON", lat, nlat, codes);
+  if(nsep) printf("respuestas separadas: %ld\n", nsep);
+  free(lat); close(s);
+  return 0;
+}
+
+int main(int argc, char **argv){
+  if(argc>=2 && !strcmp(argv[1],"codec")) return bench_codec(argc>2 ? atol(argv[2]) : 5000000);
+  if(argc>=2 && !strcmp(argv[1],"store")) return bench_store(argc>2 ? atol(argv[2]) : 5000000);
+  if(argc>=2 && !strcmp(argv[1],"load"))  return bench_load(argc, argv);
+  fprintf(stderr,"Uso: %s codec [iters] | store [iters] | load <host> <port> <METHOD> <path> [-n N] [-c C] [-d JSON] [--non] [--proxy URI] [--tcp]\n", argv[0]);
+  return 1;
+}
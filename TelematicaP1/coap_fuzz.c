@@ -0,0 +1,216 @@
+// coap_fuzz.c — Fuzzing de coap_parse / coap_parse_tcp / coap_tcp_frame_len.
+//   coap_fuzz [-n ITER] [-s SEMILLA] [-v]
+//   Bucle de mutación autónomo: parte de mensajes válidos (UDP y TCP), los
+//   muta (bits, bytes "interesantes" 0/13/14/15/0xFF, inserciones, borrados,
+//   truncados, empalmes) y pasa cada entrada por los parsers. Se compila con
+//   ASan/UBSan (make -f Makefile.txt coap_fuzz), así que cualquier lectura
+//   fuera del buffer o desbordamiento aborta; además se comprueba que todo lo
+//   que el parser acepta se recodifica byte a byte igual (la codificación de
+//   RFC 7252 es canónica) y que las vistas quedan dentro de la entrada.
+//   Con -DCOAP_FUZZ_LIBFUZZER no hay main y se exporta LLVMFuzzerTestOneInput:
+//     clang -g -O1 -fsanitize=fuzzer,address,undefined -DCOAP_FUZZ_LIBFUZZER coap_fuzz.c coap_min.c
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coap_min.h"
+
+#define FUZZ_MAX 2048   /* mayor que cualquier datagrama del proyecto */
+
+static void fail(const char *what, const uint8_t *in, size_t n){
+  fprintf(stderr, "coap_fuzz: %s; entrada (%zu bytes):\n", what, n);
+  for(size_t i=0;i<n;i++) fprintf(stderr, "%02x%s", in[i], (i%32==31 || i+1==n) ? "\n" : " ");
+  abort();
+}
+
+/* Token, opciones y payload deben ser vistas dentro de [buf, buf+n) */
+static void check_views(const coap_msg_t *m, const uint8_t *buf, size_t n){
+  const uint8_t *end = buf+n;
+  if(m->h.token && (m->h.token<buf || m->h.token+m->h.tkl>end)) fail("token fuera de la entrada", buf, n);
+  for(size_t i=0;i<m->optc;i++){
+    const coap_opt_t *o = &m->opt[i];
+    if(o->val<buf || o->val+o->len>end) fail("opción fuera de la entrada", buf, n);
+    if(i && o->num<m->opt[i-1].num) fail("opciones desordenadas", buf, n);
+  }
+  if(m->payload && (m->payload<buf || m->payload+m->plen>end || !m->plen)) fail("payload fuera de la entrada", buf, n);
+}
+
+/* Opciones + payload con el codificador: debe salir lo mismo que se parseó */
+static size_t reencode_body(coap_enc_t *e, const coap_msg_t *m){
+  for(size_t i=0;i<m->optc;i++) coap_enc_opt(e, m->opt[i].num, m->opt[i].val, m->opt[i].len);
+  coap_enc_payload(e, m->payload, m->plen);
+  return coap_enc_finish(e);
+}
+
+static void one_udp(const uint8_t *buf, size_t n){
+  coap_msg_t m; uint8_t out[FUZZ_MAX+16];
+  if(coap_parse(buf, n, &m)!=0) return;
+  check_views(&m, buf, n);
+  coap_enc_t e;
+  coap_enc_init(&e, out, sizeof out, m.h.type, m.h.code, m.h.mid, m.h.token, m.h.tkl);
+  size_t k = reencode_body(&e, &m);
+  if(k!=n || memcmp(out, buf, n)) fail("UDP: la recodificación no coincide", buf, n);
+}
+
+static void one_tcp(const uint8_t *buf, size_t n){
+  size_t flen;
+  int rc = coap_tcp_frame_len(buf, n, &flen);
+  if(rc<0) return;
+  if(rc==0 && (flen<2 || flen>n)) fail("TCP: longitud de trama incoherente", buf, n);
+  if(rc>0){
+    /* incompleta: tampoco debe parsearse como trama entera */
+    coap_msg_t m;
+    if(coap_parse_tcp(buf, n, &m)==0) fail("TCP: trama incompleta aceptada", buf, n);
+    return;
+  }
+  coap_msg_t m; uint8_t out[FUZZ_MAX+32];
+  if(coap_parse_tcp(buf, flen, &m)!=0) return;
+  check_views(&m, buf, flen);
+  coap_enc_t e;
+  coap_enc_begin(&e, out, sizeof out);
+  size_t body = reencode_body(&e, &m);
+  if(!body && (m.optc || m.plen)) fail("TCP: no se pudo recodificar", buf, flen);
+  uint8_t hdr[16];
+  size_t h = coap_tcp_header(hdr, sizeof hdr, m.h.code, m.h.token, m.h.tkl, body);
+  if(!h || h+body!=flen || memcmp(hdr, buf, h) || memcmp(out, buf+h, body))
+    fail("TCP: la recodificación no coincide", buf, flen);
+}
+
+/* Copia a un buffer del tamaño exacto: ASan detecta así cualquier byte leído de más */
+static void run_one(const uint8_t *data, size_t n){
+  uint8_t *buf = (uint8_t*)malloc(n ? n : 1);
+  if(!buf) return;
+  if(n) memcpy(buf, data, n);
+  one_udp(buf, n);
+  one_tcp(buf, n);
+  free(buf);
+}
+
+#ifdef COAP_FUZZ_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+  if(size<=FUZZ_MAX) run_one(data, size);
+  return 0;
+}
+
+#else
+
+static uint64_t rng = 0x9E3779B97F4A7C15ull;
+static uint32_t rnd(void){   /* xorshift64* */
+  rng ^= rng>>12; rng ^= rng<<25; rng ^= rng>>27;
+  return (uint32_t)((rng*0x2545F4914F6CDD1Dull)>>32);
+}
+
+#define NSEEDS 9
+static uint8_t seeds[NSEEDS][FUZZ_MAX];
+static size_t  seedlen[NSEEDS];
+
+static void make_seeds(void){
+  static const uint8_t tok[8] = {1,2,3,4,5,6,7,8};
+  static const char big[300] = "x";
+  coap_enc_t e; int i = 0;
+  /* GET /sensor/temp con Accept */
+  coap_enc_init(&e, seeds[i], FUZZ_MAX, COAP_TYPE_CON, COAP_GET, 0x1234, tok, 4);
+  coap_enc_opt(&e, OPT_URI_PATH, "sensor", 6); coap_enc_opt(&e, OPT_URI_PATH, "temp", 4);
+  coap_enc_opt_uint(&e, OPT_ACCEPT, CF_APP_JSON);
+  seedlen[i++] = coap_enc_finish(&e);
+  /* POST NON con JSON */
+  coap_enc_init(&e, seeds[i], FUZZ_MAX, COAP_TYPE_NON, COAP_POST, 7, tok, 8);
+  coap_enc_opt(&e, OPT_URI_PATH, "datos", 5);
+  coap_enc_opt_uint(&e, OPT_CONTENT_FORMAT, CF_APP_JSON);
+  coap_enc_payload(&e, "{\"t\":21.5,\"h\":40}", 17);
+  seedlen[i++] = coap_enc_finish(&e);
+  /* Proxy-Uri largo (delta y longitud extendidos 13/14) */
+  coap_enc_init(&e, seeds[i], FUZZ_MAX, COAP_TYPE_CON, COAP_GET, 9, tok, 2);
+  coap_enc_opt(&e, OPT_URI_HOST, "h", 1);
+  coap_enc_opt(&e, OPT_PROXY_URI, big, sizeof big);
+  seedlen[i++] = coap_enc_finish(&e);
+  /* ACK vacío y ping (CON vacío) */
+  coap_enc_init(&e, seeds[i], FUZZ_MAX, COAP_TYPE_ACK, 0, 42, NULL, 0);
+  seedlen[i++] = coap_enc_finish(&e);
+  coap_enc_init(&e, seeds[i], FUZZ_MAX, COAP_TYPE_CON, 0, 43, NULL, 0);
+  seedlen[i++] = coap_enc_finish(&e);
+  /* TCP: CSM con Max-Message-Size, GET y un POST con Len de 2 bytes */
+  uint8_t body[FUZZ_MAX]; size_t b, h;
+  coap_enc_begin(&e, body, sizeof body);
+  coap_enc_opt_uint(&e, OPT_MAX_MSG_SIZE, 1152);
+  b = coap_enc_finish(&e);
+  h = coap_tcp_header(seeds[i], FUZZ_MAX, COAP_7_01_CSM, NULL, 0, b);
+  memcpy(seeds[i]+h, body, b); seedlen[i++] = h+b;
+  coap_enc_begin(&e, body, sizeof body);
+  coap_enc_opt(&e, OPT_URI_PATH, "ping", 4);
+  b = coap_enc_finish(&e);
+  h = coap_tcp_header(seeds[i], FUZZ_MAX, COAP_GET, tok, 3, b);
+  memcpy(seeds[i]+h, body, b); seedlen[i++] = h+b;
+  coap_enc_begin(&e, body, sizeof body);
+  coap_enc_opt(&e, OPT_URI_PATH, "datos", 5);
+  coap_enc_payload(&e, big, sizeof big);
+  b = coap_enc_finish(&e);
+  h = coap_tcp_header(seeds[i], FUZZ_MAX, COAP_POST, tok, 1, b);
+  memcpy(seeds[i]+h, body, b); seedlen[i++] = h+b;
+  /* TCP con Len de 4 bytes en el borde de 2^32 (65805 + 0xFFFEFEF3 = 2^32) */
+  static const uint8_t edge[] = {0xF0, 0xFF, 0xFE, 0xFE, 0xF3, COAP_GET, 0xB4, 'p', 'i', 'n', 'g'};
+  memcpy(seeds[i], edge, sizeof edge); seedlen[i++] = sizeof edge;
+}
+
+static size_t mutate(uint8_t *buf, size_t n){
+  static const uint8_t interesting[] = {0x00, 0x01, 0x0C, 0x0D, 0x0E, 0x0F, 0x10,
+                                        0xD0, 0xDD, 0xE0, 0xEE, 0xF0, 0xFF, 0x7F, 0x80};
+  int rounds = 1 + (int)(rnd()%4);
+  while(rounds--){
+    size_t at = n ? rnd()%n : 0;
+    switch(rnd()%7){
+    case 0: if(n) buf[at] ^= (uint8_t)(1u<<(rnd()%8)); break;
+    case 1: if(n) buf[at] = interesting[rnd()%sizeof interesting]; break;
+    case 2: if(n) buf[at] = (uint8_t)rnd(); break;
+    case 3: if(n<FUZZ_MAX){ memmove(buf+at+1, buf+at, n-at); buf[at] = (uint8_t)rnd(); n++; } break;
+    case 4: if(n){ memmove(buf+at, buf+at+1, n-at-1); n--; } break;
+    case 5: n = n ? rnd()%(n+1) : 0; break;
+    default: { /* empalme: cola de otra semilla */
+      int s = (int)(rnd()%NSEEDS);
+      size_t from = seedlen[s] ? rnd()%seedlen[s] : 0, k = seedlen[s]-from;
+      if(at+k>FUZZ_MAX) k = FUZZ_MAX-at;
+      memcpy(buf+at, seeds[s]+from, k); n = at+k;
+    } }
+  }
+  return n;
+}
+
+int main(int argc, char **argv){
+  unsigned long long iters = 2000000, seed = 1;
+  int verbose = 0;
+  for(int i=1;i<argc;i++){
+    if(!strcmp(argv[i],"-n") && i+1<argc) iters = strtoull(argv[++i], NULL, 10);
+    else if(!strcmp(argv[i],"-s") && i+1<argc) seed = strtoull(argv[++i], NULL, 10);
+    else if(!strcmp(argv[i],"-v")) verbose = 1;
+    else { fprintf(stderr, "Uso: %s [-n ITER] [-s SEMILLA] [-v]\n", argv[0]); return 2; }
+  }
+  rng ^= seed*0xD1B54A32D192ED03ull; if(!rng) rng = 1;
+  make_seeds();
+  for(int s=0;s<NSEEDS;s++){
+    if(!seedlen[s]){ fprintf(stderr, "coap_fuzz: semilla %d no se pudo codificar\n", s); return 1; }
+    run_one(seeds[s], seedlen[s]);
+  }
+
+  static uint8_t cur[FUZZ_MAX];
+  unsigned long long ok_udp = 0, ok_tcp = 0;
+  for(unsigned long long it=0; it<iters; it++){
+    int s = (int)(rnd()%NSEEDS);
+    memcpy(cur, seeds[s], seedlen[s]);
+    size_t n = mutate(cur, seedlen[s]);
+    run_one(cur, n);
+    if(verbose){
+      coap_msg_t m; size_t fl;
+      if(coap_parse(cur, n, &m)==0) ok_udp++;
+      if(coap_tcp_frame_len(cur, n, &fl)==0 && coap_parse_tcp(cur, fl, &m)==0) ok_tcp++;
+    }
+  }
+  printf("coap_fuzz: %llu entradas sin fallos (semilla %llu)", iters, seed);
+  if(verbose) printf("; aceptadas %llu UDP, %llu TCP", ok_udp, ok_tcp);
+  printf("\n");
+  return 0;
+}
+
+#endif
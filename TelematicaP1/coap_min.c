@@ -1,29 +1,195 @@
 #include "coap_min.h"
 #include <string.h>
 
+/* Lee el valor extendido de un nibble de delta/longitud (RFC 7252 §3.1) */
+static int ext_val(unsigned nib, const uint8_t *buf, size_t len, size_t *pos, uint32_t *out){
+  if(nib<13){ *out = nib; return 0; }
+  if(nib==13){ if(*pos+1>len) return -1; *out = 13u + buf[*pos]; *pos += 1; return 0; }
+  if(nib==14){ if(*pos+2>len) return -1; *out = 269u + (((uint32_t)buf[*pos]<<8)|buf[*pos+1]); *pos += 2; return 0; }
+  return -1; /* 15: reservado */
+}
+
+/* Opciones y payload desde pos hasta len (común a UDP y TCP) */
+static int parse_opts(const uint8_t *buf, size_t len, size_t pos, coap_msg_t *m){
+  uint32_t num = 0;
+  while(pos<len){
+    uint8_t b = buf[pos++];
+    if(b==0xFF){
+      if(pos==len) return COAP_ERR_OPTION; /* marcador sin payload */
+      m->payload = buf+pos; m->plen = len-pos;
+      return 0;
+    }
+    uint32_t d, l;
+    if(ext_val(b>>4, buf, len, &pos, &d)<0) return COAP_ERR_OPTION;
+    if(ext_val(b&0x0F, buf, len, &pos, &l)<0) return COAP_ERR_OPTION;
+    num += d;
+    if(num>0xFFFF || l>len-pos) return COAP_ERR_OPTION;
+    if(m->optc==COAP_MAX_OPTS) return COAP_ERR_TOOMANY;
+    m->opt[m->optc].num = (uint16_t)num;
+    m->opt[m->optc].len = (uint16_t)l;
+    m->opt[m->optc].val = buf+pos;
+    m->optc++;
+    pos += l;
+  }
+  return 0;
+}
+
+int coap_parse(const uint8_t *buf, size_t len, coap_msg_t *m){
+  m->optc = 0; m->payload = NULL; m->plen = 0;
+  m->h.token = NULL;
+  if(len<4) return COAP_ERR_SHORT;
+  m->h.ver  = (buf[0]>>6)&3;
+  m->h.type = (buf[0]>>4)&3;
+  m->h.tkl  = buf[0]&0x0F;
+  m->h.code = buf[1];
+  m->h.mid  = ((uint16_t)buf[2]<<8)|buf[3];
+  if(m->h.ver!=COAP_VER) return COAP_ERR_VERSION;
+  if(m->h.tkl>8) return COAP_ERR_TKL;
+  if(4u+m->h.tkl>len) return COAP_ERR_SHORT;
+  m->h.token = buf+4;
+
+  return parse_opts(buf, len, 4u+m->h.tkl, m);
+}
+
+const coap_opt_t *coap_find_opt(const coap_msg_t *m, uint16_t num){
+  for(size_t i=0;i<m->optc;i++) if(m->opt[i].num==num) return &m->opt[i];
+  return NULL;
+}
+
+uint32_t coap_opt_uint(const coap_msg_t *m, uint16_t num, uint32_t def){
+  const coap_opt_t *o = coap_find_opt(m, num);
+  if(!o || o->len>4) return def;
+  uint32_t v = 0;
+  for(uint16_t k=0;k<o->len;k++) v = (v<<8)|o->val[k];
+  return v;
+}
+
+/* ======== Codificador ======== */
+static void put(coap_enc_t *e, const void *p, size_t n){
+  if(e->err) return;
+  if(e->pos+n>e->cap){ e->err = 1; return; }
+  memcpy(e->buf+e->pos, p, n); e->pos += n;
+}
+
+void coap_enc_init(coap_enc_t *e, uint8_t *out, size_t cap,
+                   uint8_t type, uint8_t code, uint16_t mid,
+                   const uint8_t *token, uint8_t tkl){
+  uint8_t h[4];
+  e->buf = out; e->cap = cap; e->pos = 0; e->last = 0;
+  e->err = (tkl>8);
+  h[0] = (uint8_t)((COAP_VER<<6) | ((type&3)<<4) | (tkl&0x0F));
+  h[1] = code;
+  h[2] = (uint8_t)(mid>>8); h[3] = (uint8_t)(mid&0xFF);
+  put(e, h, 4);
+  if(tkl) put(e, token, tkl);
+}
+
+void coap_enc_begin(coap_enc_t *e, uint8_t *out, size_t cap){
+  e->buf = out; e->cap = cap; e->pos = 0; e->last = 0; e->err = 0;
+}
+
+static uint8_t nib(uint32_t v, uint8_t *ext, size_t *n){
+  if(v<13){ *n = 0; return (uint8_t)v; }
+  if(v<269){ ext[0] = (uint8_t)(v-13); *n = 1; return 13; }
+  v -= 269; ext[0] = (uint8_t)(v>>8); ext[1] = (uint8_t)(v&0xFF); *n = 2;
+  return 14;
+}
+
+void coap_enc_opt(coap_enc_t *e, uint16_t num, const void *val, size_t len){
+  uint8_t hdr[5]; size_t dn, ln;
+  if(num<e->last || len>0xFFFFu+269u){ e->err = 1; return; }
+  uint8_t d = nib((uint32_t)(num-e->last), hdr+1, &dn);
+  uint8_t l = nib((uint32_t)len, hdr+1+dn, &ln);
+  hdr[0] = (uint8_t)((d<<4)|l);
+  put(e, hdr, 1+dn+ln);
+  if(len) put(e, val, len);
+  e->last = num;
+}
+
+void coap_enc_opt_uint(coap_enc_t *e, uint16_t num, uint32_t v){
+  /* forma mínima: sin ceros a la izquierda (0 -> longitud 0) */
+  uint8_t b[4]; size_t n = 0;
+  for(int s=24;s>=0;s-=8) if(n || (v>>s)&0xFF) b[n++] = (uint8_t)((v>>s)&0xFF);
+  coap_enc_opt(e, num, b, n);
+}
+
+void coap_enc_payload(coap_enc_t *e, const void *p, size_t len){
+  uint8_t mk = 0xFF;
+  if(!len) return;
+  put(e, &mk, 1);
+  put(e, p, len);
+}
+
+size_t coap_enc_finish(coap_enc_t *e){
+  return e->err ? 0 : e->pos;
+}
+
+size_t coap_build_msg(uint8_t *out, size_t cap,
+                      uint8_t type, uint8_t code, uint16_t mid,
+                      const uint8_t *token, uint8_t tkl,
+                      int cf, const char *payload){
+  coap_enc_t e;
+  coap_enc_init(&e, out, cap, type, code, mid, token, tkl);
+  if(cf>=0) coap_enc_opt_uint(&e, OPT_CONTENT_FORMAT, (uint32_t)cf);
+  if(payload) coap_enc_payload(&e, payload, strlen(payload));
+  return coap_enc_finish(&e);
+}
+
 size_t coap_build_reply(uint8_t *out, size_t cap,
                         uint8_t type, uint8_t code, uint16_t mid,
                         const uint8_t *token, uint8_t tkl,
-                        const char *payload) {
-    size_t pos = 0;
-    if (cap < 4) return 0;
-    out[pos++] = (1 << 6) | ((type & 3) << 4) | (tkl & 0x0F);
-    out[pos++] = code;
-    out[pos++] = (mid >> 8) & 0xFF;
-    out[pos++] = mid & 0xFF;
-
-    if (tkl) {
-        if (pos + tkl > cap) return 0;
-        memcpy(&out[pos], token, tkl);
-        pos += tkl;
-    }
+                        const char *payload){
+  return coap_build_msg(out, cap, type, code, mid, token, tkl, -1, payload);
+}
 
-    if (payload && payload[0]) {
-        size_t len = strlen(payload);
-        if (pos + 1 + len > cap) return 0;
-        out[pos++] = 0xFF;
-        memcpy(&out[pos], payload, len);
-        pos += len;
-    }
-    return pos;
+/* ======== TCP ======== */
+int coap_tcp_frame_len(const uint8_t *buf, size_t len, size_t *flen){
+  *flen = 0;
+  if(len<1) return 1;
+  unsigned ln = buf[0]>>4, tkl = buf[0]&0x0F;
+  if(tkl>8) return COAP_ERR_TKL;
+  size_t ext = ln<13 ? 0 : ln==13 ? 1 : ln==14 ? 2 : 4;
+  if(len<1+ext) return 1;
+  /* En 64 bits: con ln==15 el cuerpo puede pasar de 2^32-1 (65805 + u32).
+     Si no cabe en size_t se satura; el llamante la rechaza por tamaño. */
+  uint64_t body = ln;
+  if(ln==13) body = 13u + buf[1];
+  else if(ln==14) body = 269u + (((uint32_t)buf[1]<<8)|buf[2]);
+  else if(ln==15) body = 65805u + (uint64_t)(((uint32_t)buf[1]<<24)|((uint32_t)buf[2]<<16)|((uint32_t)buf[3]<<8)|buf[4]);
+  uint64_t total = 1 + ext + 1 + tkl + body;
+  *flen = total>(uint64_t)SIZE_MAX ? SIZE_MAX : (size_t)total;
+  return len>=*flen ? 0 : 1;
+}
+
+int coap_parse_tcp(const uint8_t *buf, size_t len, coap_msg_t *m){
+  size_t flen;
+  m->optc = 0; m->payload = NULL; m->plen = 0;
+  m->h.token = NULL; m->h.ver = COAP_VER; m->h.type = COAP_TYPE_CON; m->h.mid = 0; m->h.code = 0;
+  int rc = coap_tcp_frame_len(buf, len, &flen);
+  if(rc<0) return rc;
+  if(rc>0 || flen!=len) return COAP_ERR_SHORT;
+  unsigned ln = buf[0]>>4;
+  size_t pos = 1 + (ln<13 ? 0 : ln==13 ? 1 : ln==14 ? 2 : 4);
+  m->h.tkl = buf[0]&0x0F;
+  m->h.code = buf[pos++];
+  m->h.token = buf+pos;
+  return parse_opts(buf, len, pos+m->h.tkl, m);
+}
+
+size_t coap_tcp_header(uint8_t *out, size_t cap, uint8_t code,
+                       const uint8_t *token, uint8_t tkl, size_t body_len){
+  uint8_t h[14]; size_t n = 1;
+  if(tkl>8 || body_len>0xFFFFFFFFu-65805u) return 0;
+  if(body_len<13) h[0] = (uint8_t)(body_len<<4);
+  else if(body_len<269){ h[0] = 13<<4; h[n++] = (uint8_t)(body_len-13); }
+  else if(body_len<65805){ size_t v = body_len-269; h[0] = 14<<4; h[n++] = (uint8_t)(v>>8); h[n++] = (uint8_t)v; }
+  else { size_t v = body_len-65805; h[0] = 15<<4;
+         h[n++] = (uint8_t)(v>>24); h[n++] = (uint8_t)(v>>16); h[n++] = (uint8_t)(v>>8); h[n++] = (uint8_t)v; }
+  h[0] |= tkl;
+  h[n++] = code;
+  if(tkl) memcpy(h+n, token, tkl);
+  n += tkl;
+  if(n>cap) return 0;
+  memcpy(out, h, n);
+  return n;
 }
@@ -3,8 +3,15 @@
 #include <stdint.h>
 #include <stddef.h>
 
-#define COAP_TYPE_CON 0
-#define COAP_TYPE_ACK 2
+/* Códec CoAP (RFC 7252) compartido por server.c, main.c y las herramientas.
+   El parser es de una pasada y sin copias: opciones, token y payload son
+   vistas sobre el datagrama, que debe seguir vivo mientras se usen. */
+
+#define COAP_VER         1
+#define COAP_TYPE_CON    0
+#define COAP_TYPE_NON    1
+#define COAP_TYPE_ACK    2
+#define COAP_TYPE_RST    3
 
 #define COAP_GET    1
 #define COAP_POST   2
@@ -12,14 +19,117 @@
 #define COAP_DELETE 4
 
 #define COAP_2_01_CREATED 0x41
+#define COAP_2_02_DELETED 0x42
+#define COAP_2_03_VALID   0x43
 #define COAP_2_04_CHANGED 0x44
 #define COAP_2_05_CONTENT 0x45
 #define COAP_4_00_BADREQ  0x80
+#define COAP_4_02_BADOPT  0x82
 #define COAP_4_04_NOTFND  0x84
+#define COAP_4_06_NOTACCEPT 0x86
+#define COAP_4_13_TOOLARGE 0x8D
+#define COAP_5_00_SRVERR  0xA0
+#define COAP_5_02_BADGW   0xA2
+#define COAP_5_03_UNAVAIL 0xA3
+#define COAP_5_04_GWTIMEOUT 0xA4
+#define COAP_5_05_NOPROXY 0xA5  /* Proxying Not Supported */
+
+/* Opciones */
+#define OPT_URI_HOST        3
+#define OPT_ETAG            4
+#define OPT_URI_PORT        7
+#define OPT_URI_PATH       11
+#define OPT_CONTENT_FORMAT 12
+#define OPT_MAX_AGE        14
+#define OPT_URI_QUERY      15
+#define OPT_ACCEPT         17
+#define OPT_PROXY_URI      35
+#define OPT_PROXY_SCHEME   39
+#define CF_LINK_FORMAT     40  // application/link-format
+#define CF_APP_JSON        50  // application/json
+
+#define COAP_MAX_OPTS      32
+
+/* Errores de coap_parse */
+#define COAP_ERR_SHORT    -1  /* menos de 4 bytes o token truncado */
+#define COAP_ERR_VERSION  -2
+#define COAP_ERR_TKL      -3  /* TKL 9..15 (reservado) */
+#define COAP_ERR_OPTION   -4  /* nibble 15, opción truncada o marcador sin payload */
+#define COAP_ERR_TOOMANY  -5  /* más de COAP_MAX_OPTS opciones */
+
+typedef struct { uint16_t num; uint16_t len; const uint8_t *val; } coap_opt_t;
+
+typedef struct {
+  struct {
+    uint8_t ver, type, tkl, code;
+    uint16_t mid;
+    const uint8_t *token;
+  } h;
+  size_t optc;
+  coap_opt_t opt[COAP_MAX_OPTS];
+  const uint8_t *payload;
+  size_t plen;
+} coap_msg_t;
+
+/* 0 si OK; COAP_ERR_* si el datagrama está mal formado. Aun con error,
+   m->h queda relleno en cuanto se leyó la cabecera (para poder enviar RST). */
+int coap_parse(const uint8_t *buf, size_t len, coap_msg_t *m);
+
+/* Primera opción con ese número (NULL si no hay) y valor uint (def si no hay) */
+const coap_opt_t *coap_find_opt(const coap_msg_t *m, uint16_t num);
+uint32_t coap_opt_uint(const coap_msg_t *m, uint16_t num, uint32_t def);
+
+/* Codificador incremental. Las opciones deben añadirse en orden creciente;
+   delta y longitud usan las formas extendidas (13/14) cuando hace falta.
+   Cualquier desbordamiento deja err=1 y coap_enc_finish devuelve 0. */
+typedef struct {
+  uint8_t *buf; size_t cap, pos;
+  uint16_t last;
+  int err;
+} coap_enc_t;
+
+void   coap_enc_init(coap_enc_t *e, uint8_t *out, size_t cap,
+                     uint8_t type, uint8_t code, uint16_t mid,
+                     const uint8_t *token, uint8_t tkl);
+/* Sin cabecera ni token: sólo opciones + payload (el transporte pone el resto) */
+void   coap_enc_begin(coap_enc_t *e, uint8_t *out, size_t cap);
+void   coap_enc_opt(coap_enc_t *e, uint16_t num, const void *val, size_t len);
+void   coap_enc_opt_uint(coap_enc_t *e, uint16_t num, uint32_t v);
+void   coap_enc_payload(coap_enc_t *e, const void *p, size_t len);
+size_t coap_enc_finish(coap_enc_t *e);
+
+/* Respuesta completa: cabecera + token + [Content-Format si cf>=0] + payload */
+size_t coap_build_msg(uint8_t *out, size_t cap,
+                      uint8_t type, uint8_t code, uint16_t mid,
+                      const uint8_t *token, uint8_t tkl,
+                      int cf, const char *payload);
 
 size_t coap_build_reply(uint8_t *out, size_t cap,
                         uint8_t type, uint8_t code, uint16_t mid,
                         const uint8_t *token, uint8_t tkl,
                         const char *payload);
 
+/* ======== CoAP sobre TCP (RFC 8323 §3.2) ========
+   Trama: Len|TKL, Len extendido (0/1/2/4 bytes), Code, Token, opciones y
+   payload. Len cuenta sólo opciones + payload. No hay tipo ni MID: la
+   entrega es fiable y ordenada, así que no hay ACK por mensaje. */
+#define COAP_7_01_CSM     0xE1
+#define COAP_7_02_PING    0xE2
+#define COAP_7_03_PONG    0xE3
+#define COAP_7_04_RELEASE 0xE4
+#define COAP_7_05_ABORT   0xE5
+#define OPT_MAX_MSG_SIZE  2     /* en CSM */
+
+/* Longitud total de la trama que empieza en buf: 0 si está completa, 1 si
+   faltan bytes (flen queda a 0 si aún no se conoce), COAP_ERR_TKL si TKL>8 */
+int    coap_tcp_frame_len(const uint8_t *buf, size_t len, size_t *flen);
+
+/* Parsea una trama completa. h.type queda en CON y h.mid en 0. */
+int    coap_parse_tcp(const uint8_t *buf, size_t len, coap_msg_t *m);
+
+/* Escribe Len|TKL + Len ext + Code + Token para body_len bytes de opciones
+   y payload. Devuelve los bytes escritos (como mucho 14), 0 si no cabe. */
+size_t coap_tcp_header(uint8_t *out, size_t cap, uint8_t code,
+                       const uint8_t *token, uint8_t tkl, size_t body_len);
+
 #endif
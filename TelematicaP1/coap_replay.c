@@ -0,0 +1,351 @@
+// coap_replay.c — Repite tráfico grabado contra un servidor y compara los códigos.
+//   coap_replay <host> <port> <fichero> [opciones]
+//     fichero     captura del servidor (--capture) o un server.log
+//     --speed N   escala de tiempo: 1 = ritmo original (def), 10 = diez veces más rápido
+//     --max       sin respetar tiempos, con -c peticiones en vuelo (def 64)
+//     -n N        repetir sólo los N primeros mensajes
+//   Desde una captura se repiten los datagramas entrantes tal cual (salvo el MID,
+//   que se renumera para no chocar) y lo esperado es la respuesta grabada.
+//   Desde server.log la petición se reconstruye de las líneas REQ/BODY y lo
+//   esperado sale de RESP (o de "-> OK"/"-> not found" en logs anteriores).
+//   Todo sale de un mismo socket: conviene lanzar el servidor con --rate 0.
+//   Sale con 1 si algún código no coincide con el original.
+
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "coap_min.h"
+
+#define CODE_RST     0x100   /* "código" de una respuesta RST */
+#define CODE_NONE    -1
+#define TIMEOUT_US   2000000u
+#define SEP_TIMEOUT_US 10000000u  /* tras un ACK vacío, espera de la respuesta separada */
+#define MAX_MISMATCH_SHOWN 10
+#define BURST_MAX    64          /* envíos seguidos antes de mirar el socket */
+
+typedef struct {
+  uint64_t t_us;        /* instante original */
+  uint8_t *pkt; uint16_t len;
+  int noreply;          /* ACK/RST del cliente: se envía y no se espera nada */
+  int expect;           /* código original (CODE_NONE si no se sabe) */
+  int guess;            /* log antiguo sin RESP: deducido del texto */
+  /* repetición */
+  uint64_t sent_us;
+  int got;              /* CODE_NONE = sin respuesta (todavía) */
+  int waiting_sep;
+} ev_t;
+
+static ev_t *ev = NULL;
+static size_t nev = 0, capev = 0;
+
+static uint64_t now_us(void){
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000u + (uint64_t)ts.tv_nsec/1000u;
+}
+
+static ev_t *push_ev(uint64_t t, const uint8_t *pkt, size_t len){
+  if(nev==capev){
+    capev = capev ? capev*2 : 1024;
+    ev = (ev_t*)realloc(ev, capev*sizeof *ev);
+    if(!ev){ fprintf(stderr, "sin memoria\n"); exit(2); }
+  }
+  ev_t *e = &ev[nev++];
+  memset(e, 0, sizeof *e);
+  e->t_us = t; e->len = (uint16_t)len;
+  e->pkt = (uint8_t*)malloc(len ? len : 1);
+  if(!e->pkt){ fprintf(stderr, "sin memoria\n"); exit(2); }
+  memcpy(e->pkt, pkt, len);
+  e->expect = e->guess = e->got = CODE_NONE;
+  e->noreply = len>=4 && ((pkt[0]>>4)&3)>=COAP_TYPE_ACK;
+  return e;
+}
+
+static uint16_t pkt_mid(const ev_t *e){ return e->len>=4 ? (uint16_t)(((unsigned)e->pkt[2]<<8)|e->pkt[3]) : 0; }
+
+static int pkt_token_is(const ev_t *e, const uint8_t *tok, unsigned tkl){
+  return e->len>=4+tkl && (e->pkt[0]&0x0F)==tkl && memcmp(e->pkt+4, tok, tkl)==0;
+}
+
+/* La respuesta pertenece a la petición más reciente con ese MID (o, si tok
+   no es NULL, con ese token: respuesta separada, que lleva MID propio) que
+   aún no tenga código. Para capturas se exige además el mismo par. */
+static ev_t *find_req(uint16_t mid, const uint8_t *tok, unsigned tkl,
+                      const uint32_t *ip, const uint16_t *port,
+                      const uint32_t *eip, const uint16_t *eport){
+  for(size_t k=nev;k-->0 && nev-k<4096;){
+    ev_t *e = &ev[k];
+    if(e->noreply || e->expect!=CODE_NONE) continue;
+    if(tok ? !pkt_token_is(e, tok, tkl) : pkt_mid(e)!=mid) continue;
+    if(ip && (eip[k]!=*ip || eport[k]!=*port)) continue;
+    return e;
+  }
+  return NULL;
+}
+
+static int load_capture(FILE *f, long limit){
+  static cap_rec_t r;
+  uint32_t *eip = NULL; uint16_t *eport = NULL; size_t capp = 0;
+  int rc;
+  while((rc = capture_next(f, &r))==1){
+    if(r.dir==CAP_IN){
+      if(limit>0 && (long)nev>=limit) continue;
+      push_ev(r.ts_us, r.data, r.len);
+      if(nev>capp){
+        capp = capev;
+        eip = (uint32_t*)realloc(eip, capp*sizeof *eip);
+        eport = (uint16_t*)realloc(eport, capp*sizeof *eport);
+        if(!eip || !eport){ fprintf(stderr, "sin memoria\n"); exit(2); }
+      }
+      eip[nev-1] = r.ip; eport[nev-1] = r.port;
+    }else if(r.len>=4){
+      uint16_t mid = (uint16_t)(((unsigned)r.data[2]<<8)|r.data[3]);
+      unsigned type = (r.data[0]>>4)&3, tkl = r.data[0]&0x0F;
+      /* ACK vacío: la respuesta llega aparte, no es lo esperado */
+      if(type==COAP_TYPE_ACK && r.data[1]==0) continue;
+      /* CON/NON nuestro: respuesta separada (o NON a NON), por token */
+      const uint8_t *tok = (type<=COAP_TYPE_NON && tkl && tkl<=8 && r.len>=4+tkl) ? r.data+4 : NULL;
+      ev_t *e = find_req(mid, tok, tkl, &r.ip, &r.port, eip, eport);
+      if(e) e->expect = type==COAP_TYPE_RST ? CODE_RST : r.data[1];
+    }
+  }
+  free(eip); free(eport);
+  if(rc<0) fprintf(stderr, "aviso: captura truncada, se usa lo leído\n");
+  return 0;
+}
+
+/* Petición equivalente a la registrada en el log (token sintético) */
+static size_t build_req(uint8_t *out, size_t cap, uint8_t type, uint8_t code, uint16_t mid,
+                        uint32_t tokv, const char *path, const char *body){
+  uint8_t tok[4] = { (uint8_t)(tokv>>24), (uint8_t)(tokv>>16), (uint8_t)(tokv>>8), (uint8_t)tokv };
+  coap_enc_t e;
+  coap_enc_init(&e, out, cap, type, code, mid, tok, 4);
+  const char *p = path;
+  while(*p){
+    while(*p=='/') p++;
+    const char *q = p; while(*q && *q!='/') q++;
+    if(q>p) coap_enc_opt(&e, OPT_URI_PATH, p, (size_t)(q-p));
+    p = q;
+  }
+  if(body && body[0]){
+    coap_enc_opt_uint(&e, OPT_CONTENT_FORMAT, CF_APP_JSON);
+    coap_enc_payload(&e, body, strlen(body));
+  }
+  return coap_enc_finish(&e);
+}
+
+/* Una petición del log todavía sin BODY (plen>0) */
+typedef struct { int pending; uint64_t t; uint8_t type, code; uint16_t mid; char path[256]; } logreq_t;
+
+static void flush_logreq(logreq_t *q, const char *body){
+  uint8_t pkt[1500];
+  if(!q->pending) return;
+  size_t n = build_req(pkt, sizeof pkt, q->type, q->code, q->mid, (uint32_t)nev*2654435761u, q->path, body);
+  if(n) push_ev(q->t, pkt, n);
+  q->pending = 0;
+}
+
+static int load_log(FILE *f, long limit){
+  char line[2048];
+  logreq_t q; memset(&q, 0, sizeof q);
+  int have_resp = 0;
+  while(fgets(line, sizeof line, f)){
+    line[strcspn(line, "\r\n")] = 0;
+    struct tm tm; memset(&tm, 0, sizeof tm);
+    int off = 0;
+    if(sscanf(line, "[%d-%d-%d %d:%d:%d] %n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+              &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &off)!=6 || !off) continue;
+    tm.tm_year -= 1900; tm.tm_mon -= 1; tm.tm_isdst = -1;
+    uint64_t t = (uint64_t)mktime(&tm)*1000000u;
+    const char *m = line+off;
+
+    char type[8], path[256]; unsigned code, mid, rmid; int plen; int cc, cd, nf;
+    if(sscanf(m, "REQ type=%7s code=0x%x mid=0x%x path=%255s plen=%d", type, &code, &mid, path, &plen)==5){
+      flush_logreq(&q, NULL);
+      if(limit>0 && (long)nev>=limit) continue;
+      /* CON-SEP / NON-SEP: la misma petición, respondida por separado */
+      int con = !strcmp(type,"CON") || !strcmp(type,"CON-SEP");
+      if(!con && strcmp(type,"NON") && strcmp(type,"NON-SEP")) continue;
+      q.pending = 1; q.t = t; q.type = con ? COAP_TYPE_CON : COAP_TYPE_NON;
+      q.code = (uint8_t)code; q.mid = (uint16_t)mid;
+      snprintf(q.path, sizeof q.path, "%s", path);
+      if(plen<=0) flush_logreq(&q, NULL);
+    }else if(strncmp(m, "BODY: ", 6)==0){
+      flush_logreq(&q, m+6);
+    }else if((nf = sscanf(m, "RESP mid=0x%x code=%d.%d req=0x%x", &mid, &cc, &cd, &rmid))>=3){
+      flush_logreq(&q, NULL);
+      have_resp = 1;
+      if(cc==0 && cd==0) continue;   /* ACK vacío de una respuesta separada */
+      /* req= : respuesta separada, con MID propio; el de la petición va aparte */
+      ev_t *e = find_req((uint16_t)(nf==4 ? rmid : mid), NULL, 0, NULL, NULL, NULL, NULL);
+      if(e) e->expect = (cc<<5)|cd;
+    }else if(nev && ev[nev-1].guess==CODE_NONE){
+      if(strstr(m, " -> not found")) ev[nev-1].guess = COAP_4_04_NOTFND;
+      else if(strstr(m, " -> OK")) ev[nev-1].guess = COAP_2_04_CHANGED;
+      else if(strstr(m, " -> body vacío")) ev[nev-1].guess = COAP_4_00_BADREQ;
+    }
+  }
+  flush_logreq(&q, NULL);
+  if(!have_resp) for(size_t i=0;i<nev;i++) ev[i].expect = ev[i].guess;
+  return 0;
+}
+
+static void code_str(int c, char *out, size_t n){
+  if(c==CODE_NONE) snprintf(out, n, "-");
+  else if(c==CODE_RST) snprintf(out, n, "RST");
+  else snprintf(out, n, "%d.%02d", (c>>5)&7, c&0x1F);
+}
+
+static int cmp_u32(const void *a, const void *b){
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x>y)-(x<y);
+}
+
+int main(int argc, char **argv){
+  if(argc<4){
+    fprintf(stderr, "Uso: %s <host> <port> <captura|server.log> [--speed N | --max] [-c C] [-n N]\n", argv[0]);
+    return 2;
+  }
+  double speed = 1.0; int conc = 64; long limit = 0;
+  for(int a=4;a<argc;a++){
+    if(!strcmp(argv[a],"--speed") && a+1<argc) speed = atof(argv[++a]);
+    else if(!strcmp(argv[a],"--max")) speed = 0;
+    else if(!strcmp(argv[a],"-c") && a+1<argc) conc = atoi(argv[++a]);
+    else if(!strcmp(argv[a],"-n") && a+1<argc) limit = atol(argv[++a]);
+    else { fprintf(stderr, "Opción desconocida: %s\n", argv[a]); return 2; }
+  }
+  if(speed<0 || conc<=0 || conc>60000){ fprintf(stderr, "Parámetros inválidos\n"); return 2; }
+
+  FILE *f = fopen(argv[3], "rb");
+  if(!f){ perror(argv[3]); return 2; }
+  int is_cap = capture_read_header(f)==0;
+  if(!is_cap) rewind(f);
+  if(is_cap) load_capture(f, limit); else load_log(f, limit);
+  fclose(f);
+  if(!nev){ fprintf(stderr, "No hay mensajes que repetir en %s\n", argv[3]); return 2; }
+
+  int s = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in dst; memset(&dst, 0, sizeof dst);
+  dst.sin_family = AF_INET; dst.sin_port = htons((uint16_t)atoi(argv[2]));
+  if(inet_pton(AF_INET, argv[1], &dst.sin_addr)!=1){ fprintf(stderr, "host inválido\n"); return 2; }
+  if(connect(s, (struct sockaddr*)&dst, sizeof dst)<0){ perror("connect"); return 2; }
+  int rcvbuf = 4<<20;
+  setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
+  /* MID renumerado -> índice del evento en vuelo (-1 libre) */
+  static int32_t infl[65536];
+  for(int i=0;i<65536;i++) infl[i] = -1;
+  size_t next = 0, inflight = 0, nsep = 0;
+  uint16_t mid = (uint16_t)(now_us() & 0xFFFF);
+  uint32_t *lat = (uint32_t*)malloc(nev*sizeof *lat); size_t nlat = 0;
+  long lost = 0, sent = 0;
+  uint8_t rx[1500];
+
+  uint64_t t0 = ev[0].t_us, start = now_us(), last_sweep = start;
+  while(next<nev || inflight>0 || nsep>0){
+    uint64_t now = now_us(), wait_us = 50000;
+    int burst = 0;
+    while(next<nev){
+      /* leer respuestas entre ráfagas largas para no desbordar el socket */
+      if(++burst>BURST_MAX){ wait_us = 0; break; }
+      ev_t *e = &ev[next];
+      if(speed==0){ if(inflight>=(size_t)conc) break; }
+      else {
+        uint64_t due = start + (uint64_t)((double)(e->t_us>=t0 ? e->t_us-t0 : 0)/speed);
+        if(due>now){ if(due-now<wait_us) wait_us = due-now; break; }
+      }
+      if(!e->noreply && e->len>=4){
+        int guard = 0;
+        while(infl[mid]!=-1 && guard++<65536) mid++;
+        e->pkt[2] = (uint8_t)(mid>>8); e->pkt[3] = (uint8_t)mid;
+        infl[mid] = (int32_t)next; inflight++; mid++;
+      }
+      e->sent_us = now;
+      send(s, e->pkt, e->len, 0);
+      sent++; next++;
+    }
+
+    struct pollfd pf = { s, POLLIN, 0 };
+    if(poll(&pf, 1, wait_us ? (int)(wait_us/1000u)+1 : 0)>0){
+      ssize_t r;
+      while((r = recv(s, rx, sizeof rx, MSG_DONTWAIT))>0){
+        coap_msg_t m;
+        if(coap_parse(rx, (size_t)r, &m)<0 && r<4) continue;
+        ev_t *e = NULL;
+        if(m.h.type==COAP_TYPE_ACK || m.h.type==COAP_TYPE_RST){
+          int32_t k = infl[m.h.mid];
+          if(k<0) continue;
+          infl[m.h.mid] = -1; inflight--;
+          e = &ev[k];
+          if(m.h.type==COAP_TYPE_ACK && m.h.code==0){ e->waiting_sep = 1; nsep++; continue; }
+        }else{
+          /* NON de respuesta (mismo MID y token) o respuesta separada (por
+             token: tras ACK vacío si era CON, o NON con MID propio si era NON) */
+          int32_t k = infl[m.h.mid];
+          if(k>=0 && m.h.type==COAP_TYPE_NON && pkt_token_is(&ev[k], m.h.token, m.h.tkl)){
+            infl[m.h.mid] = -1; inflight--; e = &ev[k];
+          }
+          else for(size_t i=0;i<next && !e;i++){
+            ev_t *c = &ev[i];
+            if(c->noreply || c->got!=CODE_NONE || !pkt_token_is(c, m.h.token, m.h.tkl)) continue;
+            if(c->waiting_sep){ e = c; c->waiting_sep = 0; nsep--; }
+            else if(infl[pkt_mid(c)]==(int32_t)i){ e = c; infl[pkt_mid(c)] = -1; inflight--; }
+          }
+          if(m.h.type==COAP_TYPE_CON){
+            uint8_t ack[4] = { (COAP_VER<<6)|(COAP_TYPE_ACK<<4), 0, rx[2], rx[3] };
+            send(s, ack, sizeof ack, 0);
+          }
+          if(!e) continue;
+        }
+        e->got = m.h.type==COAP_TYPE_RST ? CODE_RST : m.h.code;
+        lat[nlat++] = (uint32_t)(now_us()-e->sent_us);
+      }
+    }
+
+    now = now_us();
+    if(now-last_sweep>100000u){
+      last_sweep = now;
+      for(int i=0;i<65536;i++) if(infl[i]>=0 && now-ev[infl[i]].sent_us>TIMEOUT_US){
+        infl[i] = -1; inflight--; lost++;
+      }
+      if(nsep) for(size_t i=0;i<next;i++) if(ev[i].waiting_sep && now-ev[i].sent_us>SEP_TIMEOUT_US){
+        ev[i].waiting_sep = 0; nsep--; lost++;
+      }
+    }
+  }
+  double secs = (double)(now_us()-start)/1e6;
+  double orig = (double)(ev[nev-1].t_us-t0)/1e6;
+
+  long compared = 0, mismatch = 0;
+  for(size_t i=0;i<nev;i++){
+    if(ev[i].noreply || ev[i].expect==CODE_NONE || ev[i].got==CODE_NONE) continue;
+    compared++;
+    if(ev[i].got!=ev[i].expect){
+      if(mismatch<MAX_MISMATCH_SHOWN){
+        char a[16], b[16]; code_str(ev[i].expect, a, sizeof a); code_str(ev[i].got, b, sizeof b);
+        printf("  #%zu: esperado %s, recibido %s\n", i, a, b);
+      }
+      mismatch++;
+    }
+  }
+
+  printf("%ld mensajes en %.3f s (original %.3f s, %s) -> %.0f msg/s\n", sent, secs, orig,
+         speed==0 ? "--max" : "escalado", (double)sent/(secs>0?secs:1e-9));
+  printf("respuestas: %zu  perdidas: %ld  comparadas: %ld  distintas: %ld\n", nlat, lost, compared, mismatch);
+  if(nlat){
+    qsort(lat, nlat, sizeof *lat, cmp_u32);
+    printf("latencia us: p50=%u p90=%u p99=%u max=%u\n",
+           lat[nlat/2], lat[nlat*9/10], lat[nlat*99/100], lat[nlat-1]);
+  }
+  for(size_t i=0;i<nev;i++) free(ev[i].pkt);
+  free(ev); free(lat); close(s);
+  return mismatch ? 1 : 0;
+}
@@ -48,7 +48,8 @@ static void* worker(void *arg){
   // Uri-Path -> construir string "/a/b"
   char path[256]; size_t used=0; path[0]='\0';
   for(size_t i=0;i<req.optc;i++) if(req.opt[i].num==OPT_URI_PATH){
-    if(used+1>=sizeof path) break; path[used++]='/';
+    if(used+1>=sizeof path) break;
+    path[used++]='/';
     size_t n=req.opt[i].len; if(used+n>=sizeof path) n=sizeof(path)-used-1;
     memcpy(&path[used], req.opt[i].val, n); used+=n; path[used]='\0';
   }
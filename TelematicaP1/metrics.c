@@ -0,0 +1,364 @@
+#define _POSIX_C_SOURCE 200809L
+#include "metrics.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+  #include <arpa/inet.h>
+  #include <sys/socket.h>
+  #include <sys/time.h>
+  #include <unistd.h>
+#endif
+#include <pthread.h>
+
+/* Un shard por hilo (asignado round-robin la primera vez que el hilo escribe).
+   Alineado a 64 B para que dos hilos no compartan línea de caché. */
+#define METRICS_SHARDS 16
+
+typedef struct {
+  uint64_t c[M_COUNTER_COUNT];
+  uint64_t req[4][8];                /* [tipo][método: 0..6, 7 = otros] */
+  uint64_t resp[256];                /* por código de respuesta */
+  uint64_t hist[H_COUNT][METRICS_HIST_BUCKETS+1];
+  uint64_t hsum[H_COUNT];
+  uint64_t chist[WQ_CLASSES][METRICS_HIST_BUCKETS+1];
+  uint64_t csum[WQ_CLASSES];
+  uint64_t cshed[WQ_CLASSES];
+} __attribute__((aligned(64))) shard_t;
+
+static shard_t shards[METRICS_SHARDS];
+static unsigned next_shard = 0;
+static __thread int my_shard = -1;
+
+static shard_t *shard(void){
+  if(my_shard<0)
+    my_shard = (int)(__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % METRICS_SHARDS);
+  return &shards[my_shard];
+}
+
+static inline void add(uint64_t *p, uint64_t v){ __atomic_fetch_add(p, v, __ATOMIC_RELAXED); }
+static inline uint64_t ld(const uint64_t *p){ return __atomic_load_n(p, __ATOMIC_RELAXED); }
+
+void metrics_add(metric_id id, uint64_t v){
+  if(id<M_COUNTER_COUNT) add(&shard()->c[id], v);
+}
+
+void metrics_request(uint8_t type, uint8_t code){
+  add(&shard()->req[type&3][code<7 ? code : 7], 1);
+}
+
+void metrics_response(uint8_t code){
+  add(&shard()->resp[code], 1);
+}
+
+/* bucket b cuenta valores < 2^b; el último es +Inf */
+static int bucket(uint64_t usec){
+  int b = usec ? 64 - __builtin_clzll(usec) : 0;
+  return b>METRICS_HIST_BUCKETS ? METRICS_HIST_BUCKETS : b;
+}
+
+void metrics_observe(hist_id h, uint64_t usec){
+  if(h>=H_COUNT) return;
+  shard_t *s = shard();
+  add(&s->hist[h][bucket(usec)], 1);
+  add(&s->hsum[h], usec);
+}
+
+void metrics_class_observe(int cls, uint64_t usec){
+  if(cls<0 || cls>=WQ_CLASSES) return;
+  shard_t *s = shard();
+  add(&s->chist[cls][bucket(usec)], 1);
+  add(&s->csum[cls], usec);
+}
+
+void metrics_class_shed(int cls){
+  if(cls>=0 && cls<WQ_CLASSES) add(&shard()->cshed[cls], 1);
+}
+
+static size_t (*depth_fn)(int) = NULL;
+void metrics_class_depth_fn(size_t (*fn)(int cls)){ depth_fn = fn; }
+
+uint64_t metrics_now_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000u + (uint64_t)ts.tv_nsec/1000u;
+}
+
+/* ======== Agregación y volcado ======== */
+typedef struct {
+  uint64_t c[M_COUNTER_COUNT];
+  uint64_t req[4][8];
+  uint64_t resp[256];
+  uint64_t hist[H_COUNT][METRICS_HIST_BUCKETS+1];
+  uint64_t hsum[H_COUNT];
+  uint64_t chist[WQ_CLASSES][METRICS_HIST_BUCKETS+1];
+  uint64_t csum[WQ_CLASSES];
+  uint64_t cshed[WQ_CLASSES];
+  uint64_t cdepth[WQ_CLASSES];
+} snap_t;
+
+static void snapshot(snap_t *o){
+  memset(o, 0, sizeof *o);
+  for(int s=0;s<METRICS_SHARDS;s++){
+    const shard_t *p = &shards[s];
+    for(int i=0;i<M_COUNTER_COUNT;i++) o->c[i] += ld(&p->c[i]);
+    for(int t=0;t<4;t++) for(int m=0;m<8;m++) o->req[t][m] += ld(&p->req[t][m]);
+    for(int i=0;i<256;i++) o->resp[i] += ld(&p->resp[i]);
+    for(int h=0;h<H_COUNT;h++){
+      for(int b=0;b<=METRICS_HIST_BUCKETS;b++) o->hist[h][b] += ld(&p->hist[h][b]);
+      o->hsum[h] += ld(&p->hsum[h]);
+    }
+    for(int c=0;c<WQ_CLASSES;c++){
+      for(int b=0;b<=METRICS_HIST_BUCKETS;b++) o->chist[c][b] += ld(&p->chist[c][b]);
+      o->csum[c] += ld(&p->csum[c]);
+      o->cshed[c] += ld(&p->cshed[c]);
+    }
+  }
+  for(int c=0;c<WQ_CLASSES;c++) o->cdepth[c] = depth_fn ? depth_fn(c) : 0;
+}
+
+/* Cuantil aproximado: cota superior del bucket donde se alcanza (0 si vacío) */
+static uint64_t quantile(const uint64_t *hist, double q){
+  uint64_t n = 0, cum = 0;
+  for(int b=0;b<=METRICS_HIST_BUCKETS;b++) n += hist[b];
+  if(!n) return 0;
+  for(int b=0;b<METRICS_HIST_BUCKETS;b++){
+    cum += hist[b];
+    if((double)cum >= q*(double)n) return 1ull<<b;
+  }
+  return 1ull<<METRICS_HIST_BUCKETS;
+}
+
+static const char *cnames[M_COUNTER_COUNT] = {
+  "pkts_in","pkts_out","bytes_in","bytes_out","rst_sent",
+  "parse_fail","drops","store_hit","store_miss","rate_limited","shed",
+  "proxy_hit","proxy_miss","proxy_coalesced","proxy_batched","proxy_upstream_fail",
+  "proxy_write_dropped","tcp_conns","store_expired","store_full",
+  "sep_deferred","sep_retransmit","sep_timeout"
+};
+static const char *tnames[4] = { "CON","NON","ACK","RST" };
+static const char *mnames[8] = { "EMPTY","GET","POST","PUT","DELETE","FETCH","PATCH","OTHER" };
+static const char *hnames[H_COUNT] = { "handler_us","queue_us" };
+static const char *cls_names[WQ_CLASSES] = { "control","write","non","bulk" };
+
+/* Añade al volcado. Si no cabe, *pos queda en cap y las siguientes llamadas
+   no hacen nada: el renderizador devuelve -1 en vez de un texto cortado. */
+static void ap(char *out, size_t cap, size_t *pos, const char *fmt, ...){
+  if(*pos>=cap) return;
+  va_list va; va_start(va, fmt);
+  int n = vsnprintf(out+*pos, cap-*pos, fmt, va);
+  va_end(va);
+  if(n<0 || (size_t)n>=cap-*pos){ *pos = cap; return; }
+  *pos += (size_t)n;
+}
+
+static int done(char *out, size_t cap, size_t pos){
+  if(pos<cap) return (int)pos;
+  out[0] = 0;
+  return -1;
+}
+
+/* Los METRICS_JSON_TOP mayores de v[0..n) distintos de 0, de mayor a menor.
+   Devuelve cuántos deja en idx; *rest suma los demás. */
+static int top_n(const uint64_t *v, int n, int *idx, uint64_t *rest){
+  int k = 0; *rest = 0;
+  for(int i=0;i<n;i++){
+    if(!v[i]) continue;
+    if(k==METRICS_JSON_TOP){                /* lleno: sustituye al menor si gana */
+      if(v[i]<=v[idx[k-1]]){ *rest += v[i]; continue; }
+      *rest += v[idx[--k]];
+    }
+    int j = k++;
+    while(j>0 && v[idx[j-1]]<v[i]){ idx[j] = idx[j-1]; j--; }
+    idx[j] = i;
+  }
+  return k;
+}
+
+static int render_json(const snap_t *s, int part, char *out, size_t cap){
+  size_t pos = 0; const char *sep;
+  if(!cap) return -1;
+  out[0] = 0;
+
+  if(part==METRICS_JSON_COUNTERS){
+    ap(out,cap,&pos,"{");
+    for(int i=0;i<M_COUNTER_COUNT;i++)
+      ap(out,cap,&pos,"%s\"%s\":%llu", i?",":"", cnames[i], (unsigned long long)s->c[i]);
+    ap(out,cap,&pos,"}");
+  }else if(part==METRICS_JSON_CODES){
+    /* los más frecuentes; el resto va a "other" para acotar el tamaño */
+    int idx[METRICS_JSON_TOP], k; uint64_t rest;
+    k = top_n(&s->req[0][0], 4*8, idx, &rest);
+    ap(out,cap,&pos,"{\"req\":{"); sep="";
+    for(int i=0;i<k;i++){
+      ap(out,cap,&pos,"%s\"%s.%s\":%llu", sep, tnames[idx[i]/8], mnames[idx[i]%8],
+         (unsigned long long)(&s->req[0][0])[idx[i]]); sep=",";
+    }
+    if(rest) ap(out,cap,&pos,"%s\"other\":%llu", sep, (unsigned long long)rest);
+    k = top_n(s->resp, 256, idx, &rest);
+    ap(out,cap,&pos,"},\"resp\":{"); sep="";
+    for(int i=0;i<k;i++){
+      ap(out,cap,&pos,"%s\"%d.%02d\":%llu", sep, idx[i]>>5, idx[i]&0x1F, (unsigned long long)s->resp[idx[i]]); sep=",";
+    }
+    if(rest) ap(out,cap,&pos,"%s\"other\":%llu", sep, (unsigned long long)rest);
+    ap(out,cap,&pos,"}}");
+  }else if(part==METRICS_JSON_LATENCY){
+    /* resúmenes (n, suma, cuantiles): los histogramas completos van en Prometheus */
+    ap(out,cap,&pos,"{");
+    for(int h=0;h<H_COUNT;h++){
+      uint64_t n = 0;
+      for(int b=0;b<=METRICS_HIST_BUCKETS;b++) n += s->hist[h][b];
+      ap(out,cap,&pos,"\"%s\":{\"n\":%llu,\"sum\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu},",
+         hnames[h], (unsigned long long)n, (unsigned long long)s->hsum[h],
+         (unsigned long long)quantile(s->hist[h], 0.5), (unsigned long long)quantile(s->hist[h], 0.9),
+         (unsigned long long)quantile(s->hist[h], 0.99));
+    }
+    ap(out,cap,&pos,"\"class\":{");
+    for(int c=0;c<WQ_CLASSES;c++){
+      uint64_t n = 0;
+      for(int b=0;b<=METRICS_HIST_BUCKETS;b++) n += s->chist[c][b];
+      ap(out,cap,&pos,"%s\"%s\":{\"depth\":%llu,\"shed\":%llu,\"n\":%llu,\"p50_us\":%llu,\"p99_us\":%llu}",
+         c?",":"", cls_names[c], (unsigned long long)s->cdepth[c], (unsigned long long)s->cshed[c],
+         (unsigned long long)n, (unsigned long long)quantile(s->chist[c], 0.5),
+         (unsigned long long)quantile(s->chist[c], 0.99));
+    }
+    ap(out,cap,&pos,"}}");
+  }else return -1;
+  return done(out, cap, pos);
+}
+
+static int render_prom(const snap_t *s, char *out, size_t cap){
+  size_t pos = 0;
+  if(!cap) return -1;
+  out[0] = 0;
+
+  for(int i=0;i<M_COUNTER_COUNT;i++)
+    ap(out,cap,&pos,"# TYPE coap_%s_total counter\ncoap_%s_total %llu\n",
+       cnames[i], cnames[i], (unsigned long long)s->c[i]);
+
+  ap(out,cap,&pos,"# TYPE coap_requests_total counter\n");
+  for(int t=0;t<4;t++) for(int m=0;m<8;m++) if(s->req[t][m])
+    ap(out,cap,&pos,"coap_requests_total{type=\"%s\",method=\"%s\"} %llu\n",
+       tnames[t], mnames[m], (unsigned long long)s->req[t][m]);
+
+  ap(out,cap,&pos,"# TYPE coap_responses_total counter\n");
+  for(int i=0;i<256;i++) if(s->resp[i])
+    ap(out,cap,&pos,"coap_responses_total{code=\"%d.%02d\"} %llu\n",
+       i>>5, i&0x1F, (unsigned long long)s->resp[i]);
+
+  for(int h=0;h<H_COUNT;h++){
+    uint64_t cum = 0;
+    ap(out,cap,&pos,"# TYPE coap_%s histogram\n", hnames[h]);
+    for(int b=0;b<METRICS_HIST_BUCKETS;b++){
+      cum += s->hist[h][b];
+      ap(out,cap,&pos,"coap_%s_bucket{le=\"%llu\"} %llu\n", hnames[h], 1ull<<b, (unsigned long long)cum);
+    }
+    cum += s->hist[h][METRICS_HIST_BUCKETS];
+    ap(out,cap,&pos,"coap_%s_bucket{le=\"+Inf\"} %llu\n", hnames[h], (unsigned long long)cum);
+    ap(out,cap,&pos,"coap_%s_sum %llu\ncoap_%s_count %llu\n",
+       hnames[h], (unsigned long long)s->hsum[h], hnames[h], (unsigned long long)cum);
+  }
+
+  ap(out,cap,&pos,"# TYPE coap_class_queue_depth gauge\n");
+  for(int c=0;c<WQ_CLASSES;c++)
+    ap(out,cap,&pos,"coap_class_queue_depth{class=\"%s\"} %llu\n", cls_names[c], (unsigned long long)s->cdepth[c]);
+  ap(out,cap,&pos,"# TYPE coap_class_shed_total counter\n");
+  for(int c=0;c<WQ_CLASSES;c++)
+    ap(out,cap,&pos,"coap_class_shed_total{class=\"%s\"} %llu\n", cls_names[c], (unsigned long long)s->cshed[c]);
+  ap(out,cap,&pos,"# TYPE coap_class_latency_us histogram\n");
+  for(int c=0;c<WQ_CLASSES;c++){
+    uint64_t cum = 0;
+    for(int b=0;b<METRICS_HIST_BUCKETS;b++){
+      cum += s->chist[c][b];
+      ap(out,cap,&pos,"coap_class_latency_us_bucket{class=\"%s\",le=\"%llu\"} %llu\n",
+         cls_names[c], 1ull<<b, (unsigned long long)cum);
+    }
+    cum += s->chist[c][METRICS_HIST_BUCKETS];
+    ap(out,cap,&pos,"coap_class_latency_us_bucket{class=\"%s\",le=\"+Inf\"} %llu\n", cls_names[c], (unsigned long long)cum);
+    ap(out,cap,&pos,"coap_class_latency_us_sum{class=\"%s\"} %llu\ncoap_class_latency_us_count{class=\"%s\"} %llu\n",
+       cls_names[c], (unsigned long long)s->csum[c], cls_names[c], (unsigned long long)cum);
+  }
+  return done(out, cap, pos);
+}
+
+/* snap_t es grande para la pila de un hilo; los volcados son raros */
+static snap_t snap;
+static pthread_mutex_t smtx = PTHREAD_MUTEX_INITIALIZER;
+
+int metrics_render_json(char *out, size_t cap, int part){
+  pthread_mutex_lock(&smtx);
+  snapshot(&snap);
+  int n = render_json(&snap, part, out, cap);
+  pthread_mutex_unlock(&smtx);
+  return n;
+}
+
+int metrics_render_prom(char *out, size_t cap){
+  pthread_mutex_lock(&smtx);
+  snapshot(&snap);
+  int n = render_prom(&snap, out, cap);
+  pthread_mutex_unlock(&smtx);
+  return n;
+}
+
+/* Todo al máximo (cada contador y bucket a 2^64-1, todos los códigos vistos):
+   el volcado más largo posible, que debe caber en los buffers fijos */
+int metrics_check_worst(int *json_max, int *prom_max){
+  static snap_t w;
+  static char buf[METRICS_PROM_MAX];
+  int rc = 0;
+  memset(&w, 0xFF, sizeof w);
+  *json_max = 0;
+  for(int p=0;p<METRICS_JSON_PARTS;p++){
+    int n = render_json(&w, p, buf, METRICS_JSON_MAX);
+    if(n<0) rc = -1;
+    else if(n>*json_max) *json_max = n;
+  }
+  *prom_max = render_prom(&w, buf, sizeof buf);
+  if(*prom_max<0) rc = -1;
+  return rc;
+}
+
+/* ======== Exportador Prometheus (TCP local) ======== */
+#ifndef _WIN32
+static void* prom_thread(void *arg){
+  int ls = (int)(intptr_t)arg;
+  static char body[METRICS_PROM_MAX];
+  for(;;){
+    int c = accept(ls, NULL, NULL);
+    if(c<0) continue;
+    /* consumir la petición HTTP (si la hay) sin bloquear indefinidamente */
+    struct timeval tv = { 0, 200000 };
+    setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    char req[512]; (void)recv(c, req, sizeof req, 0);
+    int n = metrics_render_prom(body, sizeof body);
+    char hdr[128];
+    int hn = n>=0 ? snprintf(hdr, sizeof hdr,
+                             "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %d\r\n\r\n", n)
+                  : snprintf(hdr, sizeof hdr, "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+    send(c, hdr, (size_t)hn, 0);
+    if(n>0) send(c, body, (size_t)n, 0);
+    close(c);
+  }
+  return NULL;
+}
+
+int metrics_serve_prom(int port){
+  int ls = socket(AF_INET, SOCK_STREAM, 0);
+  if(ls<0) return -1;
+  int one = 1; setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  struct sockaddr_in a; memset(&a,0,sizeof a);
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  a.sin_port = htons((uint16_t)port);
+  if(bind(ls,(struct sockaddr*)&a,sizeof a)<0 || listen(ls,8)<0){ close(ls); return -1; }
+  pthread_t th;
+  if(pthread_create(&th,NULL,prom_thread,(void*)(intptr_t)ls)!=0){ close(ls); return -1; }
+  pthread_detach(th);
+  return 0;
+}
+#else
+int metrics_serve_prom(int port){ (void)port; return -1; }
+#endif
@@ -0,0 +1,80 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stdint.h>
+#include <stddef.h>
+#include "workq.h"   /* clases de prioridad */
+
+/* Contadores del servidor. Cada hilo escribe en su propio shard con sumas
+   atómicas relajadas (sin mutex); la lectura agrega todos los shards. */
+typedef enum {
+  M_PKTS_IN = 0,   /* datagramas recibidos */
+  M_PKTS_OUT,      /* datagramas enviados */
+  M_BYTES_IN,
+  M_BYTES_OUT,
+  M_RST_SENT,
+  M_PARSE_FAIL,    /* cabecera u opciones inválidas */
+  M_DROPS,         /* recvfrom/malloc fallidos */
+  M_STORE_HIT,
+  M_STORE_MISS,
+  M_RATE_LIMITED,  /* rechazadas por el token bucket del par */
+  M_SHED,          /* rechazadas con la cola de trabajo llena */
+  M_PROXY_HIT,     /* GET servido desde la caché del proxy */
+  M_PROXY_MISS,    /* GET que fue al upstream */
+  M_PROXY_COALESCED, /* GET que esperó a otro idéntico ya en curso, o POST fusionado */
+  M_PROXY_BATCHED, /* escrituras enviadas al upstream por el volcado en lote */
+  M_PROXY_UPSTREAM_FAIL, /* intercambios con el upstream sin respuesta o con RST */
+  M_PROXY_WRITE_DROPPED, /* escrituras del lote descartadas tras BATCH_MAX_TRIES */
+  M_TCP_CONNS,     /* conexiones CoAP sobre TCP aceptadas */
+  M_STORE_EXPIRED, /* entradas liberadas por TTL */
+  M_STORE_FULL,    /* escrituras rechazadas con la tabla llena */
+  M_SEP_DEFERRED,  /* peticiones respondidas por separado (ACK vacío + respuesta) */
+  M_SEP_RETRANSMIT, /* reenvíos de respuestas separadas CON */
+  M_SEP_TIMEOUT,   /* respuestas separadas que nunca se confirmaron */
+  M_COUNTER_COUNT
+} metric_id;
+
+typedef enum {
+  H_HANDLER_US = 0, /* duración de handle_one */
+  H_QUEUE_US,       /* desde recvfrom hasta que un worker la saca de la cola */
+  H_COUNT
+} hist_id;
+
+#define METRICS_HIST_BUCKETS 24  /* buckets log2 en µs: <1, <2, <4 ... <2^23 (~8 s), +Inf */
+
+void metrics_add(metric_id id, uint64_t v);
+static inline void metrics_inc(metric_id id){ metrics_add(id, 1); }
+
+/* type = tipo CoAP (CON/NON/ACK/RST), code = código de método o de respuesta */
+void metrics_request(uint8_t type, uint8_t code);
+void metrics_response(uint8_t code);
+void metrics_observe(hist_id h, uint64_t usec);
+
+/* Por clase de prioridad: latencia desde recvfrom hasta tener la respuesta
+   enviada y rechazos por cola llena. La profundidad de cada cola se lee al
+   volcar, con la función registrada (sin ella no se publica). */
+void metrics_class_observe(int cls, uint64_t usec);
+void metrics_class_shed(int cls);
+void metrics_class_depth_fn(size_t (*fn)(int cls));
+
+uint64_t metrics_now_us(void);  /* reloj monótono */
+
+/* Volcados: JSON compacto en tres partes (recursos /.well-known/metrics,
+   .../codes y .../latency) y texto Prometheus con los histogramas completos.
+   Devuelven bytes escritos (sin el '\0'), o -1 y out vacío si no cabe:
+   nunca un volcado cortado. */
+enum { METRICS_JSON_COUNTERS = 0, METRICS_JSON_CODES, METRICS_JSON_LATENCY, METRICS_JSON_PARTS };
+#define METRICS_JSON_MAX  1024   /* cota de cada parte JSON: cabe en un datagrama CoAP */
+#define METRICS_JSON_TOP  12     /* códigos de petición/respuesta por volcado; el resto en "other" */
+#define METRICS_PROM_MAX  65536
+int metrics_render_json(char *out, size_t cap, int part);
+int metrics_render_prom(char *out, size_t cap);
+
+/* Renderiza el peor caso (todo al máximo) y deja los tamaños obtenidos.
+   0 si cada parte JSON cabe en METRICS_JSON_MAX y Prometheus en METRICS_PROM_MAX. */
+int metrics_check_worst(int *json_max, int *prom_max);
+
+/* Lanza un hilo que sirve el volcado Prometheus en 127.0.0.1:<port> (TCP).
+   0 si OK, -1 si falla (o en Windows). */
+int metrics_serve_prom(int port);
+
+#endif
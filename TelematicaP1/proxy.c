@@ -0,0 +1,649 @@
+#define _POSIX_C_SOURCE 200809L
+#include "proxy.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_SLOTS        64
+#define BATCH_SLOTS        64
+#define KEY_LEN            (2*PROXY_URI_MAX+24)
+#define TKL                4
+#define DEFAULT_MAX_AGE    60     /* RFC 7252 §5.10.5 */
+#define UP_ACK_TIMEOUT_MS  500    /* corto: el cliente espera detrás de nosotros */
+#define UP_MAX_RETRANSMIT  2
+#define UP_SEPARATE_MS     5000   /* espera de la respuesta tras un ACK vacío */
+#define BATCH_MAX_TRIES    3
+#define BATCH_WAITERS      8      /* escrituras CON fusionadas que esperan el mismo envío */
+
+/* ======== Destino: dirección del upstream + ruta y query ======== */
+typedef struct {
+  struct sockaddr_in addr;
+  char path[PROXY_URI_MAX];   /* "/a/b" ("" = raíz) */
+  char query[PROXY_URI_MAX];  /* "x=1&y=2", sin '?' */
+} target_t;
+
+static int enabled = 0, batch_ms = 0;
+static int have_default = 0;
+static struct sockaddr_in def_up;
+static uint32_t seq = 0, salt = 0;
+static proxy_log_fn log_fn = NULL;
+
+static int resolve(const char *host, uint16_t port, struct sockaddr_in *out){
+  memset(out, 0, sizeof *out);
+  out->sin_family = AF_INET; out->sin_port = htons(port);
+  if(inet_pton(AF_INET, host, &out->sin_addr)==1) return 0;
+  struct addrinfo hints, *res = NULL;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_INET; hints.ai_socktype = SOCK_DGRAM;
+  if(getaddrinfo(host, NULL, &hints, &res)!=0 || !res) return -1;
+  out->sin_addr = ((struct sockaddr_in*)res->ai_addr)->sin_addr;
+  freeaddrinfo(res);
+  return 0;
+}
+
+/* "host[:port]" -> dirección (puerto 5683 si no viene) */
+static int resolve_hostport(const char *hp, size_t len, struct sockaddr_in *out){
+  char host[64]; unsigned port = 5683;
+  size_t hl = 0;
+  while(hl<len && hp[hl]!=':') hl++;
+  if(hl==0 || hl>=sizeof host) return -1;
+  memcpy(host, hp, hl); host[hl] = 0;
+  if(hl<len){
+    port = 0;
+    for(size_t k=hl+1;k<len;k++){
+      if(hp[k]<'0' || hp[k]>'9') return -1;
+      port = port*10 + (unsigned)(hp[k]-'0');
+      if(port>65535) return -1;
+    }
+  }
+  return resolve(host, (uint16_t)port, out);
+}
+
+/* Concatena las opciones num con sep delante de cada una (Uri-Path) o entre ellas (Uri-Query) */
+static int join_opts(const coap_msg_t *m, uint16_t num, char sep, int lead, char *out, size_t cap){
+  size_t w = 0;
+  for(size_t i=0;i<m->optc;i++){
+    if(m->opt[i].num!=num) continue;
+    if(lead || w) { if(w+1>=cap) return -1; out[w++] = sep; }
+    if(w+m->opt[i].len>=cap) return -1;
+    memcpy(out+w, m->opt[i].val, m->opt[i].len); w += m->opt[i].len;
+  }
+  out[w] = 0;
+  return 0;
+}
+
+/* Proxy-Uri: coap://host[:port][/ruta][?query] (sin decodificar %xx) */
+static uint8_t target_from_uri(const coap_opt_t *o, target_t *t){
+  static const char scheme[] = "coap://";
+  const char *u = (const char*)o->val; size_t len = o->len, sl = sizeof scheme - 1;
+  if(len<sl || memcmp(u, scheme, sl)!=0) return COAP_5_05_NOPROXY;
+  size_t h = sl, p = h;
+  while(p<len && u[p]!='/' && u[p]!='?') p++;
+  if(resolve_hostport(u+h, p-h, &t->addr)<0) return COAP_5_02_BADGW;
+  size_t q = p;
+  while(q<len && u[q]!='?') q++;
+  if(q-p>=sizeof t->path || (q<len && len-q-1>=sizeof t->query)) return COAP_4_00_BADREQ;
+  memcpy(t->path, u+p, q-p); t->path[q-p] = 0;
+  if(q<len){ memcpy(t->query, u+q+1, len-q-1); t->query[len-q-1] = 0; }
+  else t->query[0] = 0;
+  return 0;
+}
+
+/* Proxy-Scheme: el destino sale de Uri-Host/Uri-Port/Uri-Path/Uri-Query */
+static uint8_t target_from_opts(const coap_msg_t *m, const coap_opt_t *sch, target_t *t){
+  if(sch->len!=4 || memcmp(sch->val, "coap", 4)!=0) return COAP_5_05_NOPROXY;
+  const coap_opt_t *host = coap_find_opt(m, OPT_URI_HOST);
+  if(host){
+    char hp[64];
+    if(host->len>=sizeof hp) return COAP_4_00_BADREQ;
+    memcpy(hp, host->val, host->len); hp[host->len] = 0;
+    if(resolve(hp, (uint16_t)coap_opt_uint(m, OPT_URI_PORT, 5683), &t->addr)<0) return COAP_5_02_BADGW;
+  }else if(have_default){
+    t->addr = def_up;
+    if(coap_find_opt(m, OPT_URI_PORT))
+      t->addr.sin_port = htons((uint16_t)coap_opt_uint(m, OPT_URI_PORT, 5683));
+  }else return COAP_4_00_BADREQ;
+  if(join_opts(m, OPT_URI_PATH, '/', 1, t->path, sizeof t->path)<0 ||
+     join_opts(m, OPT_URI_QUERY, '&', 0, t->query, sizeof t->query)<0) return COAP_4_00_BADREQ;
+  return 0;
+}
+
+static void make_key(const target_t *t, char *key, size_t cap){
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &t->addr.sin_addr, ip, sizeof ip);
+  snprintf(key, cap, "%s:%u%s%s%s", ip, (unsigned)ntohs(t->addr.sin_port),
+           t->path[0] ? t->path : "/", t->query[0] ? "?" : "", t->query);
+}
+
+static void resp_simple(proxy_resp_t *r, uint8_t code, const char *payload){
+  r->code = code; r->cf = -1; r->has_max_age = 0; r->max_age = 0; r->etag_len = 0;
+  r->plen = payload ? strlen(payload) : 0;
+  if(r->plen) memcpy(r->payload, payload, r->plen);
+}
+
+/* ======== Intercambios CON con el upstream ======== */
+enum { X_WAIT_ACK, X_WAIT_SEP, X_DONE, X_FAIL };
+
+typedef struct {
+  struct sockaddr_in dst;
+  uint8_t pkt[1500]; size_t n;
+  uint16_t mid; uint8_t tok[TKL];
+  int state, tries;
+  uint64_t next_us;   /* próxima retransmisión, o fin de la espera de la respuesta separada */
+  proxy_resp_t r;
+} xchg_t;
+
+static void enc_segments(coap_enc_t *e, uint16_t num, const char *s, char sep){
+  while(*s){
+    while(*s==sep) s++;
+    const char *q = s; while(*q && *q!=sep) q++;
+    if(q>s) coap_enc_opt(e, num, s, (size_t)(q-s));
+    s = q;
+  }
+}
+
+/* MID y token únicos: el token es una biyección del contador, así no se repite
+   mientras no den la vuelta 2^32 intercambios */
+static void prep(xchg_t *x, const target_t *t, uint8_t code,
+                 const uint8_t *etag, uint8_t etag_len, int cf, const uint8_t *body, size_t blen){
+  uint32_t v = __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED);
+  uint32_t h = (v*2654435761u) ^ salt;
+  x->mid = (uint16_t)v;
+  x->tok[0] = (uint8_t)(h>>24); x->tok[1] = (uint8_t)(h>>16); x->tok[2] = (uint8_t)(h>>8); x->tok[3] = (uint8_t)h;
+  x->dst = t->addr;
+
+  coap_enc_t e;
+  coap_enc_init(&e, x->pkt, sizeof x->pkt, COAP_TYPE_CON, code, x->mid, x->tok, TKL);
+  if(etag_len) coap_enc_opt(&e, OPT_ETAG, etag, etag_len);
+  enc_segments(&e, OPT_URI_PATH, t->path, '/');
+  if(cf>=0) coap_enc_opt_uint(&e, OPT_CONTENT_FORMAT, (uint32_t)cf);
+  enc_segments(&e, OPT_URI_QUERY, t->query, '&');
+  if(body) coap_enc_payload(&e, body, blen);
+  x->n = coap_enc_finish(&e);
+}
+
+static void fill_resp(proxy_resp_t *r, const coap_msg_t *m){
+  if(m->plen>PROXY_BODY_MAX){ resp_simple(r, COAP_5_02_BADGW, NULL); return; }
+  r->code = m->h.code;
+  r->cf = coap_find_opt(m, OPT_CONTENT_FORMAT) ? (int)coap_opt_uint(m, OPT_CONTENT_FORMAT, 0) : -1;
+  r->has_max_age = 1;
+  r->max_age = coap_opt_uint(m, OPT_MAX_AGE, DEFAULT_MAX_AGE);
+  const coap_opt_t *o = coap_find_opt(m, OPT_ETAG);
+  r->etag_len = (o && o->len<=sizeof r->etag) ? (uint8_t)o->len : 0;
+  if(r->etag_len) memcpy(r->etag, o->val, r->etag_len);
+  r->plen = m->plen;
+  if(r->plen) memcpy(r->payload, m->payload, r->plen);
+}
+
+static xchg_t *match(xchg_t *x, int n, const coap_msg_t *m){
+  for(int i=0;i<n;i++){
+    xchg_t *c = &x[i];
+    if(c->state!=X_WAIT_ACK && c->state!=X_WAIT_SEP) continue;
+    if(m->h.type==COAP_TYPE_ACK || m->h.type==COAP_TYPE_RST){
+      if(c->state==X_WAIT_ACK && c->mid==m->h.mid &&
+         (m->h.code==0 || (m->h.tkl==TKL && memcmp(m->h.token, c->tok, TKL)==0))) return c;
+    }else if(m->h.tkl==TKL && memcmp(m->h.token, c->tok, TKL)==0) return c;
+  }
+  return NULL;
+}
+
+/* Lleva n intercambios a la vez sobre un socket: retransmisión con backoff
+   exponencial, ACK vacío + respuesta separada y RST. Vuelve cuando todos
+   están en X_DONE o X_FAIL. */
+static void run_exchanges(int sock, xchg_t *x, int n){
+  int left = n;
+  for(int i=0;i<n;i++){
+    x[i].tries = 0; x[i].next_us = 0;
+    x[i].state = x[i].n ? X_WAIT_ACK : X_FAIL;
+    if(!x[i].n) left--;
+  }
+  while(left>0){
+    uint64_t now = metrics_now_us(), wake = now + 1000000u;
+    for(int i=0;i<n;i++){
+      xchg_t *c = &x[i];
+      if(c->state==X_WAIT_ACK && now>=c->next_us){
+        if(c->tries>UP_MAX_RETRANSMIT){ c->state = X_FAIL; left--; continue; }
+        sendto(sock, c->pkt, c->n, 0, (struct sockaddr*)&c->dst, sizeof c->dst);
+        c->next_us = now + ((uint64_t)UP_ACK_TIMEOUT_MS*1000u << c->tries);
+        c->tries++;
+      }else if(c->state==X_WAIT_SEP && now>=c->next_us){ c->state = X_FAIL; left--; continue; }
+      if((c->state==X_WAIT_ACK || c->state==X_WAIT_SEP) && c->next_us<wake) wake = c->next_us;
+    }
+    if(!left) break;
+
+    struct pollfd pf = { sock, POLLIN, 0 };
+    if(poll(&pf, 1, (int)((wake-now)/1000u)+1)<=0) continue;
+    uint8_t rx[1500]; ssize_t r;
+    struct sockaddr_in from; socklen_t fl = sizeof from;
+    while((r = recvfrom(sock, rx, sizeof rx, MSG_DONTWAIT, (struct sockaddr*)&from, &fl))>0){
+      coap_msg_t m; fl = sizeof from;
+      if(coap_parse(rx, (size_t)r, &m)<0) continue;
+      xchg_t *c = match(x, n, &m);
+      if(!c) continue;
+      if(m.h.type==COAP_TYPE_RST){ c->state = X_FAIL; left--; continue; }
+      if(m.h.type==COAP_TYPE_CON){
+        uint8_t ack[4] = { (COAP_VER<<6)|(COAP_TYPE_ACK<<4), 0, rx[2], rx[3] };
+        sendto(sock, ack, sizeof ack, 0, (struct sockaddr*)&from, sizeof from);
+      }
+      if(m.h.type==COAP_TYPE_ACK && m.h.code==0){
+        c->state = X_WAIT_SEP; c->next_us = metrics_now_us() + UP_SEPARATE_MS*1000u;
+        continue;
+      }
+      fill_resp(&c->r, &m); c->state = X_DONE; left--;
+    }
+  }
+}
+
+/* Un intercambio suelto por un socket propio (la respuesta vuelve a ese puerto) */
+static void upstream_call(const target_t *t, uint8_t code, const uint8_t *etag, uint8_t etag_len,
+                          int cf, const uint8_t *body, size_t blen, proxy_resp_t *out){
+  xchg_t x;
+  prep(&x, t, code, etag, etag_len, cf, body, blen);
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if(sock<0 || !x.n){
+    if(sock>=0) close(sock);
+    resp_simple(out, COAP_5_00_SRVERR, NULL);
+    return;
+  }
+  run_exchanges(sock, &x, 1);
+  close(sock);
+  if(x.state==X_DONE) *out = x.r;
+  else { metrics_inc(M_PROXY_UPSTREAM_FAIL); resp_simple(out, COAP_5_04_GWTIMEOUT, NULL); }
+}
+
+/* ======== Caché de GET ======== */
+/* Cada entrada guarda la última respuesta del upstream. pending marca un GET
+   en curso: los idénticos que llegan mientras tanto esperan en cdone y se
+   llevan esa misma respuesta. Sólo 2.05 con Max-Age>0 se sirve desde caché.
+   stale: hubo una escritura a la clave durante el GET en curso, así que su
+   respuesta puede ser anterior a ella y no se guarda. */
+typedef struct {
+  int used, pending, waiters, fresh_ok, stale;
+  char key[KEY_LEN];
+  uint64_t expires_us, last_use;
+  proxy_resp_t r;
+} centry_t;
+
+static centry_t cache[CACHE_SLOTS];
+static pthread_mutex_t cmtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cdone = PTHREAD_COND_INITIALIZER;
+
+static centry_t *cache_find(const char *key){
+  for(int i=0;i<CACHE_SLOTS;i++) if(cache[i].used && strcmp(cache[i].key, key)==0) return &cache[i];
+  return NULL;
+}
+
+/* Hueco libre o, si no hay, la entrada menos usada que nadie está esperando */
+static centry_t *cache_claim(const char *key){
+  centry_t *v = NULL;
+  for(int i=0;i<CACHE_SLOTS;i++){
+    centry_t *e = &cache[i];
+    if(!e->used){ v = e; break; }
+    if(e->pending || e->waiters) continue;
+    if(!v || e->last_use<v->last_use) v = e;
+  }
+  if(!v) return NULL;
+  memset(v, 0, sizeof *v);
+  v->used = 1;
+  snprintf(v->key, sizeof v->key, "%s", key);
+  return v;
+}
+
+static void out_from_entry(const centry_t *e, uint64_t now, proxy_resp_t *out){
+  *out = e->r;
+  if(e->fresh_ok){
+    out->has_max_age = 1;
+    out->max_age = e->expires_us>now ? (uint32_t)((e->expires_us-now+999999u)/1000000u) : 0;
+  }
+}
+
+static int write_pending(const char *key);
+
+static void cached_get(const target_t *t, const char *key, proxy_resp_t *out){
+  pthread_mutex_lock(&cmtx);
+  uint64_t now = metrics_now_us();
+  centry_t *e = cache_find(key);
+  if(e && e->pending){
+    e->waiters++;
+    while(e->pending) pthread_cond_wait(&cdone, &cmtx);
+    e->waiters--;
+    e->last_use = now;
+    out_from_entry(e, metrics_now_us(), out);
+    pthread_mutex_unlock(&cmtx);
+    metrics_inc(M_PROXY_COALESCED);
+    return;
+  }
+  if(e && e->fresh_ok && now<e->expires_us){
+    e->last_use = now;
+    out_from_entry(e, now, out);
+    pthread_mutex_unlock(&cmtx);
+    metrics_inc(M_PROXY_HIT);
+    return;
+  }
+  if(!e) e = cache_claim(key);
+  if(!e){  /* todas las entradas ocupadas por GET en curso: sin caché */
+    pthread_mutex_unlock(&cmtx);
+    metrics_inc(M_PROXY_MISS);
+    upstream_call(t, COAP_GET, NULL, 0, -1, NULL, 0, out);
+    return;
+  }
+  /* entrada caducada con ETag: se revalida en vez de pedir el cuerpo */
+  uint8_t etag[8], etag_len = e->fresh_ok ? e->r.etag_len : 0;
+  memcpy(etag, e->r.etag, etag_len);
+  e->pending = 1; e->stale = 0;
+  pthread_mutex_unlock(&cmtx);
+  metrics_inc(M_PROXY_MISS);
+
+  proxy_resp_t r;
+  upstream_call(t, COAP_GET, etag, etag_len, -1, NULL, 0, &r);
+  /* Con una escritura a la clave en el lote o en vuelo la respuesta se
+     entrega pero no se guarda: sería anterior a esa escritura */
+  int wp = write_pending(key);
+
+  pthread_mutex_lock(&cmtx);
+  now = metrics_now_us();
+  if(wp || e->stale){
+    /* Un 2.03 sólo confirma el cuerpo que ya teníamos (el GET del cliente no
+       llevaba ETag): se entrega ése, sin dejarlo fresco */
+    if(!(etag_len && r.code==COAP_2_03_VALID)) e->r = r;
+    e->fresh_ok = 0;
+  }else if(etag_len && r.code==COAP_2_03_VALID){
+    e->expires_us = now + (uint64_t)r.max_age*1000000u;
+    e->fresh_ok = r.max_age>0;
+  }else{
+    e->r = r;
+    e->fresh_ok = (r.code==COAP_2_05_CONTENT && r.max_age>0);
+    e->expires_us = now + (uint64_t)r.max_age*1000000u;
+  }
+  e->pending = 0; e->last_use = now;
+  out_from_entry(e, now, out);
+  pthread_cond_broadcast(&cdone);
+  pthread_mutex_unlock(&cmtx);
+}
+
+/* Escritura a la clave (encolada o ya contestada por el upstream): fuera la
+   entrada. Si hay un GET en curso sobre ella sólo se marca, para que los que
+   esperan sigan teniendo dónde recoger la respuesta. */
+static void cache_drop(const char *key){
+  pthread_mutex_lock(&cmtx);
+  centry_t *e = cache_find(key);
+  if(e){
+    if(e->pending || e->waiters){ e->fresh_ok = 0; e->stale = 1; }
+    else e->used = 0;
+  }
+  pthread_mutex_unlock(&cmtx);
+}
+
+/* ======== Escrituras agrupadas (write-behind) ======== */
+/* Una entrada por destino: una escritura nueva al mismo destino dentro de la
+   ventana sustituye el cuerpo pendiente (última escritura gana, como en el
+   store del servidor de origen). Las NON se contestan "queued" al encolar;
+   las CON que llegan por proxy_write_async esperan en w[] y reciben la
+   respuesta del envío que las incluye (o de la escritura que las sustituyó). */
+typedef struct { proxy_done_fn fn; void *ctx; } waiter_t;
+
+typedef struct {
+  int used, tries, cf;
+  uint8_t code;
+  target_t t;
+  char key[KEY_LEN];
+  uint8_t body[PROXY_BODY_MAX]; size_t blen;
+  int nw; waiter_t w[BATCH_WAITERS];
+} bentry_t;
+
+static bentry_t batch[BATCH_SLOTS];
+static bentry_t sending[BATCH_SLOTS];   /* el volcado en curso (lo lee write_pending) */
+static int nsending = 0;
+static pthread_mutex_t bmtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Fuera de bmtx: done puede enviar (respuesta separada) */
+static void answer(const waiter_t *w, int n, const proxy_resp_t *r, const char *key){
+  for(int i=0;i<n;i++) w[i].fn(w[i].ctx, r, key);
+}
+
+static void answer_code(const waiter_t *w, int n, uint8_t code, const char *key){
+  proxy_resp_t r;
+  resp_simple(&r, code, NULL);
+  answer(w, n, &r, key);
+}
+
+/* 0 si queda en el lote; -1 si no hay hueco (el llamador reenvía directo).
+   merge=0 (reintento del volcado): si ya hay una más nueva, gana ésa y los que
+   esperaban pasan a esperarla; los que no caben en ella quedan en *over. */
+static int batch_put(const bentry_t *in, int merge, waiter_t *over, int *nover){
+  bentry_t *b = NULL, *fr = NULL;
+  if(nover) *nover = 0;
+  pthread_mutex_lock(&bmtx);
+  for(int i=0;i<BATCH_SLOTS;i++){
+    if(batch[i].used && strcmp(batch[i].key, in->key)==0){ b = &batch[i]; break; }
+    if(!batch[i].used && !fr) fr = &batch[i];
+  }
+  if(b && b->nw+in->nw>BATCH_WAITERS && merge){ pthread_mutex_unlock(&bmtx); return -1; }
+  if(b && !merge){   /* ya hay otra más nueva */
+    for(int i=0;i<in->nw;i++){
+      if(b->nw<BATCH_WAITERS) b->w[b->nw++] = in->w[i];
+      else over[(*nover)++] = in->w[i];
+    }
+    pthread_mutex_unlock(&bmtx);
+    return 0;
+  }
+  if(b){
+    metrics_inc(M_PROXY_COALESCED);
+    waiter_t w[BATCH_WAITERS]; int nw = b->nw;
+    memcpy(w, b->w, (size_t)nw*sizeof *w);
+    *b = *in;
+    memcpy(b->w+in->nw, w, (size_t)nw*sizeof *w); b->nw += nw;
+  }else if((b = fr)!=NULL) *b = *in;
+  else { pthread_mutex_unlock(&bmtx); return -1; }
+  b->used = 1;
+  pthread_mutex_unlock(&bmtx);
+  return 0;
+}
+
+/* Saca del lote la escritura pendiente a key (la sustituye una directa) y
+   deja en w los que esperaban por ella; devuelve cuántos */
+static int batch_take(const char *key, waiter_t *w){
+  int n = 0;
+  pthread_mutex_lock(&bmtx);
+  for(int i=0;i<BATCH_SLOTS;i++)
+    if(batch[i].used && strcmp(batch[i].key, key)==0){
+      memcpy(w, batch[i].w, (size_t)batch[i].nw*sizeof *w); n = batch[i].nw;
+      batch[i].used = 0;
+      break;
+    }
+  pthread_mutex_unlock(&bmtx);
+  return n;
+}
+
+/* 1 si hay una escritura a key en el lote o en el volcado en curso */
+static int write_pending(const char *key){
+  int found = 0;
+  pthread_mutex_lock(&bmtx);
+  for(int i=0;i<BATCH_SLOTS && !found;i++)
+    found = batch[i].used && strcmp(batch[i].key, key)==0;
+  for(int i=0;i<nsending && !found;i++)
+    found = strcmp(sending[i].key, key)==0;
+  pthread_mutex_unlock(&bmtx);
+  return found;
+}
+
+/* Cada batch_ms vacía el lote y lo envía con todos los CON en vuelo a la vez
+   sobre un único socket. Los fallidos vuelven al lote hasta BATCH_MAX_TRIES;
+   después se descartan (se cuentan, se registran y los que esperaban reciben
+   5.04). Tras el envío se tira la caché de cada destino escrito. */
+static void *flusher(void *arg){
+  (void)arg;
+  static xchg_t x[BATCH_SLOTS];
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if(sock<0) return NULL;
+  for(;;){
+    struct timespec ts = { batch_ms/1000, (long)(batch_ms%1000)*1000000L };
+    nanosleep(&ts, NULL);
+
+    int n = 0;
+    pthread_mutex_lock(&bmtx);
+    for(int i=0;i<BATCH_SLOTS;i++)
+      if(batch[i].used){ sending[n++] = batch[i]; batch[i].used = 0; }
+    nsending = n;
+    pthread_mutex_unlock(&bmtx);
+    if(!n) continue;
+
+    for(int i=0;i<n;i++)
+      prep(&x[i], &sending[i].t, sending[i].code, NULL, 0, sending[i].cf, sending[i].body, sending[i].blen);
+    run_exchanges(sock, x, n);
+    metrics_add(M_PROXY_BATCHED, (uint64_t)n);
+
+    for(int i=0;i<n;i++){
+      bentry_t *b = &sending[i];
+      cache_drop(b->key);
+      if(x[i].state==X_DONE){ answer(b->w, b->nw, &x[i].r, b->key); continue; }
+      metrics_inc(M_PROXY_UPSTREAM_FAIL);
+      if(++b->tries<BATCH_MAX_TRIES){
+        waiter_t over[BATCH_WAITERS]; int nover;
+        if(batch_put(b, 0, over, &nover)==0){ answer_code(over, nover, COAP_5_04_GWTIMEOUT, b->key); continue; }
+      }
+      metrics_inc(M_PROXY_WRITE_DROPPED);
+      if(log_fn) log_fn("PROXY escritura %s descartada tras %d intentos (%d esperando)", b->key, b->tries, b->nw);
+      answer_code(b->w, b->nw, COAP_5_04_GWTIMEOUT, b->key);
+    }
+    pthread_mutex_lock(&bmtx);
+    nsending = 0;
+    pthread_mutex_unlock(&bmtx);
+  }
+  return NULL;
+}
+
+/* ======== API ======== */
+void proxy_set_log(proxy_log_fn fn){ log_fn = fn; }
+
+int proxy_init(const char *upstream, int bms){
+  if(upstream){
+    if(resolve_hostport(upstream, strlen(upstream), &def_up)<0) return -1;
+    have_default = 1;
+  }
+  seq = (uint32_t)time(NULL) ^ (uint32_t)getpid();
+  salt = (uint32_t)(metrics_now_us()*2246822519u);
+  batch_ms = bms>0 ? bms : 0;
+  if(batch_ms){
+    pthread_t th;
+    if(pthread_create(&th, NULL, flusher, NULL)!=0) return -1;
+    pthread_detach(th);
+  }
+  enabled = 1;
+  return 0;
+}
+
+int proxy_wants(const coap_msg_t *req){
+  return coap_find_opt(req, OPT_PROXY_URI) || coap_find_opt(req, OPT_PROXY_SCHEME);
+}
+
+static uint8_t req_target(const coap_msg_t *req, target_t *t, char *key){
+  const coap_opt_t *pu = coap_find_opt(req, OPT_PROXY_URI);
+  uint8_t err = pu ? target_from_uri(pu, t) : target_from_opts(req, coap_find_opt(req, OPT_PROXY_SCHEME), t);
+  if(!err) make_key(t, key, KEY_LEN);
+  return err;
+}
+
+int proxy_may_block(const coap_msg_t *req){
+  target_t t; char key[KEY_LEN];
+  if(!enabled || req_target(req, &t, key)) return 0;
+  uint8_t code = req->h.code;
+  if(code==COAP_GET){
+    pthread_mutex_lock(&cmtx);
+    centry_t *e = cache_find(key);
+    int fresh = e && !e->pending && e->fresh_ok && metrics_now_us()<e->expires_us;
+    pthread_mutex_unlock(&cmtx);
+    return !fresh;
+  }
+  if(code==COAP_DELETE) return 1;
+  /* con lote, una NON se contesta "queued" al momento; una CON espera al envío */
+  if(code==COAP_POST || code==COAP_PUT)
+    return req->plen<=PROXY_BODY_MAX && (batch_ms==0 || req->h.type==COAP_TYPE_CON);
+  return 0;
+}
+
+static void batch_entry(bentry_t *b, const coap_msg_t *req, const target_t *t, const char *key, int cf){
+  b->tries = 0; b->cf = cf; b->code = req->h.code; b->t = *t; b->nw = 0;
+  snprintf(b->key, sizeof b->key, "%s", key);
+  b->blen = req->plen;
+  if(b->blen) memcpy(b->body, req->payload, b->blen);
+}
+
+void proxy_handle(const coap_msg_t *req, proxy_resp_t *out, char *tgt, size_t tsz){
+  target_t t; char key[KEY_LEN];
+  if(!enabled){ resp_simple(out, COAP_5_05_NOPROXY, NULL); snprintf(tgt, tsz, "-"); return; }
+  uint8_t err = req_target(req, &t, key);
+  if(err){ resp_simple(out, err, NULL); snprintf(tgt, tsz, "?"); return; }
+  snprintf(tgt, tsz, "%s", key);
+
+  uint8_t code = req->h.code;
+  if(code==COAP_GET){ cached_get(&t, key, out); return; }
+  if(code!=COAP_POST && code!=COAP_PUT && code!=COAP_DELETE){ resp_simple(out, COAP_4_00_BADREQ, NULL); return; }
+  if(req->plen>PROXY_BODY_MAX){ resp_simple(out, COAP_4_13_TOOLARGE, NULL); return; }
+
+  int cf = coap_find_opt(req, OPT_CONTENT_FORMAT) ? (int)coap_opt_uint(req, OPT_CONTENT_FORMAT, 0) : -1;
+  cache_drop(key);
+  /* Sólo las NON se dan por hechas al encolar: no esperan confirmación */
+  if(batch_ms && code!=COAP_DELETE && req->h.type==COAP_TYPE_NON){
+    bentry_t b;
+    batch_entry(&b, req, &t, key, cf);
+    if(batch_put(&b, 1, NULL, NULL)==0){ resp_simple(out, COAP_2_04_CHANGED, "queued"); return; }
+  }
+  /* Directa: sustituye a la pendiente del lote, y quien la esperaba se lleva esta respuesta */
+  waiter_t w[BATCH_WAITERS];
+  int nw = batch_take(key, w);
+  upstream_call(&t, code, NULL, 0, cf, req->payload, req->plen, out);
+  cache_drop(key);
+  answer(w, nw, out, key);
+}
+
+int proxy_write_async(const coap_msg_t *req, proxy_done_fn done, void *ctx){
+  target_t t; char key[KEY_LEN];
+  uint8_t code = req->h.code;
+  if(!enabled || !batch_ms || (code!=COAP_POST && code!=COAP_PUT) || req->plen>PROXY_BODY_MAX) return -1;
+  if(req_target(req, &t, key)) return -1;
+  int cf = coap_find_opt(req, OPT_CONTENT_FORMAT) ? (int)coap_opt_uint(req, OPT_CONTENT_FORMAT, 0) : -1;
+  bentry_t b;
+  batch_entry(&b, req, &t, key, cf);
+  b.nw = 1; b.w[0].fn = done; b.w[0].ctx = ctx;
+  if(batch_put(&b, 1, NULL, NULL)<0) return -1;
+  cache_drop(key);
+  return 0;
+}
+
+#else  /* _WIN32: sin proxy */
+
+void proxy_set_log(proxy_log_fn fn){ (void)fn; }
+int  proxy_init(const char *upstream, int bms){ (void)upstream; (void)bms; return -1; }
+int  proxy_wants(const coap_msg_t *req){
+  return coap_find_opt(req, OPT_PROXY_URI) || coap_find_opt(req, OPT_PROXY_SCHEME);
+}
+int  proxy_may_block(const coap_msg_t *req){ (void)req; return 0; }
+int  proxy_write_async(const coap_msg_t *req, proxy_done_fn done, void *ctx){ (void)req; (void)done; (void)ctx; return -1; }
+void proxy_handle(const coap_msg_t *req, proxy_resp_t *out, char *tgt, size_t tsz){
+  (void)req;
+  snprintf(tgt, tsz, "-");
+  out->code = COAP_5_05_NOPROXY; out->cf = -1; out->has_max_age = 0; out->etag_len = 0; out->plen = 0;
+}
+
+#endif
+
+size_t proxy_encode_body(uint8_t *out, size_t cap, const proxy_resp_t *r){
+  coap_enc_t e;
+  coap_enc_begin(&e, out, cap);
+  if(r->etag_len) coap_enc_opt(&e, OPT_ETAG, r->etag, r->etag_len);
+  if(r->cf>=0) coap_enc_opt_uint(&e, OPT_CONTENT_FORMAT, (uint32_t)r->cf);
+  if(r->has_max_age) coap_enc_opt_uint(&e, OPT_MAX_AGE, r->max_age);
+  coap_enc_payload(&e, r->payload, r->plen);
+  return coap_enc_finish(&e);
+}
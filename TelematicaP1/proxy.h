@@ -0,0 +1,67 @@
+#ifndef PROXY_H
+#define PROXY_H
+#include <stdint.h>
+#include <stddef.h>
+#include "coap_min.h"
+
+/* Proxy de reenvío CoAP (RFC 7252 §5.7) con caché. Las peticiones que traen
+   Proxy-Uri o Proxy-Scheme se reenvían por CON a otro servidor CoAP:
+   - GET: caché según Max-Age (60 s si no viene) y revalidación con ETag;
+     varios GET idénticos concurrentes comparten una sola petición al upstream.
+   - POST/PUT: se acumulan y se envían en lote cada batch_ms; dentro de la
+     ventana sólo viaja el último cuerpo de cada destino. Una NON se contesta
+     2.04 "queued" al encolar; una CON espera en el lote (proxy_write_async)
+     a la respuesta del upstream. Tras BATCH_MAX_TRIES envíos fallidos la
+     escritura se descarta y se cuenta en proxy_write_dropped.
+   - DELETE (y escrituras que no caben en el lote): reenvío directo.
+   Sólo POSIX; en Windows proxy_init devuelve -1. */
+
+#define PROXY_URI_MAX  256
+#define PROXY_BODY_MAX 1024
+
+typedef struct {
+  uint8_t  code;
+  int      cf;              /* Content-Format, -1 si no hay */
+  int      has_max_age;
+  uint32_t max_age;         /* segundos de frescura restantes */
+  uint8_t  etag[8], etag_len;
+  uint8_t  payload[PROXY_BODY_MAX];
+  size_t   plen;
+} proxy_resp_t;
+
+/* Registro de eventos del proxy (escrituras descartadas); NULL = sin registro */
+typedef void (*proxy_log_fn)(const char *fmt, ...);
+void proxy_set_log(proxy_log_fn fn);
+
+/* upstream: "host:port" por defecto para Proxy-Scheme sin Uri-Host (o NULL).
+   batch_ms: ventana de agrupación de escrituras (0 = reenvío directo). */
+int proxy_init(const char *upstream, int batch_ms);
+
+/* 1 si la petición va dirigida al proxy (trae Proxy-Uri o Proxy-Scheme) */
+int proxy_wants(const coap_msg_t *req);
+
+/* 1 si atender req probablemente espere al upstream (GET sin copia fresca,
+   DELETE, escritura sin lote): el servidor la responde por separado. */
+int proxy_may_block(const coap_msg_t *req);
+
+/* Atiende la petición y deja en out la respuesta a devolver al cliente
+   (5.05 Proxying Not Supported si no se llamó a proxy_init).
+   target recibe "ip:puerto/ruta" para el log. Bloquea el hilo que llama
+   mientras dura el intercambio con el upstream. */
+void proxy_handle(const coap_msg_t *req, proxy_resp_t *out, char *target, size_t tsz);
+
+/* Respuesta a una escritura aplazada, desde el hilo del lote. target es
+   "ip:puerto/ruta" para el log. */
+typedef void (*proxy_done_fn)(void *ctx, const proxy_resp_t *r, const char *target);
+
+/* POST/PUT CON con lote: queda en el lote y done(ctx, ...) se llama una vez
+   con la respuesta del upstream al envío que la incluye (5.04 si se agotan
+   los intentos). 0 si quedó en el lote; -1 si no aplica (sin lote, otro
+   método, lote lleno): entonces se atiende con proxy_handle. */
+int proxy_write_async(const coap_msg_t *req, proxy_done_fn done, void *ctx);
+
+/* Opciones (ETag, Content-Format, Max-Age) y payload de la respuesta, sin
+   cabecera ni token: el transporte (UDP o TCP) los pone delante. 0 si no cabe. */
+size_t proxy_encode_body(uint8_t *out, size_t cap, const proxy_resp_t *r);
+
+#endif
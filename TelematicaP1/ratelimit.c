@@ -0,0 +1,44 @@
+#include "ratelimit.h"
+#include <string.h>
+
+#define RL_SLOTS 4096   /* potencia de 2 */
+#define RL_PROBE 8      /* huecos revisados por búsqueda antes de desalojar */
+
+typedef struct { uint32_t ip; int used; double tokens; uint64_t last_us; } bucket_t;
+static bucket_t tab[RL_SLOTS];
+static double g_rate = 0, g_burst = 0;
+
+void rl_init(double rate, double burst){
+  memset(tab, 0, sizeof tab);
+  g_rate = rate;
+  g_burst = burst < 1 ? 1 : burst;
+}
+
+static unsigned hash_ip(uint32_t ip){
+  ip ^= ip >> 16; ip *= 0x7feb352dU; ip ^= ip >> 15; ip *= 0x846ca68bU; ip ^= ip >> 16;
+  return ip & (RL_SLOTS-1);
+}
+
+static bucket_t *lookup(uint32_t ip, uint64_t now_us){
+  unsigned h = hash_ip(ip);
+  bucket_t *victim = NULL;
+  for(int k=0;k<RL_PROBE;k++){
+    bucket_t *b = &tab[(h+k)&(RL_SLOTS-1)];
+    if(b->used && b->ip==ip) return b;
+    if(!b->used){ if(!victim || victim->used) victim = b; continue; }
+    if(!victim || (victim->used && b->last_us < victim->last_us)) victim = b;
+  }
+  /* nuevo par (o desalojo del menos reciente del vecindario): cubo lleno */
+  victim->used = 1; victim->ip = ip; victim->tokens = g_burst; victim->last_us = now_us;
+  return victim;
+}
+
+uint64_t rl_check(uint32_t ip, uint64_t now_us){
+  if(g_rate<=0) return 0;
+  bucket_t *b = lookup(ip, now_us);
+  b->tokens += (double)(now_us - b->last_us) * g_rate / 1e6;
+  if(b->tokens > g_burst) b->tokens = g_burst;
+  b->last_us = now_us;
+  if(b->tokens >= 1.0){ b->tokens -= 1.0; return 0; }
+  return (uint64_t)((1.0 - b->tokens) * 1e6 / g_rate) + 1;
+}
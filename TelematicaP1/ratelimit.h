@@ -0,0 +1,13 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+#include <stdint.h>
+
+/* Token bucket por IP de origen (rate peticiones/s, ráfaga burst).
+   Tabla fija con direccionamiento abierto; la usa sólo el hilo receptor,
+   así que no lleva mutex. rate<=0 desactiva el límite. */
+void rl_init(double rate, double burst);
+
+/* 0 si se admite la petición; si no, microsegundos hasta el próximo token */
+uint64_t rl_check(uint32_t ip, uint64_t now_us);
+
+#endif
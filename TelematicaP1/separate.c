@@ -0,0 +1,246 @@
+#define _POSIX_C_SOURCE 200809L
+#include "separate.h"
+#include "metrics.h"
+#include "timerwheel.h"
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define SEP_TICK_MS        100
+#define ACK_TIMEOUT_MS     2000   /* RFC 7252 §4.8 */
+#define MAX_RETRANSMIT     4
+#define EXCHANGE_LIFETIME_MS 247000  /* §4.8.2: hasta aquí puede llegar un duplicado */
+#define MAX_TRANSMIT_WAIT_MS  93000  /* §4.8.2: el cliente ya no retransmite */
+
+/* S_DONE: respuesta a una CON ya confirmada (o abandonada). Se guarda hasta
+   EXCHANGE_LIFETIME para contestar retransmisiones tardías de la petición
+   (la del ACK vacío perdido) sin volver a ejecutar el manejador. */
+enum { S_FREE = 0, S_RUNNING, S_WAIT_ACK, S_DONE };
+
+struct sep {
+  int state;
+  struct sockaddr_in peer;
+  uint8_t req_type; uint16_t req_mid;
+  uint64_t begun;             /* tick de sep_begin */
+  uint8_t tkl, token[8];
+  uint16_t mid;               /* de nuestra respuesta CON */
+  int tries; uint32_t timeout_ticks;
+  tw_node_t tmr;
+  sep_fn fn; void *arg;       /* manejador aplazado, hasta que lo recoja un worker */
+  size_t len; uint8_t msg[4 + 8 + SEP_BODY_MAX];
+};
+
+static sep_t tab[SEP_MAX];
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static tw_t wheel;
+static sep_send_fn send_fn = NULL;
+static uint16_t next_mid = 0;
+
+/* Cola del pool: a lo sumo SEP_MAX manejadores, uno por entrada de tab */
+static sep_t *runq[SEP_MAX];
+static size_t rq_head = 0, rq_count = 0;
+static pthread_mutex_t rq_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  rq_cv = PTHREAD_COND_INITIALIZER;
+
+static uint64_t now_ticks(void){
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec*1000u + (uint64_t)ts.tv_nsec/1000000u) / SEP_TICK_MS;
+}
+
+static int same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b){
+  return a->sin_addr.s_addr==b->sin_addr.s_addr && a->sin_port==b->sin_port;
+}
+
+static void send_empty_ack(const sep_t *h){
+  uint8_t out[4] = { (COAP_VER<<6) | (COAP_TYPE_ACK<<4), 0,
+                     (uint8_t)(h->req_mid>>8), (uint8_t)h->req_mid };
+  send_fn(&h->peer, out, sizeof out, 0, h->req_mid);
+}
+
+/* con mtx tomado */
+static void release(sep_t *h){
+  tw_del(&h->tmr);
+  h->state = S_FREE;
+}
+
+/* con mtx tomado: nuestra CON ya no se reenvía; queda para los duplicados */
+static void finish(sep_t *h){
+  h->state = S_DONE;
+  tw_add(&wheel, &h->tmr, h->begun + EXCHANGE_LIFETIME_MS/SEP_TICK_MS);
+}
+
+/* con mtx tomado. Retransmisión de una petición CON ya aplazada: mientras
+   el manejador corre o nuestra CON espera su ACK basta repetir el ACK vacío;
+   terminada, se repite la respuesta guardada en un ACK con el MID de la
+   petición */
+static void answer_dup(const sep_t *h){
+  if(h->state!=S_DONE){ send_empty_ack(h); return; }
+  uint8_t out[sizeof h->msg];
+  memcpy(out, h->msg, h->len);
+  out[0] = (uint8_t)((out[0] & 0xCF) | (COAP_TYPE_ACK<<4));
+  out[2] = (uint8_t)(h->req_mid>>8); out[3] = (uint8_t)h->req_mid;
+  send_fn(&h->peer, out, h->len, out[1], h->req_mid);
+}
+
+static void on_timeout(tw_node_t *n, void *ctx){
+  (void)ctx;
+  sep_t *h = (sep_t*)((char*)n - offsetof(sep_t, tmr));
+  if(h->state==S_DONE){ release(h); return; }
+  if(h->tries>=MAX_RETRANSMIT){ metrics_inc(M_SEP_TIMEOUT); finish(h); return; }
+  h->tries++;
+  h->timeout_ticks *= 2;
+  send_fn(&h->peer, h->msg, h->len, h->msg[1], h->req_mid);
+  metrics_inc(M_SEP_RETRANSMIT);
+  tw_add(&wheel, &h->tmr, wheel.now + h->timeout_ticks);
+}
+
+static void *retx_main(void *arg){
+  (void)arg;
+  for(;;){
+    struct timespec ts = { 0, SEP_TICK_MS*1000000L };
+    nanosleep(&ts, NULL);
+    pthread_mutex_lock(&mtx);
+    tw_advance(&wheel, now_ticks(), on_timeout, NULL);
+    pthread_mutex_unlock(&mtx);
+  }
+  return NULL;
+}
+
+static void *run_main(void *arg){
+  (void)arg;
+  for(;;){
+    pthread_mutex_lock(&rq_mtx);
+    while(!rq_count) pthread_cond_wait(&rq_cv, &rq_mtx);
+    sep_t *h = runq[rq_head];
+    rq_head = (rq_head+1) % SEP_MAX; rq_count--;
+    pthread_mutex_unlock(&rq_mtx);
+    h->fn(h, h->arg);
+  }
+  return NULL;
+}
+
+int sep_start(sep_send_fn send){
+  if(!send) return -1;
+  tw_init(&wheel, now_ticks());
+  next_mid = (uint16_t)(time(NULL) ^ 0x5E9A);
+  pthread_t th;
+  if(pthread_create(&th, NULL, retx_main, NULL)!=0) return -1;
+  pthread_detach(th);
+  for(int i=0;i<SEP_WORKERS;i++){
+    if(pthread_create(&th, NULL, run_main, NULL)!=0) return -1;
+    pthread_detach(th);
+  }
+  send_fn = send;   /* al final: sin pool sep_begin sigue devolviendo NULL */
+  return 0;
+}
+
+/* con mtx tomado */
+static sep_t *find_dup(const struct sockaddr_in *cli, uint16_t mid){
+  for(int i=0;i<SEP_MAX;i++){
+    sep_t *h = &tab[i];
+    if(h->state!=S_FREE && h->req_type==COAP_TYPE_CON && h->req_mid==mid && same_peer(&h->peer, cli))
+      return h;
+  }
+  return NULL;
+}
+
+sep_t *sep_begin(const struct sockaddr_in *cli, const coap_msg_t *req, int *dup){
+  *dup = 0;
+  if(!send_fn) return NULL;
+  sep_t *h = NULL;
+  pthread_mutex_lock(&mtx);
+  if(req->h.type==COAP_TYPE_CON && (h = find_dup(cli, req->h.mid))!=NULL){
+    answer_dup(h);
+    pthread_mutex_unlock(&mtx);
+    *dup = 1;
+    return NULL;
+  }
+  /* Sin huecos libres se recicla la terminada más antigua, si su cliente ya
+     no puede estar retransmitiendo la petición */
+  sep_t *old = NULL;
+  for(int i=0;i<SEP_MAX;i++){
+    if(tab[i].state==S_FREE){ h = &tab[i]; break; }
+    if(tab[i].state==S_DONE && (!old || tab[i].begun<old->begun)) old = &tab[i];
+  }
+  if(!h && old && wheel.now - old->begun >= MAX_TRANSMIT_WAIT_MS/SEP_TICK_MS){ release(old); h = old; }
+  if(h){
+    h->state = S_RUNNING;
+    h->begun = wheel.now;
+    h->peer = *cli;
+    h->req_type = req->h.type; h->req_mid = req->h.mid;
+    h->tkl = req->h.tkl; memcpy(h->token, req->h.token, req->h.tkl);
+    h->tries = 0; h->len = 0;
+  }
+  pthread_mutex_unlock(&mtx);
+  if(!h) return NULL;
+  if(h->req_type==COAP_TYPE_CON) send_empty_ack(h);
+  metrics_inc(M_SEP_DEFERRED);
+  return h;
+}
+
+void sep_run(sep_t *h, sep_fn fn, void *arg){
+  h->fn = fn; h->arg = arg;
+  pthread_mutex_lock(&rq_mtx);
+  runq[(rq_head+rq_count) % SEP_MAX] = h; rq_count++;
+  pthread_cond_signal(&rq_cv);
+  pthread_mutex_unlock(&rq_mtx);
+}
+
+void sep_complete(sep_t *h, uint8_t code, const uint8_t *body, size_t blen){
+  int con = h->req_type==COAP_TYPE_CON;
+  if(blen>SEP_BODY_MAX){ code = COAP_5_00_SRVERR; blen = 0; }
+  pthread_mutex_lock(&mtx);
+  h->mid = next_mid++;
+  coap_enc_t e;
+  coap_enc_init(&e, h->msg, sizeof h->msg, con ? COAP_TYPE_CON : COAP_TYPE_NON,
+                code, h->mid, h->token, h->tkl);
+  size_t hl = coap_enc_finish(&e);
+  memcpy(h->msg+hl, body, blen);
+  h->len = hl + blen;
+  if(con){
+    /* primer plazo aleatorio en [ACK_TIMEOUT, 1.5*ACK_TIMEOUT] */
+    h->timeout_ticks = ACK_TIMEOUT_MS/SEP_TICK_MS + (uint32_t)(rand() % (ACK_TIMEOUT_MS/SEP_TICK_MS/2 + 1));
+    h->state = S_WAIT_ACK;
+    tw_add(&wheel, &h->tmr, wheel.now + h->timeout_ticks);
+  }
+  /* se envía con mtx tomado: un ACK no puede liberar h antes de tiempo */
+  send_fn(&h->peer, h->msg, h->len, code, h->req_mid);
+  if(!con) release(h);
+  pthread_mutex_unlock(&mtx);
+}
+
+int sep_dup(const struct sockaddr_in *cli, uint16_t mid){
+  pthread_mutex_lock(&mtx);
+  sep_t *h = find_dup(cli, mid);
+  if(h) answer_dup(h);
+  pthread_mutex_unlock(&mtx);
+  return h!=NULL;
+}
+
+int sep_on_ack(const struct sockaddr_in *from, uint8_t type, uint16_t mid){
+  int found = 0;
+  pthread_mutex_lock(&mtx);
+  for(int i=0;i<SEP_MAX && !found;i++){
+    sep_t *h = &tab[i];
+    if(h->state==S_WAIT_ACK && h->mid==mid && same_peer(&h->peer, from)){
+      (void)type;   /* RST: el cliente ya no la quiere, igual se deja de enviar */
+      finish(h); found = 1;
+    }
+  }
+  pthread_mutex_unlock(&mtx);
+  return found;
+}
+
+#else  /* _WIN32: sin respuestas separadas */
+
+int    sep_start(sep_send_fn send){ (void)send; return -1; }
+sep_t *sep_begin(const struct sockaddr_in *cli, const coap_msg_t *req, int *dup){ (void)cli; (void)req; *dup = 0; return NULL; }
+void   sep_run(sep_t *h, sep_fn fn, void *arg){ fn(h, arg); }
+void   sep_complete(sep_t *h, uint8_t code, const uint8_t *body, size_t blen){ (void)h; (void)code; (void)body; (void)blen; }
+int    sep_dup(const struct sockaddr_in *cli, uint16_t mid){ (void)cli; (void)mid; return 0; }
+int    sep_on_ack(const struct sockaddr_in *from, uint8_t type, uint16_t mid){ (void)from; (void)type; (void)mid; return 0; }
+
+#endif
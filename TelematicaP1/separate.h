@@ -0,0 +1,61 @@
+#ifndef SEPARATE_H
+#define SEPARATE_H
+#include <stdint.h>
+#include <stddef.h>
+#include "coap_min.h"
+#ifdef _WIN32
+  #include <winsock2.h>
+#else
+  #include <netinet/in.h>
+#endif
+
+/* Respuestas separadas por UDP (RFC 7252 §5.2.2). Para una petición cuyo
+   manejador es lento, sep_begin manda ya el ACK vacío (si era CON) y el
+   resultado sale después en su propio mensaje: CON con MID nuevo y el mismo
+   token, retransmitido con ACK_TIMEOUT 2 s doblando hasta 4 veces, o NON si
+   la petición era NON. El receptor entrega a sep_on_ack los ACK/RST vacíos.
+   Cada intercambio CON se recuerda (con su respuesta) EXCHANGE_LIFETIME
+   desde que llegó: una retransmisión tardía de la petición recibe otra vez
+   la respuesta y no vuelve a ejecutarse.
+   Sólo POSIX; en Windows sep_begin devuelve NULL y se responde en línea. */
+
+#define SEP_MAX      256     /* intercambios aplazados o recordados a la vez */
+#define SEP_WORKERS  8       /* hilos fijos que ejecutan los manejadores aplazados */
+#define SEP_BODY_MAX 2048    /* opciones + payload de la respuesta */
+
+typedef struct sep sep_t;
+
+/* Envío de un datagrama ya montado (el servidor añade métricas, captura y
+   log). req_mid es el MID de la petición a la que responde. */
+typedef void (*sep_send_fn)(const struct sockaddr_in *to, const uint8_t *buf, size_t n,
+                            uint8_t code, uint16_t req_mid);
+/* Manejador aplazado: debe acabar llamando a sep_complete(h, ...) */
+typedef void (*sep_fn)(sep_t *h, void *arg);
+
+int  sep_start(sep_send_fn send);   /* retransmisión + SEP_WORKERS hilos; 0 si OK */
+
+/* Aplaza la respuesta a req recibida de cli. NULL si no hay hueco libre:
+   entonces hay que responder en línea como siempre. Si ya hay una con el
+   mismo MID y par (retransmisión de una CON) repite el ACK vacío, o la
+   respuesta si ya terminó, pone *dup a 1 y devuelve NULL: no hay que
+   atenderla. La comprobación y la reserva van juntas bajo el mismo cerrojo. */
+sep_t *sep_begin(const struct sockaddr_in *cli, const coap_msg_t *req, int *dup);
+
+/* Encola fn(h, arg) para el pool de SEP_WORKERS hilos, sin ocupar al que
+   llama. No falla: cada h se encola una vez y caben los SEP_MAX. */
+void sep_run(sep_t *h, sep_fn fn, void *arg);
+
+/* Resultado del manejador: body con opciones + payload ya codificados.
+   Se puede llamar desde cualquier hilo; h deja de ser válido. */
+void sep_complete(sep_t *h, uint8_t code, const uint8_t *body, size_t blen);
+
+/* Retransmisión de una petición CON ya aplazada: repite el ACK vacío (o la
+   respuesta, si ya terminó) y devuelve 1 (no hay que atenderla otra vez);
+   0 si no lo es. */
+int sep_dup(const struct sockaddr_in *cli, uint16_t mid);
+
+/* ACK o RST vacío del cliente: 1 si confirmaba (o rechazaba) una respuesta
+   separada nuestra, que deja de retransmitirse. */
+int sep_on_ack(const struct sockaddr_in *from, uint8_t type, uint16_t mid);
+
+#endif
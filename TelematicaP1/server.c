@@ -8,40 +8,31 @@
 #else
   #include <arpa/inet.h>
   #include <sys/socket.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
   #include <unistd.h>
   #include <pthread.h>
 #endif
 
+#include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
 #include <stdarg.h>   // <- necesario para log_line
+#include "capture.h"
+#include "coap_min.h"
+#include "metrics.h"
+#include "proxy.h"
+#include "ratelimit.h"
+#include "separate.h"
+#include "store.h"
+#ifndef _WIN32
+  #include "workq.h"
+#endif
 
-/* ======== CoAP: tipos y códigos ======== */
-#define COAP_VER         1
-#define COAP_TYPE_CON    0
-#define COAP_TYPE_NON    1
-#define COAP_TYPE_ACK    2
-#define COAP_TYPE_RST    3
-
-#define COAP_GET         1
-#define COAP_POST        2
-#define COAP_PUT         3
-#define COAP_DELETE      4
-
-#define COAP_2_01_CREATED 0x41
-#define COAP_2_04_CHANGED 0x44
-#define COAP_2_05_CONTENT 0x45
-#define COAP_4_00_BADREQ  0x80
-#define COAP_4_04_NOTFND  0x84
-#define COAP_5_00_SRVERR  0xA0
-
-/* ======== Opciones CoAP ======== */
-#define OPT_URI_PATH       11
-#define OPT_CONTENT_FORMAT 12
-#define CF_APP_JSON        50  // application/json
+/* ======== CoAP: tipos, códigos y opciones en coap_min.h ======== */
 
 /* ======== Logger sencillo (consola + archivo) ======== */
 static FILE *glog = NULL;
@@ -70,93 +61,81 @@ static void log_line(const char *fmt, ...){
   }
 }
 
-/* ======== Almacenamiento en memoria por recurso ======== */
-#define MAX_ITEMS 32
-#define KEY_MAX   128
+/* ======== Almacenamiento en memoria por recurso (store.c) ======== */
+#define KEY_MAX   128   /* mismos límites que store.c */
 #define VAL_MAX   1024
-typedef struct { int used; char key[KEY_MAX]; char val[VAL_MAX]; } kv_t;
-static kv_t tab[MAX_ITEMS];
-
-static int find_slot(const char *key){
-  for(int i=0;i<MAX_ITEMS;i++)
-    if(tab[i].used && strcmp(tab[i].key,key)==0) return i;
-  return -1;
-}
-static int find_free(void){
-  for(int i=0;i<MAX_ITEMS;i++)
-    if(!tab[i].used) return i;
-  return -1;
-}
-static int store_upsert(const char *key, const char *json){
-  int i = find_slot(key);
-  if(i<0){ i=find_free(); if(i<0) return -1; }
-  snprintf(tab[i].key, KEY_MAX, "%s", key);
-  snprintf(tab[i].val, VAL_MAX, "%s", json);
-  tab[i].used = 1;
-  return 0;
-}
-static int store_get(const char *key, char *out, int outsz){
-  int i = find_slot(key);
-  if(i<0) return -1;
-  snprintf(out, outsz, "%s", tab[i].val);
-  return 0;
-}
-static int store_delete(const char *key){
-  int i = find_slot(key);
-  if(i<0) return -1;
-  tab[i].used=0; tab[i].key[0]=0; tab[i].val[0]=0;
-  return 0;
-}
 
-/* ======== Construcción de respuestas CoAP ======== */
-/* Nota: añadimos Content-Format: application/json (50) cuando code == 2.05 */
-static size_t coap_build_msg(uint8_t *out, size_t cap,
-                             uint8_t type, uint8_t code, uint16_t mid,
-                             const uint8_t *token, uint8_t tkl,
-                             const char *payload){
-  size_t pos=0;
-  if(cap<4) return 0;
-  out[pos++] = ((COAP_VER&3)<<6) | ((type&3)<<4) | (tkl&0x0F);
-  out[pos++] = code;
-  out[pos++] = (mid>>8)&0xFF; out[pos++] = mid&0xFF;
-  if(tkl){
-    if(pos+tkl>cap) return 0;
-    memcpy(&out[pos], token, tkl); pos+=tkl;
-  }
-  /* Si vamos a devolver contenido, añade opción Content-Format (n=12, len=1, val=50).
-     Como no hemos enviado opciones antes, last=0 y delta=12 (<13) → byte 0xC1 seguido de 0x32 (50). */
-  if(code == COAP_2_05_CONTENT){
-    if(pos+2>cap) return 0;
-    out[pos++] = (OPT_CONTENT_FORMAT<<4) | 1; // 0xC1
-    out[pos++] = CF_APP_JSON;                 // 50
-  }
-  if(payload && payload[0]){
-    size_t plen = strlen(payload);
-    if(pos+1+plen>cap) return 0;
-    out[pos++] = 0xFF;
-    memcpy(&out[pos], payload, plen); pos+=plen;
-  }
-  return pos;
-}
-
-static void send_coap_reply(
+/* ======== Envío de respuestas CoAP ======== */
+static void send_dgram(
 #ifdef _WIN32
   SOCKET s,
 #else
   int s,
 #endif
-  struct sockaddr_in *cli, socklen_t cl,
-  uint8_t resp_type, uint8_t code, uint16_t mid,
-  const uint8_t *token, uint8_t tkl, const char *payload)
+  struct sockaddr_in *cli, socklen_t cl, const uint8_t *out, size_t m, uint8_t code)
 {
-  uint8_t out[1500];
-  size_t m = coap_build_msg(out,sizeof out, resp_type, code, mid, token, tkl, payload);
-  if(!m) return;
 #ifdef _WIN32
   sendto(s,(const char*)out,(int)m,0,(struct sockaddr*)cli,cl);
 #else
   sendto(s,out,m,0,(struct sockaddr*)cli,cl);
 #endif
+  metrics_inc(M_PKTS_OUT); metrics_add(M_BYTES_OUT, m);
+  metrics_response(code);
+  capture_write(CAP_OUT, cli->sin_addr.s_addr, cli->sin_port, out, m);
+}
+
+static void send_raw(
+#ifdef _WIN32
+  SOCKET s,
+#else
+  int s,
+#endif
+  struct sockaddr_in *cli, socklen_t cl, const uint8_t *out, size_t m, uint8_t code)
+{
+  send_dgram(s, cli, cl, out, m, code);
+  /* mid + código: coap_replay reconstruye de aquí lo esperado a partir del log */
+  if(m>=4) log_line("RESP mid=0x%04X code=%d.%02d", ((unsigned)out[2]<<8)|out[3], code>>5, code&0x1F);
+}
+
+/* ======== Respuesta independiente del transporte ======== */
+/* Los manejadores dejan en body las opciones y el payload ya codificados;
+   el transporte escribe su cabecera + token en el hueco de delante (headroom)
+   y envía todo de una vez, sin copiar el cuerpo. */
+#define RESP_HEADROOM 16     /* >= 4+8 (UDP) y 1+4+1+8 (TCP) */
+#define RESP_BODY_MAX 2048
+typedef struct {
+  uint8_t code;
+  size_t blen;
+  uint8_t buf[RESP_HEADROOM + RESP_BODY_MAX];
+} resp_t;
+#define RESP_BODY(r) ((r)->buf + RESP_HEADROOM)
+
+/* Añadimos Content-Format: application/json (50) cuando code == 2.05 */
+static void resp_text(resp_t *r, uint8_t code, const char *payload){
+  coap_enc_t e;
+  coap_enc_begin(&e, RESP_BODY(r), RESP_BODY_MAX);
+  if(code==COAP_2_05_CONTENT) coap_enc_opt_uint(&e, OPT_CONTENT_FORMAT, CF_APP_JSON);
+  if(payload) coap_enc_payload(&e, payload, strlen(payload));
+  r->code = code; r->blen = coap_enc_finish(&e);
+}
+
+/* UDP: cabecera de 4 bytes (ACK si la petición era CON, NON si era NON) */
+static void send_udp_resp(
+#ifdef _WIN32
+  SOCKET s,
+#else
+  int s,
+#endif
+  struct sockaddr_in *cli, socklen_t cl,
+  uint8_t resp_type, uint16_t mid, const uint8_t *token, uint8_t tkl, resp_t *r)
+{
+  uint8_t h[RESP_HEADROOM]; coap_enc_t e;
+  coap_enc_init(&e, h, sizeof h, resp_type, r->code, mid, token, tkl);
+  size_t hl = coap_enc_finish(&e);
+  if(!hl) return;
+  uint8_t *out = r->buf + RESP_HEADROOM - hl;
+  memcpy(out, h, hl);
+  send_raw(s, cli, cl, out, hl + r->blen, r->code);
 }
 
 static void send_rst(
@@ -176,39 +155,45 @@ static void send_rst(
 #else
   sendto(s,out,4,0,(struct sockaddr*)cli,cl);
 #endif
+  metrics_inc(M_RST_SENT); metrics_inc(M_PKTS_OUT); metrics_add(M_BYTES_OUT, 4);
+  capture_write(CAP_OUT, cli->sin_addr.s_addr, cli->sin_port, out, 4);
 }
 
-/* ======== Parse de opciones para extraer URI-Path ======== */
-typedef struct { uint16_t num; const uint8_t *val; uint16_t len; } opt_t;
-
-static int parse_options(const uint8_t *buf, int len, int tkl,
-                         opt_t *opts, int *optc,
-                         const uint8_t **payload, int *plen){
-  int pos = 4 + tkl;
-  uint16_t last = 0; int count = 0;
-  *payload = NULL; *plen = 0;
-  if(pos>len) return -1;
-  while(pos < len){
-    if(buf[pos]==0xFF){ pos++; *payload=&buf[pos]; *plen = len-pos; return 0; }
-    if(pos>=len) break;
-    uint8_t b = buf[pos++];
-    uint16_t d = (b>>4)&0xF, l = b&0xF;
-    if(d==13){ if(pos>=len) return -1; d = 13 + buf[pos++]; }
-    else if(d==14){ if(pos+1>=len) return -1; d = 269 + ((buf[pos]<<8)|buf[pos+1]); pos+=2; }
-    if(l==13){ if(pos>=len) return -1; l = 13 + buf[pos++]; }
-    else if(l==14){ if(pos+1>=len) return -1; l = 269 + ((buf[pos]<<8)|buf[pos+1]); pos+=2; }
-    uint16_t num = last + d; last = num;
-    if(pos + l > len) return -1;
-    if(count<16){ opts[count].num=num; opts[count].val=&buf[pos]; opts[count].len=l; count++; }
-    pos += l;
-  }
-  *optc = count;
-  return 0;
+/* ======== Admisión: rechazo barato desde el hilo receptor ======== */
+/* CON -> 5.03 Service Unavailable con Max-Age (segundos hasta reintentar);
+   NON/ACK/RST -> se descarta sin responder. */
+static void send_unavailable(
+#ifdef _WIN32
+  SOCKET s,
+#else
+  int s,
+#endif
+  struct sockaddr_in *cli, socklen_t cl, const uint8_t *buf, int n, uint32_t max_age)
+{
+  if(n<4 || ((buf[0]>>6)&3)!=COAP_VER || ((buf[0]>>4)&3)!=COAP_TYPE_CON) return;
+  uint8_t tkl = buf[0]&0x0F;
+  if(tkl>8 || 4+tkl>n) return;
+  uint16_t mid = ((uint16_t)buf[2]<<8)|buf[3];
+
+  uint8_t out[24]; coap_enc_t e;
+  coap_enc_init(&e, out, sizeof out, COAP_TYPE_ACK, COAP_5_03_UNAVAIL, mid, buf+4, tkl);
+  coap_enc_opt_uint(&e, OPT_MAX_AGE, max_age);
+  size_t m = coap_enc_finish(&e);
+  if(!m) return;
+#ifdef _WIN32
+  sendto(s,(const char*)out,(int)m,0,(struct sockaddr*)cli,cl);
+#else
+  sendto(s,out,m,0,(struct sockaddr*)cli,cl);
+#endif
+  metrics_inc(M_PKTS_OUT); metrics_add(M_BYTES_OUT, m);
+  metrics_response(COAP_5_03_UNAVAIL);
+  capture_write(CAP_OUT, cli->sin_addr.s_addr, cli->sin_port, out, m);
 }
 
-static void build_path(char *out, int outsz, const opt_t *opts, int optc){
+/* ======== URI-Path a partir de las opciones ======== */
+static void build_path(char *out, int outsz, const coap_opt_t *opts, size_t optc){
   int w=0; out[0]=0;
-  for(int i=0;i<optc;i++){
+  for(size_t i=0;i<optc;i++){
     if(opts[i].num==OPT_URI_PATH){
       if(w+1<outsz) out[w++]='/';
       for(int k=0;k<opts[i].len && w+1<outsz;k++) out[w++] = (char)opts[i].val[k];
@@ -218,7 +203,110 @@ static void build_path(char *out, int outsz, const opt_t *opts, int optc){
   else out[w]=0;
 }
 
-/* ======== Job por petición (para POSIX threads) ======== */
+/* TTL por defecto de las entradas escritas sin Max-Age (--ttl, 0 = nunca) */
+static uint32_t ttl_default = 0;
+
+/* ======== Listado de sensores: GET /sensors?prefix=&after=&limit= ========
+   Recorre el índice ordenado del store. El cursor es el id de la última
+   entrada devuelta (after=id), no un desplazamiento, así que las escrituras
+   entre página y página no hacen saltar ni repetir entradas. */
+#define LIST_PREFIX    "/sensors/"
+#define LIST_LIMIT_DEF 16
+#define LIST_LIMIT_MAX 64
+#define LIST_PAGE_MAX  1024   /* cabe en un datagrama */
+
+typedef struct { char *buf; size_t cap, len; int lf; char last[KEY_MAX]; } list_ctx_t;
+
+static void lc_puts(list_ctx_t *c, const char *t){
+  while(*t && c->len+1<c->cap) c->buf[c->len++] = *t++;
+  c->buf[c->len] = 0;
+}
+/* link-format: todo lo que no sea no reservado o '/' va como %XX */
+static void lc_pct(list_ctx_t *c, const char *t){
+  for(; *t; t++){
+    unsigned char ch = (unsigned char)*t; char e[4];
+    if(isalnum(ch) || strchr("-._~/", ch)){ e[0] = (char)ch; e[1] = 0; }
+    else snprintf(e, sizeof e, "%%%02X", ch);
+    lc_puts(c, e);
+  }
+}
+static void lc_json(list_ctx_t *c, const char *t){
+  for(; *t; t++){
+    unsigned char ch = (unsigned char)*t; char e[8];
+    if(ch=='"' || ch=='\\') snprintf(e, sizeof e, "\\%c", ch);
+    else if(ch<0x20) snprintf(e, sizeof e, "\\u%04X", ch);
+    else { e[0] = (char)ch; e[1] = 0; }
+    lc_puts(c, e);
+  }
+}
+
+static int list_add(const char *key, void *arg){
+  list_ctx_t *c = (list_ctx_t*)arg;
+  const char *id = key + strlen(LIST_PREFIX);
+  /* sitio para esta entrada y para el cierre con el cursor "next" */
+  if(c->len + 12*strlen(id) + 48 > c->cap) return -1;
+  if(c->lf){ lc_puts(c, c->len ? ",<" : "<"); lc_pct(c, key); lc_puts(c, ">"); }
+  else { lc_puts(c, c->buf[c->len-1]=='[' ? "\"" : ",\""); lc_json(c, id); lc_puts(c, "\""); }
+  snprintf(c->last, sizeof c->last, "%s", id);
+  return 0;
+}
+
+/* Valor de la opción Uri-Query "name=..." en out: 1 si está, 0 si no,
+   -1 si no cabe */
+static int query_param(const coap_msg_t *m, const char *name, char *out, size_t cap){
+  size_t nl = strlen(name);
+  for(size_t i=0;i<m->optc;i++){
+    const coap_opt_t *o = &m->opt[i];
+    if(o->num!=OPT_URI_QUERY || o->len<=nl || memcmp(o->val, name, nl)!=0 || o->val[nl]!='=') continue;
+    size_t vl = (size_t)o->len - nl - 1;
+    if(vl>=cap) return -1;
+    memcpy(out, o->val+nl+1, vl); out[vl] = 0;
+    return 1;
+  }
+  return 0;
+}
+
+static void handle_list(const coap_msg_t *req, resp_t *r){
+  char prefix[KEY_MAX], after[KEY_MAX], lim[12], pfx[KEY_MAX+16], aft[KEY_MAX+16];
+  int qp = query_param(req, "prefix", prefix, sizeof prefix);
+  int qa = query_param(req, "after", after, sizeof after);
+  int ql = query_param(req, "limit", lim, sizeof lim);
+  int limit = LIST_LIMIT_DEF;
+  if(qp<0 || qa<0 || ql<0){ resp_text(r, COAP_4_00_BADREQ, "bad query"); return; }
+  if(!qp) prefix[0] = 0;
+  if(ql){
+    char *e; long v = strtol(lim, &e, 10);
+    if(!lim[0] || *e || v<1){ resp_text(r, COAP_4_00_BADREQ, "bad limit"); return; }
+    limit = v>LIST_LIMIT_MAX ? LIST_LIMIT_MAX : (int)v;
+  }
+  int cf = (int)coap_opt_uint(req, OPT_ACCEPT, CF_APP_JSON);
+  if(cf!=CF_APP_JSON && cf!=CF_LINK_FORMAT){ resp_text(r, COAP_4_06_NOTACCEPT, "accept"); return; }
+  snprintf(pfx, sizeof pfx, "%s%s", LIST_PREFIX, prefix);
+  snprintf(aft, sizeof aft, "%s%s", LIST_PREFIX, after);
+
+  char page[LIST_PAGE_MAX];
+  list_ctx_t c = { page, sizeof page, 0, cf==CF_LINK_FORMAT, "" };
+  page[0] = 0;
+  if(!c.lf) lc_puts(&c, "{\"sensors\":[");
+  int more = 0;
+  int n = store_list(pfx, qa ? aft : NULL, limit, &more, list_add, &c);
+  if(c.lf){
+    if(more){ lc_puts(&c, n ? ",</sensors?after=" : "</sensors?after="); lc_pct(&c, c.last); lc_puts(&c, ">;rel=\"next\""); }
+  }else{
+    lc_puts(&c, "]");
+    if(more){ lc_puts(&c, ",\"next\":\""); lc_json(&c, c.last); lc_puts(&c, "\""); }
+    lc_puts(&c, "}");
+  }
+  log_line("LIST prefix=%s after=%s -> %d%s", prefix, qa ? after : "-", n, more ? " (+)" : "");
+
+  coap_enc_t e;
+  coap_enc_begin(&e, RESP_BODY(r), RESP_BODY_MAX);
+  coap_enc_opt_uint(&e, OPT_CONTENT_FORMAT, (uint32_t)cf);
+  if(c.len) coap_enc_payload(&e, page, c.len);
+  r->code = COAP_2_05_CONTENT; r->blen = coap_enc_finish(&e);
+}
+
+/* ======== Job por petición (se encola para el pool de workers) ======== */
 typedef struct {
 #ifdef _WIN32
   SOCKET s;
@@ -226,114 +314,502 @@ typedef struct {
   int s;
 #endif
   struct sockaddr_in cli; socklen_t cl;
+  uint64_t t_rx;  /* metrics_now_us() al recibir, para medir la espera */
+  int cls;        /* clase de prioridad (WQ_*) */
   int n; uint8_t buf[1500];
 } job_t;
 
-static void handle_one(
-#ifdef _WIN32
-  SOCKET s,
-#else
-  int s,
-#endif
-  struct sockaddr_in *cli, socklen_t cl, const uint8_t *buf, int n)
+/* Métrica de la petición y líneas REQ/BODY del log (las lee coap_replay).
+   Deja la ruta en path[KEY_MAX] y el cuerpo, si cabe, en body[VAL_MAX]. */
+static void log_req(const coap_msg_t *req, const char *via, char *path, char *body)
 {
-  if(n<4) return;
+  metrics_request(req->h.type, req->h.code);
+  const uint8_t *payload = req->payload; int plen = (int)req->plen;
 
-  uint8_t ver = (buf[0]>>6)&3;
-  uint8_t req_type = (buf[0]>>4)&3; // CON/NON esperado
-  uint8_t tkl = buf[0]&0x0F;
-  uint8_t code = buf[1];
-  uint16_t mid = ((uint16_t)buf[2]<<8)|buf[3];
-
-  if(ver!=COAP_VER || tkl>8){
-    log_line("MSG inválido: ver=%u tkl=%u -> RST", ver, tkl);
-    send_rst(s,cli,cl,mid);
-    return;
-  }
-
-  uint8_t token[8]; memset(token,0,8);
-  if(tkl){ if(4+tkl>n){ send_rst(s,cli,cl,mid); return; } memcpy(token, buf+4, tkl); }
-
-  opt_t opts[16]; int optc=0; const uint8_t *payload=NULL; int plen=0;
-  if(parse_options(buf,n,tkl,opts,&optc,&payload,&plen)<0){ send_rst(s,cli,cl,mid); return; }
-
-  char path[KEY_MAX]; build_path(path,sizeof path,opts,optc);
+  build_path(path,KEY_MAX,req->opt,req->optc);
 
   /* Fallback: si no llegó URI-Path, usar /sensor por defecto */
   if (path[0]=='/' && path[1]=='\0') {
     log_line("URI-Path vacío -> usando /sensor por defecto");
-    snprintf(path, sizeof path, "/sensor");
+    snprintf(path, KEY_MAX, "/sensor");
   }
 
-  char body[VAL_MAX]="";
-  if(payload && plen>0){
-    if(plen >= (int)sizeof(body)) plen=(int)sizeof(body)-1;
+  log_line("REQ type=%s code=0x%02X mid=0x%04X path=%s plen=%d", via, req->h.code, req->h.mid, path, plen);
+  body[0] = 0;
+  if(payload && plen>0 && plen<VAL_MAX){
     memcpy(body,payload,(size_t)plen); body[plen]=0;
+    log_line("BODY: %s", body);
   }
+}
 
-  log_line("REQ type=%s code=0x%02X mid=0x%04X path=%s plen=%d",
-           (req_type==COAP_TYPE_CON?"CON": req_type==COAP_TYPE_NON?"NON":"UNK"),
-           code, mid, path, plen);
-  if(plen>0) log_line("BODY: %s", body);
+/* Lógica de aplicación común a UDP y TCP: deja la respuesta en r.
+   via sólo etiqueta el log ("CON"/"NON" por UDP, "TCP" por TCP). */
+static void handle_request(const coap_msg_t *req, const char *via, resp_t *r)
+{
+  uint8_t code = req->h.code;
+  int plen = (int)req->plen;
+  char path[KEY_MAX], body[VAL_MAX];
+  log_req(req, via, path, body);
+
+  /* Proxy de reenvío: Proxy-Uri / Proxy-Scheme van al upstream, no al store */
+  if(proxy_wants(req)){
+    proxy_resp_t pr; char tgt[300];
+    proxy_handle(req, &pr, tgt, sizeof tgt);  /* 5.05 si no se arrancó con --proxy */
+    log_line("PROXY %s -> %d.%02d (%zu bytes)", tgt, pr.code>>5, pr.code&0x1F, pr.plen);
+    r->code = pr.code;
+    r->blen = proxy_encode_body(RESP_BODY(r), RESP_BODY_MAX, &pr);
+    if(!r->blen && pr.plen) resp_text(r, COAP_5_00_SRVERR, "err");
+    return;
+  }
 
-  /* Elegir tipo de respuesta: ACK si CON, NON si NON */
-  uint8_t resp_type = (req_type==COAP_TYPE_CON) ? COAP_TYPE_ACK : COAP_TYPE_NON;
-  char resp[VAL_MAX]=""; uint8_t code_resp = COAP_4_00_BADREQ;
+  /* El store guarda valores de hasta VAL_MAX-1 bytes: mejor 4.13 que truncar */
+  if(plen >= VAL_MAX){
+    log_line("%s -> cuerpo de %d bytes demasiado grande", path, plen);
+    resp_text(r, COAP_4_13_TOOLARGE, "too large");
+    return;
+  }
+  /* Comprobación de vida para el orquestador: barata y siempre en WQ_CONTROL */
+  if(code==COAP_GET && strcmp(path,"/ping")==0){
+    resp_text(r, COAP_2_05_CONTENT, "pong");
+    return;
+  }
+  /* Recursos de métricas en JSON: contadores, códigos y latencias. Cada uno
+     cabe en METRICS_JSON_MAX en el peor caso (se comprueba al arrancar) */
+  if(code==COAP_GET && strncmp(path,"/.well-known/metrics",20)==0){
+    const char *sub = path+20;
+    int part = !*sub ? METRICS_JSON_COUNTERS : !strcmp(sub,"/codes") ? METRICS_JSON_CODES
+             : !strcmp(sub,"/latency") ? METRICS_JSON_LATENCY : -1;
+    char mbuf[METRICS_JSON_MAX];
+    if(part<0) resp_text(r, COAP_4_04_NOTFND, "err");
+    else if(metrics_render_json(mbuf, sizeof mbuf, part)<0) resp_text(r, COAP_5_00_SRVERR, "err");
+    else resp_text(r, COAP_2_05_CONTENT, mbuf);
+    return;
+  }
+
+  if(code==COAP_GET && strcmp(path,"/sensors")==0){
+    handle_list(req, r);
+    return;
+  }
 
   if(code==COAP_GET){
-    if(store_get(path, resp, (int)sizeof resp)==0){
-      code_resp = COAP_2_05_CONTENT;
-      log_line("GET %s -> %s", path, resp);
+    /* Camino rápido: el cuerpo ya codificado en el store va tal cual. Con
+       la ETag vigente (revalidación de un proxy) basta un 2.03 */
+    const coap_opt_t *et = coap_find_opt(req, OPT_ETAG);
+    int valid;
+    int bl = store_get_encoded(path, et ? et->val : NULL, et ? et->len : 0,
+                               RESP_BODY(r), RESP_BODY_MAX, &valid);
+    if(bl>=0){
+      metrics_inc(M_STORE_HIT);
+      log_line("GET %s -> %s%d bytes", path, valid ? "2.03 " : "", bl);
+      r->code = valid ? COAP_2_03_VALID : COAP_2_05_CONTENT; r->blen = (size_t)bl;
+    }else if(bl==-2){
+      log_line("GET %s -> respuesta demasiado grande", path);
+      resp_text(r, COAP_5_00_SRVERR, "err");
     }else{
-      code_resp = COAP_4_04_NOTFND;
-      snprintf(resp,sizeof resp,"err");
+      metrics_inc(M_STORE_MISS);
       log_line("GET %s -> not found", path);
+      resp_text(r, COAP_4_04_NOTFND, "err");
     }
   }else if(code==COAP_POST || code==COAP_PUT){
-    if(body[0]){
-      store_upsert(path, body);
-      code_resp = COAP_2_04_CHANGED;
-      snprintf(resp,sizeof resp,(code==COAP_POST)?"stored":"updated");
-      log_line("%s %s -> OK", (code==COAP_POST?"POST":"PUT"), path);
+    /* TTL: Max-Age de la petición (0 = no caduca) o el de --ttl */
+    uint32_t ttl = coap_find_opt(req, OPT_MAX_AGE) ? coap_opt_uint(req, OPT_MAX_AGE, 0) : ttl_default;
+    if(body[0] && store_upsert_ttl(path, body, ttl)==0){
+      log_line("%s %s -> OK (ttl=%u)", (code==COAP_POST?"POST":"PUT"), path, (unsigned)ttl);
+      resp_text(r, COAP_2_04_CHANGED, (code==COAP_POST)?"stored":"updated");
+    }else if(body[0]){
+      metrics_inc(M_STORE_FULL);
+      log_line("%s %s -> store lleno", (code==COAP_POST?"POST":"PUT"), path);
+      resp_text(r, COAP_5_03_UNAVAIL, "store full");
     }else{
-      code_resp = COAP_4_00_BADREQ;
-      snprintf(resp,sizeof resp,"bad");
       log_line("%s %s -> body vacío", (code==COAP_POST?"POST":"PUT"), path);
+      resp_text(r, COAP_4_00_BADREQ, "bad");
     }
   }else if(code==COAP_DELETE){
     if(store_delete(path)==0){
-      code_resp = COAP_2_04_CHANGED;
-      snprintf(resp,sizeof resp,"deleted");
       log_line("DELETE %s -> OK", path);
+      resp_text(r, COAP_2_04_CHANGED, "deleted");
     }else{
-      code_resp = COAP_4_04_NOTFND;
-      snprintf(resp,sizeof resp,"err");
       log_line("DELETE %s -> not found", path);
+      resp_text(r, COAP_4_04_NOTFND, "err");
     }
   }else{
-    code_resp = COAP_4_00_BADREQ;
-    snprintf(resp,sizeof resp,"err");
     log_line("Método no soportado: 0x%02X", code);
+    resp_text(r, COAP_4_00_BADREQ, "err");
+  }
+}
+
+/* ======== Respuestas separadas para manejadores lentos ======== */
+/* Copia del datagrama: el job del worker se libera en cuanto éste vuelve */
+typedef struct { int n; uint8_t buf[1500]; } deferred_t;
+
+/* Escritura CON que esperó en el lote del proxy: la respuesta del upstream
+   sale desde el hilo del lote como respuesta separada */
+static void proxy_write_done(void *ctx, const proxy_resp_t *pr, const char *tgt){
+  resp_t r;
+  log_line("PROXY %s -> %d.%02d (%zu bytes, lote)", tgt, pr->code>>5, pr->code&0x1F, pr->plen);
+  r.code = pr->code;
+  r.blen = proxy_encode_body(RESP_BODY(&r), RESP_BODY_MAX, pr);
+  if(!r.blen && pr->plen) resp_text(&r, COAP_5_00_SRVERR, "err");
+  sep_complete((sep_t*)ctx, r.code, RESP_BODY(&r), r.blen);
+}
+
+static void deferred_main(sep_t *h, void *arg){
+  deferred_t *d = (deferred_t*)arg;
+  coap_msg_t req; resp_t r;
+  if(coap_parse(d->buf, (size_t)d->n, &req)==0)
+    handle_request(&req, req.h.type==COAP_TYPE_CON ? "CON-SEP" : "NON-SEP", &r);
+  else resp_text(&r, COAP_5_00_SRVERR, "err");
+  sep_complete(h, r.code, RESP_BODY(&r), r.blen);
+  free(d);
+}
+
+/* Datagrama UDP: parseo, RST si está mal formado, manejador y respuesta */
+static void handle_one(
+#ifdef _WIN32
+  SOCKET s,
+#else
+  int s,
+#endif
+  struct sockaddr_in *cli, socklen_t cl, const uint8_t *buf, int n)
+{
+  coap_msg_t req;
+  int rc = coap_parse(buf, (size_t)n, &req);
+  if(rc==COAP_ERR_SHORT && n<4){ metrics_inc(M_PARSE_FAIL); return; }
+
+  uint8_t req_type = req.h.type; // CON/NON esperado
+  uint8_t tkl = req.h.tkl;
+  uint16_t mid = req.h.mid;
+
+  if(rc==COAP_ERR_VERSION || rc==COAP_ERR_TKL){
+    log_line("MSG inválido: ver=%u tkl=%u -> RST", req.h.ver, tkl);
+    metrics_inc(M_PARSE_FAIL);
+    send_rst(s,cli,cl,mid);
+    return;
   }
+  if(rc<0){
+    log_line("MSG mal formado (err=%d) mid=0x%04X -> RST", rc, mid);
+    metrics_inc(M_PARSE_FAIL);
+    send_rst(s,cli,cl,mid);
+    return;
+  }
+  /* Ping CoAP (RFC 7252 §4.3): CON vacío -> RST. Otros vacíos no piden nada */
+  if(req.h.code==0){
+    if(req_type==COAP_TYPE_CON) send_rst(s,cli,cl,mid);
+    return;
+  }
+
+  /* Proxy que va a esperar al upstream: ACK vacío ya y la respuesta después
+     desde otro hilo, para que ni el cliente retransmita ni el worker espere */
+  if(proxy_wants(&req) && (req_type==COAP_TYPE_CON || req_type==COAP_TYPE_NON)){
+    /* retransmisión de una ya aplazada, aunque ahora se pudiera contestar en línea */
+    if(sep_dup(cli, mid)) return;
+    deferred_t *d;
+    if(proxy_may_block(&req) && (d = (deferred_t*)malloc(sizeof *d))!=NULL){
+      int dup;
+      sep_t *h = sep_begin(cli, &req, &dup);   /* comprueba duplicado y reserva a la vez */
+      if(dup){ free(d); return; }
+      if(h){
+        /* CON al lote: la contesta el hilo del lote cuando el upstream confirma */
+        if(req_type==COAP_TYPE_CON && proxy_write_async(&req, proxy_write_done, h)==0){
+          char path[KEY_MAX], body[VAL_MAX];
+          log_req(&req, "CON-SEP", path, body);
+          free(d);
+          return;
+        }
+        d->n = n; memcpy(d->buf, buf, (size_t)n);
+        sep_run(h, deferred_main, d);
+        return;
+      }
+      free(d);
+    }
+  }
+
+  resp_t r;
+  handle_request(&req, req_type==COAP_TYPE_CON?"CON": req_type==COAP_TYPE_NON?"NON":"UNK", &r);
+  /* Elegir tipo de respuesta: ACK si CON, NON si NON */
+  uint8_t resp_type = (req_type==COAP_TYPE_CON) ? COAP_TYPE_ACK : COAP_TYPE_NON;
+  send_udp_resp(s, cli, cl, resp_type, mid, req.h.token, tkl, &r);
+}
 
-  send_coap_reply(s, cli, cl, resp_type, code_resp, mid, token, tkl, resp);
+/* Clase de prioridad del datagrama, en el hilo receptor: sólo cabecera y, en
+   los GET, el primer Uri-Path. Lo mal formado va a WQ_BULK (el worker
+   responde RST igual, pero sin adelantarse a nadie). */
+static int req_class(const uint8_t *b, int n){
+  if(n<4) return WQ_BULK;
+  uint8_t type = (b[0]>>4)&3, tkl = b[0]&0x0F, code = b[1];
+  if(code==0) return type==COAP_TYPE_CON ? WQ_CONTROL : WQ_BULK;   /* sólo el ping CoAP */
+  if((code>>5)!=0 || type>COAP_TYPE_NON) return WQ_BULK;
+  if(code!=COAP_GET) return type==COAP_TYPE_CON ? WQ_WRITE : WQ_NON;
+
+  size_t i = 4 + (size_t)tkl, len = (size_t)n;
+  uint32_t num = 0;
+  while(i<len && b[i]!=0xFF){
+    uint32_t f[2] = { b[i]>>4, b[i]&0x0F };
+    i++;
+    for(int k=0;k<2;k++){
+      if(f[k]==13){ if(i>=len) return WQ_BULK; f[k] = 13 + b[i++]; }
+      else if(f[k]==14){ if(i+1>=len) return WQ_BULK; f[k] = 269 + ((uint32_t)b[i]<<8 | b[i+1]); i += 2; }
+      else if(f[k]==15) return WQ_BULK;
+    }
+    num += f[0];
+    if(num>OPT_URI_PATH || i+f[1]>len) break;
+    if(num==OPT_URI_PATH){
+      if((f[1]==4 && memcmp(b+i, "ping", 4)==0) || (f[1]==11 && memcmp(b+i, ".well-known", 11)==0))
+        return WQ_CONTROL;
+      break;
+    }
+    i += f[1];
+  }
+  return WQ_BULK;
 }
 
+/* Max-Age de los 5.03 por cola llena: el cliente reintenta pasado este tiempo */
+#define SHED_MAX_AGE_S 1
+
 #ifndef _WIN32
-static void* worker(void *arg){
+static void worker(void *arg){
   job_t *j = (job_t*)arg;
+  uint64_t t0 = metrics_now_us();
+  metrics_observe(H_QUEUE_US, t0 - j->t_rx);
   handle_one(j->s, &j->cli, j->cl, j->buf, j->n);
+  uint64_t t1 = metrics_now_us();
+  metrics_observe(H_HANDLER_US, t1 - t0);
+  metrics_class_observe(j->cls, t1 - j->t_rx);
   free(j);
+}
+
+static int udp_sock = -1;
+/* La respuesta separada lleva MID propio: req= dice a coap_replay de qué petición es */
+static void sep_send(const struct sockaddr_in *to, const uint8_t *buf, size_t n, uint8_t code, uint16_t req_mid){
+  send_dgram(udp_sock, (struct sockaddr_in*)to, (socklen_t)sizeof *to, buf, n, code);
+  if(n>=4) log_line("RESP mid=0x%04X code=%d.%02d req=0x%04X", ((unsigned)buf[2]<<8)|buf[3],
+                    code>>5, code&0x1F, (unsigned)req_mid);
+}
+
+/* Caducidad del store: un tick por segundo avanza la rueda de TTL */
+static void *ttl_ticker(void *arg){
+  (void)arg;
+  for(;;){
+    sleep(1);
+    int n = store_expire();
+    if(n>0){ metrics_add(M_STORE_EXPIRED, (uint64_t)n); log_line("TTL: %d entradas caducadas", n); }
+  }
   return NULL;
 }
+
+/* ======== CoAP sobre TCP (RFC 8323) ======== */
+/* Un hilo por conexión. El gateway manda peticiones seguidas sin esperar
+   (pipelining); se atienden en orden y las respuestas de todo lo leído en
+   un recv salen juntas en un solo send. Sin ACK por mensaje: TCP ya es fiable. */
+#define TCP_MSG_MAX   (64*1024)   /* Max-Message-Size anunciado en el CSM */
+#define TCP_OUT_MAX   (64*1024)
+
+typedef struct {
+  int fd;
+  struct sockaddr_in peer;
+  size_t olen;
+  uint8_t out[TCP_OUT_MAX];
+} tcp_conn_t;
+
+static int tcp_max_conns = 64;
+static int tcp_conns = 0;
+
+static int tcp_flush(tcp_conn_t *c){
+  size_t off = 0;
+  while(off<c->olen){
+    ssize_t w = send(c->fd, c->out+off, c->olen-off, MSG_NOSIGNAL);
+    if(w<=0) return -1;
+    off += (size_t)w;
+  }
+  metrics_add(M_BYTES_OUT, c->olen);
+  c->olen = 0;
+  return 0;
+}
+
+/* Encola una trama: cabecera en el headroom de r y cuerpo a continuación */
+static int tcp_queue(tcp_conn_t *c, const uint8_t *token, uint8_t tkl, resp_t *r){
+  uint8_t h[RESP_HEADROOM];
+  size_t hl = coap_tcp_header(h, sizeof h, r->code, token, tkl, r->blen);
+  if(!hl) return -1;
+  uint8_t *p = r->buf + RESP_HEADROOM - hl;
+  memcpy(p, h, hl);
+  size_t n = hl + r->blen;
+  if(c->olen+n>sizeof c->out && tcp_flush(c)<0) return -1;
+  memcpy(c->out+c->olen, p, n); c->olen += n;
+  metrics_inc(M_PKTS_OUT);
+  metrics_response(r->code);
+  return 0;
+}
+
+/* Mensajes de señalización (7.xx) sin opciones: CSM, Pong, Abort */
+static int tcp_signal(tcp_conn_t *c, uint8_t code, const uint8_t *token, uint8_t tkl,
+                      uint16_t opt, uint32_t optval, const char *diag){
+  resp_t r; coap_enc_t e;
+  coap_enc_begin(&e, RESP_BODY(&r), RESP_BODY_MAX);
+  if(opt) coap_enc_opt_uint(&e, opt, optval);
+  if(diag) coap_enc_payload(&e, diag, strlen(diag));
+  r.code = code; r.blen = coap_enc_finish(&e);
+  return tcp_queue(c, token, tkl, &r);
+}
+
+/* 0 para seguir, -1 para cerrar la conexión */
+static int tcp_message(tcp_conn_t *c, const uint8_t *p, size_t n){
+  coap_msg_t m;
+  metrics_inc(M_PKTS_IN);
+  int rc = coap_parse_tcp(p, n, &m);
+  if(rc<0){
+    log_line("TCP mensaje mal formado (err=%d) -> Abort", rc);
+    metrics_inc(M_PARSE_FAIL);
+    tcp_signal(c, COAP_7_05_ABORT, NULL, 0, 0, 0, "bad message");
+    return -1;
+  }
+  if((m.h.code>>5)==7){
+    if(m.h.code==COAP_7_02_PING) return tcp_signal(c, COAP_7_03_PONG, m.h.token, m.h.tkl, 0, 0, NULL);
+    if(m.h.code==COAP_7_04_RELEASE || m.h.code==COAP_7_05_ABORT) return -1;
+    return 0;  /* CSM del par: no necesitamos nada de lo que anuncia */
+  }
+  if((m.h.code>>5)!=0 || m.h.code==0) return 0;  /* respuestas o vacíos: nada que hacer */
+
+  uint64_t t0 = metrics_now_us();
+  resp_t r;
+  handle_request(&m, "TCP", &r);
+  metrics_observe(H_HANDLER_US, metrics_now_us() - t0);
+  return tcp_queue(c, m.h.token, m.h.tkl, &r);
+}
+
+static void *tcp_conn_main(void *arg){
+  tcp_conn_t *c = (tcp_conn_t*)arg;
+  uint8_t *in = (uint8_t*)malloc(TCP_MSG_MAX);
+  size_t have = 0;
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &c->peer.sin_addr, ip, sizeof ip);
+  log_line("TCP conexión de %s:%d", ip, ntohs(c->peer.sin_port));
+
+  /* RFC 8323 §5.3: lo primero que manda cada extremo es su CSM */
+  if(!in || tcp_signal(c, COAP_7_01_CSM, NULL, 0, OPT_MAX_MSG_SIZE, TCP_MSG_MAX, NULL)<0 || tcp_flush(c)<0)
+    goto done;
+
+  for(;;){
+    ssize_t r = recv(c->fd, in+have, TCP_MSG_MAX-have, 0);
+    if(r<=0) break;
+    have += (size_t)r;
+    metrics_add(M_BYTES_IN, (uint64_t)r);
+    size_t off = 0, flen;
+    int fr, stop = 0;
+    while((fr = coap_tcp_frame_len(in+off, have-off, &flen))==0){
+      if(tcp_message(c, in+off, flen)<0){ stop = 1; break; }
+      off += flen;
+    }
+    if(!stop && (fr<0 || flen>TCP_MSG_MAX)){
+      log_line("TCP trama inválida o mayor que %d bytes -> Abort", TCP_MSG_MAX);
+      metrics_inc(M_PARSE_FAIL);
+      tcp_signal(c, COAP_7_05_ABORT, NULL, 0, 0, 0, "message too big");
+      stop = 1;
+    }
+    if(tcp_flush(c)<0 || stop) break;
+    memmove(in, in+off, have-off); have -= off;
+  }
+done:
+  log_line("TCP cierre de %s:%d", ip, ntohs(c->peer.sin_port));
+  close(c->fd);
+  free(in); free(c);
+  __atomic_sub_fetch(&tcp_conns, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void *tcp_listener(void *arg){
+  int ls = *(int*)arg; free(arg);
+  for(;;){
+    tcp_conn_t *c = (tcp_conn_t*)malloc(sizeof *c);
+    if(!c){ metrics_inc(M_DROPS); sleep(1); continue; }
+    socklen_t pl = sizeof c->peer;
+    c->fd = accept(ls, (struct sockaddr*)&c->peer, &pl);
+    c->olen = 0;
+    if(c->fd<0){ free(c); continue; }
+    if(__atomic_add_fetch(&tcp_conns, 1, __ATOMIC_RELAXED) > tcp_max_conns){
+      metrics_inc(M_SHED);
+      close(c->fd); free(c);
+      __atomic_sub_fetch(&tcp_conns, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    metrics_inc(M_TCP_CONNS);
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    pthread_t th;
+    if(pthread_create(&th, NULL, tcp_conn_main, c)!=0){
+      close(c->fd); free(c);
+      __atomic_sub_fetch(&tcp_conns, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    pthread_detach(th);
+  }
+  return NULL;
+}
+
+static int tcp_start(int port){
+  int ls = socket(AF_INET, SOCK_STREAM, 0);
+  if(ls<0) return -1;
+  int one = 1;
+  setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  struct sockaddr_in a; memset(&a, 0, sizeof a);
+  a.sin_family = AF_INET; a.sin_addr.s_addr = htonl(INADDR_ANY); a.sin_port = htons((uint16_t)port);
+  if(bind(ls, (struct sockaddr*)&a, sizeof a)<0 || listen(ls, 64)<0){ close(ls); return -1; }
+  int *arg = (int*)malloc(sizeof *arg);
+  if(!arg){ close(ls); return -1; }
+  *arg = ls;
+  pthread_t th;
+  if(pthread_create(&th, NULL, tcp_listener, arg)!=0){ free(arg); close(ls); return -1; }
+  pthread_detach(th);
+  return 0;
+}
 #endif
 
 int main(int argc, char **argv){
   if(argc<3){
-    fprintf(stderr, "Uso: %s <PORT> <LogFile>\n", argv[0]);
+    fprintf(stderr, "Uso: %s <PORT> <LogFile> [--metrics-port N] [--workers N] [--queue N]\n"
+                    "          [--rate R] [--burst B]   (R peticiones/s por IP; por defecto 0 = sin límite:\n"
+                    "                                    detrás de NAT toda la flota comparte IP)\n"
+                    "          [--proxy] [--upstream HOST:PORT] [--proxy-batch-ms MS]\n"
+                    "          [--shm NAME]   (réplica del store en memoria compartida, ver shmcat)\n"
+                    "          [--capture FILE]   (tráfico crudo para coap_replay)\n"
+                    "          [--tcp-port N] [--tcp-max-conns N]   (CoAP sobre TCP, RFC 8323)\n"
+                    "          [--ttl S]   (caducidad de entradas sin Max-Age; 0 = nunca)\n"
+                    "          [--weights C,W,N,B]   (pesos de control/escrituras CON/NON/lecturas; 8,4,2,1)\n", argv[0]);
     return 1;
   }
   int port = atoi(argv[1]);
+  int metrics_port = 0;
+  int workers = 4, queue_cap = 256;
+  double rate = 0, burst = -1;   /* limitador opcional (--rate) */
+  int proxy = 0, proxy_batch_ms = 200; const char *upstream = NULL;
+  const char *shm_name = NULL, *capture_path = NULL;
+  int tcp_port = 0;
+  unsigned weights[WQ_CLASSES] = WQ_DEFAULT_WEIGHTS;
+  for(int a=3;a<argc;a++){
+    if(strcmp(argv[a],"--metrics-port")==0 && a+1<argc) metrics_port = atoi(argv[++a]);
+    else if(strcmp(argv[a],"--workers")==0 && a+1<argc) workers = atoi(argv[++a]);
+    else if(strcmp(argv[a],"--queue")==0 && a+1<argc) queue_cap = atoi(argv[++a]);
+    else if(strcmp(argv[a],"--rate")==0 && a+1<argc) rate = atof(argv[++a]);
+    else if(strcmp(argv[a],"--burst")==0 && a+1<argc) burst = atof(argv[++a]);
+    else if(strcmp(argv[a],"--proxy")==0) proxy = 1;
+    else if(strcmp(argv[a],"--upstream")==0 && a+1<argc){ upstream = argv[++a]; proxy = 1; }
+    else if(strcmp(argv[a],"--proxy-batch-ms")==0 && a+1<argc) proxy_batch_ms = atoi(argv[++a]);
+    else if(strcmp(argv[a],"--shm")==0 && a+1<argc) shm_name = argv[++a];
+    else if(strcmp(argv[a],"--capture")==0 && a+1<argc) capture_path = argv[++a];
+    else if(strcmp(argv[a],"--tcp-port")==0 && a+1<argc) tcp_port = atoi(argv[++a]);
+    else if(strcmp(argv[a],"--ttl")==0 && a+1<argc) ttl_default = (uint32_t)strtoul(argv[++a], NULL, 10);
+    else if(strcmp(argv[a],"--weights")==0 && a+1<argc){
+      if(sscanf(argv[++a], "%u,%u,%u,%u", &weights[0], &weights[1], &weights[2], &weights[3])!=4){
+        fprintf(stderr, "--weights espera cuatro enteros: control,escrituras,NON,lecturas\n"); return 1;
+      }
+    }
+#ifndef _WIN32
+    else if(strcmp(argv[a],"--tcp-max-conns")==0 && a+1<argc) tcp_max_conns = atoi(argv[++a]);
+#endif
+    else { fprintf(stderr, "Opción desconocida: %s\n", argv[a]); return 1; }
+  }
+  if(workers<1 || queue_cap<1){ fprintf(stderr, "--workers y --queue deben ser >= 1\n"); return 1; }
+  rl_init(rate, burst>0 ? burst : 2*rate);
   /* abrir log */
   glog = fopen(argv[2], "a");
 
@@ -355,30 +831,105 @@ int main(int argc, char **argv){
   if(bind(s,(struct sockaddr*)&srv,sizeof srv)==SOCKET_ERROR){ fprintf(stderr,"bind() fail\n"); return 1; }
 #else
   if(bind(s,(struct sockaddr*)&srv,sizeof srv)<0){ perror("bind"); return 1; }
+  if(workq_start((size_t)queue_cap, workers, worker, weights)!=0){ fprintf(stderr,"workq_start fail\n"); return 1; }
+  metrics_class_depth_fn(workq_depth);
+  pthread_t tt;
+  if(pthread_create(&tt, NULL, ttl_ticker, NULL)==0) pthread_detach(tt);
+  udp_sock = s;
+  /* El peor volcado de métricas debe caber en los buffers fijos */
+  int jmax, pmax;
+  if(metrics_check_worst(&jmax, &pmax)!=0){
+    fprintf(stderr, "Métricas: el peor caso no cabe (JSON %d/%d B, Prometheus %d/%d B)\n",
+            jmax, METRICS_JSON_MAX, pmax, METRICS_PROM_MAX);
+    return 1;
+  }
+  if(sep_start(sep_send)!=0) log_line("Sin respuestas separadas: se responderá siempre en el ACK");
 #endif
 
-  log_line("Servidor CoAP escuchando en UDP %d", port);
+  log_line("Servidor CoAP escuchando en UDP %d (workers=%d cola=%d/clase pesos=%u,%u,%u,%u rate=%.0f/s ttl=%us)",
+           port, workers, queue_cap, weights[0], weights[1], weights[2], weights[3], rate, (unsigned)ttl_default);
+  if(capture_path){
+    if(capture_open(capture_path)==0) log_line("Capturando tráfico en %s", capture_path);
+    else { log_line("No se pudo abrir el fichero de captura %s", capture_path); return 1; }
+  }
+  if(shm_name){
+    if(store_shm_open(shm_name)==0) log_line("Réplica del store en memoria compartida %s", shm_name);
+    else { log_line("No se pudo crear la memoria compartida %s", shm_name); return 1; }
+  }
+  if(proxy){
+    proxy_set_log(log_line);
+    if(proxy_init(upstream, proxy_batch_ms)==0)
+      log_line("Proxy CoAP activo (upstream por defecto=%s, lote=%d ms)", upstream?upstream:"-", proxy_batch_ms);
+    else { log_line("No se pudo activar el proxy (upstream=%s)", upstream?upstream:"-"); return 1; }
+  }
+  if(tcp_port>0){
+#ifndef _WIN32
+    if(tcp_start(tcp_port)==0) log_line("CoAP sobre TCP escuchando en %d (máx. %d conexiones)", tcp_port, tcp_max_conns);
+    else { log_line("No se pudo abrir el puerto TCP %d", tcp_port); return 1; }
+#else
+    log_line("CoAP sobre TCP no disponible en Windows");
+#endif
+  }
+  if(metrics_port>0){
+    if(metrics_serve_prom(metrics_port)==0) log_line("Métricas Prometheus en tcp://127.0.0.1:%d", metrics_port);
+    else log_line("No se pudo abrir el puerto de métricas %d", metrics_port);
+  }
 
+  /* Un job se reutiliza para la siguiente recepción si la petición se rechaza */
+  job_t *j = NULL;
   for(;;){
-    job_t *j = (job_t*)malloc(sizeof *j);
-    if(!j){ log_line("malloc() fail"); break; }
+    if(!j){
+      j = (job_t*)malloc(sizeof *j);
+      if(!j){ log_line("malloc() fail"); metrics_inc(M_DROPS); break; }
+    }
     j->s=s; j->cl=(socklen_t)sizeof j->cli;
 
 #ifdef _WIN32
     j->n = recvfrom(s, (char*)j->buf, (int)sizeof j->buf, 0, (struct sockaddr*)&j->cli, &j->cl);
-    if(j->n==SOCKET_ERROR){ free(j); continue; }
-    /* En Windows: manejamos inline (sin pthread) */
-    handle_one(j->s, &j->cli, j->cl, j->buf, j->n);
-    free(j);
+    if(j->n==SOCKET_ERROR){ metrics_inc(M_DROPS); continue; }
 #else
     j->n = (int)recvfrom(s, j->buf, sizeof j->buf, 0, (struct sockaddr*)&j->cli, &j->cl);
-    if(j->n<=0){ free(j); continue; }
-    pthread_t th;
-    if(pthread_create(&th,NULL,worker,j)!=0){ log_line("pthread_create fail"); free(j); continue; }
-    pthread_detach(th);
+    if(j->n<=0){ metrics_inc(M_DROPS); continue; }
+#endif
+    metrics_inc(M_PKTS_IN); metrics_add(M_BYTES_IN, (uint64_t)j->n);
+    capture_write(CAP_IN, j->cli.sin_addr.s_addr, j->cli.sin_port, j->buf, (size_t)j->n);
+    j->t_rx = metrics_now_us();
+    j->cls = req_class(j->buf, j->n);
+
+    /* ACK/RST vacío: confirma (o rechaza) una respuesta separada nuestra, que
+       deja de reenviarse, o no pide nada. Ni cola ni worker */
+    if(j->n>=4 && j->buf[1]==0 && ((j->buf[0]>>4)&3)>=COAP_TYPE_ACK){
+      sep_on_ack(&j->cli, (j->buf[0]>>4)&3, ((uint16_t)j->buf[2]<<8)|j->buf[3]);
+      continue;
+    }
+
+    /* Límite por par: un dispositivo desbocado no consume la cola de los demás */
+    uint64_t wait_us = rl_check(j->cli.sin_addr.s_addr, j->t_rx);
+    if(wait_us){
+      metrics_inc(M_RATE_LIMITED);
+      send_unavailable(s, &j->cli, j->cl, j->buf, j->n, (uint32_t)((wait_us+999999)/1000000));
+      continue;
+    }
+
+#ifdef _WIN32
+    /* En Windows: manejamos inline (sin pool de hilos) */
+    handle_one(j->s, &j->cli, j->cl, j->buf, j->n);
+    metrics_observe(H_HANDLER_US, metrics_now_us() - j->t_rx);
+    metrics_class_observe(j->cls, metrics_now_us() - j->t_rx);
+#else
+    /* Cola acotada por clase: si la suya está llena se responde 5.03 en vez de
+       encolar sin límite; las lecturas pesadas no agotan el sitio de los pings */
+    if(workq_push(j->cls, j)!=0){
+      metrics_inc(M_SHED); metrics_class_shed(j->cls);
+      send_unavailable(s, &j->cli, j->cl, j->buf, j->n, SHED_MAX_AGE_S);
+      continue;
+    }
+    j = NULL;
 #endif
   }
 
+  free(j);
+  capture_close();
   if(glog){ fclose(glog); glog=NULL; }
 #ifdef _WIN32
   closesocket(s); WSACleanup();
@@ -0,0 +1,58 @@
+// shmcat.c — Lee la réplica del store en memoria compartida (servidor con --shm NAME).
+//   shmcat NAME          -> todas las entradas, una por línea: clave<TAB>valor
+//   shmcat NAME KEY      -> sólo el valor de KEY (sale con 1 si no existe y con 2
+//                           si la región no se puede leer)
+//   shmcat -f NAME       -> vuelca de nuevo cada vez que cambia el contador gen
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "shmstore_reader.h"
+
+static void print_kv(const char *key, const char *val, uint64_t updated_us, void *ctx){
+  (void)updated_us; (void)ctx;
+  printf("%s\t%s\n", key, val);
+}
+
+int main(int argc, char **argv){
+  int follow = (argc>=2 && strcmp(argv[1],"-f")==0);
+  if(argc<2+follow || argc>3){
+    fprintf(stderr, "Uso: %s NAME [KEY] | -f NAME\n", argv[0]);
+    return 2;
+  }
+  const char *name = argv[1+follow];
+  shmstore_t *st = shmstore_open(name);
+  if(!st){ fprintf(stderr, "No se pudo abrir la réplica %s (¿servidor con --shm?)\n", name); return 2; }
+
+  if(!follow && argc==3){
+    char val[1024]; uint64_t upd;
+    int rc = shmstore_get(st, argv[2], val, sizeof val, &upd);
+    if(rc>=0) printf("%s\n", val);
+    else if(rc==-3) fprintf(stderr, "región reiniciándose\n");
+    else if(rc==-4) fprintf(stderr, "slot a medio escribir (¿servidor caído?)\n");
+    shmstore_close(st);
+    return rc>=0 ? 0 : rc<=-3 ? 2 : 1;
+  }
+
+  uint64_t last = ~0ull;
+  do{
+    uint64_t g = shmstore_generation(st);
+    if(g!=last){
+      if(follow) printf("# gen %llu\n", (unsigned long long)g);
+      int rc = shmstore_foreach(st, print_kv, NULL);
+      if(rc==-3) fprintf(stderr, "región reiniciándose\n");
+      else if(rc==-4){
+        fprintf(stderr, "slot a medio escribir (¿servidor caído?)\n");
+        if(!follow){ shmstore_close(st); return 2; }
+      }
+      fflush(stdout);
+      last = g;
+    }
+    if(follow){ struct timespec ts = { 0, 100000000L }; nanosleep(&ts, NULL); }
+  }while(follow);
+
+  shmstore_close(st);
+  return 0;
+}
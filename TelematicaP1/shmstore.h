@@ -0,0 +1,41 @@
+#ifndef SHMSTORE_H
+#define SHMSTORE_H
+#include <stdint.h>
+
+/* Formato de la réplica del store en memoria compartida (shm_open + mmap).
+   Un único escritor (el servidor) y cualquier número de lectores locales.
+
+   Cada slot lleva su propio seqlock: el escritor pone seq impar, copia clave
+   y valor y vuelve a ponerlo par. El lector copia el slot y lo da por bueno
+   sólo si leyó el mismo seq par antes y después. gen sube con cada cambio,
+   para que un lector sepa si hay algo nuevo sin recorrer los slots.
+
+   Cualquier cambio incompatible de esta estructura sube SHMSTORE_VERSION. */
+
+#define SHMSTORE_MAGIC    0x564B4853u   /* "SHKV" en little-endian */
+#define SHMSTORE_VERSION  1
+#define SHMSTORE_SLOTS    32            /* = MAX_ITEMS de store.c */
+#define SHMSTORE_KEY_MAX  128
+#define SHMSTORE_VAL_MAX  1024
+
+typedef struct {
+  uint32_t seq;          /* impar = escritura en curso */
+  uint32_t used;
+  uint64_t updated_us;   /* CLOCK_REALTIME en µs de la última escritura */
+  uint32_t klen, vlen;   /* sin contar el '\0' */
+  char key[SHMSTORE_KEY_MAX];
+  char val[SHMSTORE_VAL_MAX];
+} __attribute__((aligned(64))) shm_slot_t;
+
+typedef struct {
+  uint32_t magic;        /* se escribe el último: 0 = región a medio iniciar */
+  uint32_t version;
+  uint32_t nslots, slot_size;
+  uint32_t key_max, val_max;
+  uint32_t writer_pid;
+  uint32_t reserved;
+  uint64_t gen;          /* contador de cambios */
+  shm_slot_t slot[SHMSTORE_SLOTS];
+} __attribute__((aligned(64))) shm_hdr_t;
+
+#endif
@@ -0,0 +1,125 @@
+#define _POSIX_C_SOURCE 200809L
+#include "shmstore_reader.h"
+#include "shmstore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_SPINS    1000   /* reintentos seguidos antes de empezar a esperar */
+#define READ_WAIT_MS  20     /* espera máxima a que el escritor suelte un slot */
+
+struct shmstore { const shm_hdr_t *h; };
+
+shmstore_t *shmstore_open(const char *name){
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd<0) return NULL;
+  struct stat sb;
+  if(fstat(fd, &sb)<0 || (size_t)sb.st_size<sizeof(shm_hdr_t)){ close(fd); return NULL; }
+  void *p = mmap(NULL, sizeof(shm_hdr_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p==MAP_FAILED) return NULL;
+
+  const shm_hdr_t *h = (const shm_hdr_t*)p;
+  if(__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE)!=SHMSTORE_MAGIC ||
+     h->version!=SHMSTORE_VERSION || h->nslots!=SHMSTORE_SLOTS ||
+     h->slot_size!=sizeof(shm_slot_t) ||
+     h->key_max!=SHMSTORE_KEY_MAX || h->val_max!=SHMSTORE_VAL_MAX){
+    munmap(p, sizeof(shm_hdr_t));
+    return NULL;
+  }
+  shmstore_t *st = (shmstore_t*)malloc(sizeof *st);
+  if(!st){ munmap(p, sizeof(shm_hdr_t)); return NULL; }
+  st->h = h;
+  return st;
+}
+
+void shmstore_close(shmstore_t *st){
+  if(!st) return;
+  munmap((void*)st->h, sizeof(shm_hdr_t));
+  free(st);
+}
+
+static int ready(const shmstore_t *st){
+  return __atomic_load_n(&st->h->magic, __ATOMIC_ACQUIRE)==SHMSTORE_MAGIC;
+}
+
+/* Otra vuelta del seqlock: el escritor tiene el slot a medias o lo pisó
+   durante la copia. Lo normal es que suelte en unos µs; pasados READ_SPINS
+   intentos se espera en pausas de 100 µs, y se abandona (1) si el servidor
+   ya no existe (murió con seq impar) o tras READ_WAIT_MS. Sólo este camino
+   hace llamadas al sistema. */
+static int writer_stuck(const shm_hdr_t *h, unsigned *spin){
+  if(++*spin < READ_SPINS) return 0;
+  pid_t pid = (pid_t)h->writer_pid;
+  if(pid>0 && kill(pid, 0)<0 && errno==ESRCH) return 1;
+  if(*spin >= READ_SPINS + READ_WAIT_MS*10) return 1;
+  struct timespec ts = { 0, 100000L };
+  nanosleep(&ts, NULL);
+  return 0;
+}
+
+/* Lectura de un slot bajo su seqlock. Si key!=NULL sólo copia el valor
+   cuando la clave coincide. Devuelve la longitud del valor, -1 si el slot
+   está libre o es otra clave, -2 si no cabe en out, -4 si el escritor no lo
+   suelta. La copia se repite mientras el escritor la haya pisado a medias. */
+static int read_slot(const shm_hdr_t *h, const shm_slot_t *s, const char *key, size_t kl,
+                     char *kout, char *out, size_t cap, uint64_t *upd){
+  unsigned spin = 0;
+  for(;;){
+    uint32_t q = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if(q&1){ if(writer_stuck(h, &spin)) return -4; continue; }
+    int rc = -1;
+    uint32_t used = s->used, klen = s->klen, vlen = s->vlen;
+    uint64_t u = s->updated_us;
+    if(used && klen<SHMSTORE_KEY_MAX && vlen<SHMSTORE_VAL_MAX &&
+       (!key || (klen==kl && memcmp(s->key, key, kl)==0))){
+      if(vlen+1>cap) rc = -2;
+      else {
+        memcpy(out, s->val, vlen); out[vlen] = 0;
+        if(kout){ memcpy(kout, s->key, klen); kout[klen] = 0; }
+        rc = (int)vlen;
+      }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&s->seq, __ATOMIC_RELAXED)!=q){
+      if(writer_stuck(h, &spin)) return -4;
+      continue;
+    }
+    if(rc>=0 && upd) *upd = u;
+    return rc;
+  }
+}
+
+int shmstore_get(shmstore_t *st, const char *key, char *out, size_t cap, uint64_t *updated_us){
+  size_t kl = strlen(key);
+  if(!ready(st)) return -3;
+  if(kl>=SHMSTORE_KEY_MAX) return -1;
+  for(int i=0;i<SHMSTORE_SLOTS;i++){
+    int rc = read_slot(st->h, &st->h->slot[i], key, kl, NULL, out, cap, updated_us);
+    if(rc!=-1) return rc;
+  }
+  return -1;
+}
+
+int shmstore_foreach(shmstore_t *st, shmstore_visit_fn fn, void *ctx){
+  char key[SHMSTORE_KEY_MAX], val[SHMSTORE_VAL_MAX];
+  int n = 0;
+  if(!ready(st)) return -3;
+  for(int i=0;i<SHMSTORE_SLOTS;i++){
+    uint64_t u;
+    int rc = read_slot(st->h, &st->h->slot[i], NULL, 0, key, val, sizeof val, &u);
+    if(rc==-4) return -4;
+    if(rc>=0){ fn(key, val, u, ctx); n++; }
+  }
+  return n;
+}
+
+uint64_t shmstore_generation(shmstore_t *st){
+  return __atomic_load_n(&st->h->gen, __ATOMIC_ACQUIRE);
+}
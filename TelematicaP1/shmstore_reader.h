@@ -0,0 +1,33 @@
+#ifndef SHMSTORE_READER_H
+#define SHMSTORE_READER_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* Lector de la réplica del store (servidor lanzado con --shm NAME).
+   Tras shmstore_open todas las lecturas son accesos a memoria: ni
+   llamadas al sistema ni intervención del servidor (salvo al esperar a un
+   escritor que no suelta un slot). Es seguro leer desde varios hilos con el
+   mismo shmstore_t. */
+typedef struct shmstore shmstore_t;
+
+/* NULL si la región no existe, no está lista o es de otra versión */
+shmstore_t *shmstore_open(const char *name);
+void        shmstore_close(shmstore_t *st);
+
+/* Copia el valor de key en out (con '\0'). Devuelve su longitud, -1 si no
+   existe, -2 si no cabe en out, -3 si el servidor está reiniciando la región
+   o -4 si un slot sigue a medio escribir (el servidor murió escribiendo o no
+   lo suelta en unos ms). */
+int shmstore_get(shmstore_t *st, const char *key, char *out, size_t cap,
+                 uint64_t *updated_us);
+
+/* Recorre las entradas vivas con una copia coherente de cada una.
+   Devuelve cuántas visitó (o -3/-4 como shmstore_get). */
+typedef void (*shmstore_visit_fn)(const char *key, const char *val,
+                                  uint64_t updated_us, void *ctx);
+int shmstore_foreach(shmstore_t *st, shmstore_visit_fn fn, void *ctx);
+
+/* Contador de cambios: si no se movió, no hay nada nuevo que leer */
+uint64_t shmstore_generation(shmstore_t *st);
+
+#endif
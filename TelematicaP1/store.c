@@ -1,16 +1,227 @@
+#define _POSIX_C_SOURCE 200809L
 #include "store.h"
+#include "coap_min.h"
+#include "shmstore.h"
+#include "timerwheel.h"
+#include <stddef.h>
 #include <string.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <time.h>
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
 
-#define MAX_ITEMS 16
-#define KEY_MAX   64
+#define MAX_ITEMS 32
+#define KEY_MAX   128
 #define VAL_MAX   1024
+#define ENC_MAX   (VAL_MAX + 9)   /* ETag (5) + Content-Format (2) + 0xFF (1) + payload */
+#define ETAG_LEN  4
 
-typedef struct { char key[KEY_MAX]; char val[VAL_MAX]; int used; } kv_t;
+typedef struct {
+  char key[KEY_MAX]; char val[VAL_MAX]; int used;
+  uint8_t enc[ENC_MAX]; int enc_len;   /* cuerpo de la respuesta 2.05 ya codificado */
+  uint32_t etag;                       /* versión del valor, distinta en cada escritura */
+  tw_node_t ttl;                       /* armado si la entrada caduca */
+} kv_t;
 static kv_t tab[MAX_ITEMS];
 static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
 
+/* Caducidad: rueda en ticks de 1 s sobre un reloj monótono */
+static tw_t wheel;
+static int wheel_ready = 0;
+static int expired_pending = 0;   /* caducadas fuera de store_expire, aún sin contar */
+/* Última ETag dada. Arranca del reloj para que tras reiniciar el servidor una
+   caché intermedia no dé por válida una ETag de antes */
+static uint32_t etag_seq = 0;
+
+/* la réplica usa los mismos índices de slot y los mismos límites */
+typedef char shm_layout_check[(SHMSTORE_SLOTS==MAX_ITEMS && SHMSTORE_KEY_MAX==KEY_MAX &&
+                               SHMSTORE_VAL_MAX==VAL_MAX) ? 1 : -1];
+
+/* ======== Réplica en memoria compartida (opcional) ======== */
+#ifndef _WIN32
+static shm_hdr_t *shm = NULL;
+
+/* Copia el slot i a la réplica bajo su seqlock. Se llama con mtx tomado,
+   así que hay un solo escritor. */
+static void shm_mirror(int i){
+  if(!shm) return;
+  shm_slot_t *d = &shm->slot[i];
+  uint32_t q = d->seq;
+  __atomic_store_n(&d->seq, q+1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  d->used = (uint32_t)tab[i].used;
+  d->klen = (uint32_t)strlen(tab[i].key);
+  d->vlen = (uint32_t)strlen(tab[i].val);
+  memcpy(d->key, tab[i].key, d->klen+1);
+  memcpy(d->val, tab[i].val, d->vlen+1);
+  struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
+  d->updated_us = (uint64_t)ts.tv_sec*1000000u + (uint64_t)ts.tv_nsec/1000u;
+  __atomic_store_n(&d->seq, q+2, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&shm->gen, 1, __ATOMIC_RELEASE);
+}
+
+int store_shm_open(const char *name){
+  int fd = shm_open(name, O_CREAT|O_RDWR, 0644);
+  if(fd<0) return -1;
+  if(ftruncate(fd, (off_t)sizeof(shm_hdr_t))<0){ close(fd); return -1; }
+  void *p = mmap(NULL, sizeof(shm_hdr_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p==MAP_FAILED) return -1;
+
+  pthread_mutex_lock(&mtx);
+  shm = (shm_hdr_t*)p;
+  __atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);  /* lectores: región no lista */
+  memset(shm->slot, 0, sizeof shm->slot);
+  shm->version = SHMSTORE_VERSION;
+  shm->nslots = SHMSTORE_SLOTS; shm->slot_size = (uint32_t)sizeof(shm_slot_t);
+  shm->key_max = SHMSTORE_KEY_MAX; shm->val_max = SHMSTORE_VAL_MAX;
+  shm->writer_pid = (uint32_t)getpid();
+  for(int i=0;i<MAX_ITEMS;i++) if(tab[i].used) shm_mirror(i);
+  __atomic_store_n(&shm->magic, SHMSTORE_MAGIC, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&mtx);
+  return 0;
+}
+#else
+static void shm_mirror(int i){ (void)i; }
+int store_shm_open(const char *name){ (void)name; return -1; }
+#endif
+
+/* ======== Índice ordenado (crit-bit) ========
+   Árbol binario sobre los bits de las claves: cada nodo interno guarda el
+   primer bit en que difieren sus dos subárboles (byte + máscara con todos los
+   bits menos ese) y las hojas son índices de tab[]. Con n claves hay n-1
+   nodos internos, así que basta un pool de MAX_ITEMS nodos. Una referencia
+   0..MAX_ITEMS-1 es una hoja (slot), MAX_ITEMS+k es el nodo k, CB_NIL vacío.
+   Todo con mtx tomado. */
+#define CB_NIL        (-1)
+#define CB_IS_NODE(r) ((r)>=MAX_ITEMS)
+#define CB_N(r)       (&cbn[(r)-MAX_ITEMS])
+
+typedef struct { int child[2]; uint32_t byte; uint8_t otherbits; } cb_node_t;
+static cb_node_t cbn[MAX_ITEMS];
+static int cb_root = CB_NIL;
+static int cb_free = CB_NIL, cb_hw = 0;   /* libres encadenados por child[0] */
+
+static int cb_alloc(void){
+  int k;
+  if(cb_free!=CB_NIL){ k = cb_free; cb_free = cbn[k].child[0]; }
+  else k = cb_hw++;
+  return MAX_ITEMS + k;
+}
+static void cb_release(int r){
+  CB_N(r)->child[0] = cb_free; cb_free = r - MAX_ITEMS;
+}
+
+/* 0 = hijo izquierdo (bit a 0, o la clave ya se acabó), 1 = derecho */
+static int cb_dir(const cb_node_t *n, const char *k, size_t kl){
+  uint8_t c = n->byte<kl ? (uint8_t)k[n->byte] : 0;
+  return (1 + (n->otherbits | c)) >> 8;
+}
+/* el nodo n decide antes del bit (byte, other) */
+static int cb_before(const cb_node_t *n, uint32_t byte, uint8_t other){
+  return n->byte<byte || (n->byte==byte && n->otherbits<other);
+}
+static int cb_best(int r, const char *k, size_t kl){
+  while(CB_IS_NODE(r)) r = CB_N(r)->child[cb_dir(CB_N(r), k, kl)];
+  return r;
+}
+/* Primer bit distinto entre a y b; 0 si son iguales */
+static int cb_diff(const char *a, size_t al, const char *b, size_t bl,
+                   uint32_t *byte, uint8_t *other){
+  size_t n = al>bl ? al : bl;
+  for(size_t i=0;i<n;i++){
+    uint8_t ca = i<al ? (uint8_t)a[i] : 0, cb = i<bl ? (uint8_t)b[i] : 0;
+    if(ca!=cb){
+      uint8_t x = ca ^ cb;
+      x |= x>>1; x |= x>>2; x |= x>>4;
+      *byte = (uint32_t)i; *other = (uint8_t)~(x & ~(x>>1));
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void cb_insert(int i){
+  const char *k = tab[i].key; size_t kl = strlen(k);
+  if(cb_root==CB_NIL){ cb_root = i; return; }
+  int b = cb_best(cb_root, k, kl);
+  uint32_t byte; uint8_t other;
+  if(!cb_diff(k, kl, tab[b].key, strlen(tab[b].key), &byte, &other)) return;
+  int nr = cb_alloc();
+  cb_node_t *n = CB_N(nr);
+  n->byte = byte; n->otherbits = other;
+  int d = cb_dir(n, k, kl);
+  int *wp = &cb_root;
+  while(CB_IS_NODE(*wp) && cb_before(CB_N(*wp), byte, other))
+    wp = &CB_N(*wp)->child[cb_dir(CB_N(*wp), k, kl)];
+  n->child[d] = i; n->child[1-d] = *wp;
+  *wp = nr;
+}
+
+static void cb_remove(int i){
+  const char *k = tab[i].key; size_t kl = strlen(k);
+  int *wp = &cb_root, *wq = NULL, q = CB_NIL, d = 0;
+  if(cb_root==CB_NIL) return;
+  while(CB_IS_NODE(*wp)){
+    wq = wp; q = *wp;
+    d = cb_dir(CB_N(q), k, kl);
+    wp = &CB_N(q)->child[d];
+  }
+  if(*wp!=i) return;
+  if(!wq){ cb_root = CB_NIL; return; }
+  *wq = CB_N(q)->child[1-d];
+  cb_release(q);
+}
+
+int store_list(const char *prefix, const char *after, int limit, int *more,
+               store_list_fn fn, void *ctx){
+  int stk[MAX_ITEMS+1], sp = 0, n = 0;
+  size_t pl = strlen(prefix);
+  *more = 0;
+  pthread_mutex_lock(&mtx);
+  /* Subárbol con todas las claves que empiezan por prefix */
+  int top = cb_root;
+  while(CB_IS_NODE(top) && CB_N(top)->byte<pl) top = CB_N(top)->child[cb_dir(CB_N(top), prefix, pl)];
+  if(top!=CB_NIL && strncmp(tab[cb_best(top, prefix, pl)].key, prefix, pl)!=0) top = CB_NIL;
+
+  /* Posicionar tras after: se baja por sus bits apilando los subárboles
+     derechos pendientes hasta el bit en que after se separa del árbol. */
+  if(top!=CB_NIL && !after) stk[sp++] = top;
+  else if(top!=CB_NIL){
+    size_t al = strlen(after);
+    int b = cb_best(top, after, al);
+    uint32_t byte = 0; uint8_t other = 0;
+    int differ = cb_diff(after, al, tab[b].key, strlen(tab[b].key), &byte, &other);
+    int r = top;
+    while(CB_IS_NODE(r) && (!differ || cb_before(CB_N(r), byte, other))){
+      int d = cb_dir(CB_N(r), after, al);
+      if(d==0) stk[sp++] = CB_N(r)->child[1];
+      r = CB_N(r)->child[d];
+    }
+    /* r comparte con after todo lo anterior a la diferencia: o va entero
+       detrás de after o entero delante. Si after existe, r es su hoja. */
+    if(differ){
+      uint8_t ca = byte<al ? (uint8_t)after[byte] : 0;
+      uint8_t cl = byte<strlen(tab[b].key) ? (uint8_t)tab[b].key[byte] : 0;
+      if(ca<cl) stk[sp++] = r;
+    }
+  }
+
+  /* En orden: izquierda antes que derecha */
+  while(sp>0){
+    int r = stk[--sp];
+    while(CB_IS_NODE(r)){ stk[sp++] = CB_N(r)->child[1]; r = CB_N(r)->child[0]; }
+    if(n==limit || fn(tab[r].key, ctx)<0){ *more = 1; break; }
+    n++;
+  }
+  pthread_mutex_unlock(&mtx);
+  return n;
+}
+
 static int find_slot(const char *key){
   for(int i=0;i<MAX_ITEMS;i++)
     if(tab[i].used && strcmp(tab[i].key,key)==0) return i;
@@ -22,17 +233,89 @@ static int find_free(void){
   return -1;
 }
 
-int store_upsert(const char *key, const char *json){
+static uint64_t mono_s(void){
+#ifdef _WIN32
+  return (uint64_t)time(NULL);
+#else
+  struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec;
+#endif
+}
+
+/* con mtx tomado */
+static void drop_slot(int i){
+  tw_del(&tab[i].ttl);
+  cb_remove(i);
+  tab[i].used=0; tab[i].key[0]=0; tab[i].val[0]=0; tab[i].enc_len=0;
+  shm_mirror(i);
+}
+
+static void on_expire(tw_node_t *n, void *ctx){
+  (void)ctx;
+  kv_t *e = (kv_t*)((char*)n - offsetof(kv_t, ttl));
+  drop_slot((int)(e - tab));
+}
+
+/* con mtx tomado; devuelve cuántas entradas caducaron */
+static int expire_locked(void){
+  if(!wheel_ready) return 0;
+  return tw_advance(&wheel, mono_s(), on_expire, NULL);
+}
+
+/* Opciones de un 2.05 sin cabecera ni token: ETag (versión de la entrada,
+   para que un proxy revalide con 2.03) y Content-Format, como coap_build_msg */
+static void encode_body(kv_t *e){
+  size_t vlen = strlen(e->val);
+  int pos = 0;
+  if(!etag_seq) etag_seq = (uint32_t)time(NULL) << 8;
+  e->etag = ++etag_seq;
+  e->enc[pos++] = (OPT_ETAG<<4) | ETAG_LEN;      /* delta 4, longitud 4 */
+  for(int k=ETAG_LEN-1;k>=0;k--) e->enc[pos++] = (uint8_t)(e->etag >> (8*k));
+  e->enc[pos++] = ((OPT_CONTENT_FORMAT-OPT_ETAG)<<4) | 1;   /* delta 8, longitud 1 */
+  e->enc[pos++] = CF_APP_JSON;
+  if(vlen){
+    e->enc[pos++] = 0xFF;
+    memcpy(&e->enc[pos], e->val, vlen); pos += (int)vlen;
+  }
+  e->enc_len = pos;
+}
+
+int store_upsert_ttl(const char *key, const char *json, uint32_t ttl_s){
   pthread_mutex_lock(&mtx);
-  int i = find_slot(key);
-  if(i<0){ i = find_free(); if(i<0){ pthread_mutex_unlock(&mtx); return -1; } }
+  int i = find_slot(key), fresh = 0;
+  if(i<0){
+    i = find_free();
+    /* Lleno: puede haber entradas vencidas que el tick aún no ha recogido */
+    if(i<0){ expired_pending += expire_locked(); i = find_free(); }
+    if(i<0){ pthread_mutex_unlock(&mtx); return -1; }
+    fresh = 1;
+  }
   snprintf(tab[i].key, KEY_MAX, "%s", key);
   snprintf(tab[i].val, VAL_MAX, "%s", json);
+  encode_body(&tab[i]);
   tab[i].used = 1;
+  if(fresh) cb_insert(i);
+  if(ttl_s){
+    if(!wheel_ready){ tw_init(&wheel, mono_s()); wheel_ready = 1; }
+    tw_add(&wheel, &tab[i].ttl, mono_s() + ttl_s);
+  }else tw_del(&tab[i].ttl);
+  shm_mirror(i);
   pthread_mutex_unlock(&mtx);
   return 0;
 }
 
+int store_upsert(const char *key, const char *json){
+  return store_upsert_ttl(key, json, 0);
+}
+
+int store_expire(void){
+  pthread_mutex_lock(&mtx);
+  int n = expire_locked() + expired_pending;
+  expired_pending = 0;
+  pthread_mutex_unlock(&mtx);
+  return n;
+}
+
 int store_get(const char *key, char *out, int outsz){
   int rc=-1;
   pthread_mutex_lock(&mtx);
@@ -45,11 +328,28 @@ int store_get(const char *key, char *out, int outsz){
   return rc;
 }
 
+int store_get_encoded(const char *key, const uint8_t *etag, size_t etag_len,
+                      uint8_t *out, int outsz, int *valid){
+  int rc=-1;
+  *valid = 0;
+  pthread_mutex_lock(&mtx);
+  int i = find_slot(key);
+  if(i>=0){
+    /* La ETag es la primera opción: con la del cliente vigente basta ésa */
+    int n = tab[i].enc_len;
+    if(etag_len==ETAG_LEN && memcmp(etag, tab[i].enc+1, ETAG_LEN)==0){ n = 1+ETAG_LEN; *valid = 1; }
+    if(n > outsz) rc=-2;
+    else { memcpy(out, tab[i].enc, (size_t)n); rc=n; }
+  }
+  pthread_mutex_unlock(&mtx);
+  return rc;
+}
+
 int store_delete(const char *key){
   int rc=-1;
   pthread_mutex_lock(&mtx);
   int i = find_slot(key);
-  if(i>=0){ tab[i].used=0; tab[i].key[0]=0; tab[i].val[0]=0; rc=0; }
+  if(i>=0){ drop_slot(i); rc=0; }
   pthread_mutex_unlock(&mtx);
   return rc;
 }
@@ -1,9 +1,43 @@
 #ifndef STORE_H
 #define STORE_H
+#include <stddef.h>
+#include <stdint.h>
 
-/* almacén simple: guarda valor JSON por recurso (path) */
+/* almacén simple: guarda valor JSON por recurso (path).
+   store_upsert devuelve -1 si la tabla está llena. */
 int store_upsert(const char *key, const char *json);
+
+/* Igual, pero la entrada caduca a los ttl_s segundos (0 = nunca). Reescribir
+   la clave rearma o quita el plazo. */
+int store_upsert_ttl(const char *key, const char *json, uint32_t ttl_s);
+
+/* Borra las entradas vencidas; hay que llamarla periódicamente (cada
+   segundo basta, la resolución es de 1 s). Devuelve cuántas se liberaron,
+   incluidas las que store_upsert recogió al encontrar la tabla llena. */
+int store_expire(void);
 int store_get(const char *key, char *out, int outsz);
 int store_delete(const char *key);
 
+/* Respuesta GET precodificada de key: opciones (ETag, Content-Format JSON) +
+   0xFF + payload, regenerada sólo en store_upsert. El llamador antepone
+   cabecera y token. Si etag (la de la petición, NULL/0 si no trae) es la
+   vigente sólo copia la opción ETag y deja *valid=1: se responde 2.03 Valid.
+   Devuelve bytes copiados, -1 si no existe o -2 si no cabe en out. */
+int store_get_encoded(const char *key, const uint8_t *etag, size_t etag_len,
+                      uint8_t *out, int outsz, int *valid);
+
+/* Listado en orden de clave de las que empiezan por prefix y son mayores que
+   after (NULL = desde el principio), como mucho limit. fn se llama con el
+   mutex del store tomado y puede devolver -1 para cortar (no cuenta). Devuelve
+   cuántas se visitaron y deja *more=1 si quedaban más. Como el cursor es la
+   propia clave, seguir con after = última clave recibida no salta ni repite
+   entradas aunque haya escrituras entre páginas. */
+typedef int (*store_list_fn)(const char *key, void *ctx);
+int store_list(const char *prefix, const char *after, int limit, int *more,
+               store_list_fn fn, void *ctx);
+
+/* Replica el store en memoria compartida POSIX (formato en shmstore.h) para
+   que otros procesos lo lean sin pasar por UDP. 0 si OK, -1 si falla. */
+int store_shm_open(const char *name);
+
 #endif
@@ -0,0 +1,61 @@
+#include "timerwheel.h"
+
+static void link_tail(tw_node_t *head, tw_node_t *n){
+  n->next = head; n->prev = head->prev;
+  head->prev->next = n; head->prev = n;
+}
+
+void tw_init(tw_t *w, uint64_t now){
+  for(int l=0;l<TW_LEVELS;l++)
+    for(unsigned i=0;i<TW_SLOTS;i++){ tw_node_t *h = &w->slot[l][i]; h->next = h->prev = h; }
+  w->now = now;
+}
+
+void tw_del(tw_node_t *n){
+  if(!n->next) return;
+  n->prev->next = n->next; n->next->prev = n->prev;
+  n->next = n->prev = 0;
+}
+
+/* Hueco según la distancia al próximo tick: el nivel más bajo donde cabe,
+   indexado por los bits de expires de ese nivel. Lo ya vencido va al hueco
+   del próximo tick. */
+static void place(tw_t *w, tw_node_t *n){
+  if(n->expires < w->now) n->expires = w->now;
+  uint64_t d = n->expires - w->now;
+  if(d >= TW_RANGE){ d = TW_RANGE-1; n->expires = w->now + d; }
+  int l = 0;
+  while(d >= (1ull<<(TW_BITS*(l+1)))) l++;
+  link_tail(&w->slot[l][(n->expires >> (TW_BITS*l)) & (TW_SLOTS-1)], n);
+}
+
+void tw_add(tw_t *w, tw_node_t *n, uint64_t expires){
+  tw_del(n);
+  n->expires = expires;
+  place(w, n);
+}
+
+/* Saca la lista de un hueco a una cabecera local: quien la recorre puede
+   tocar otros nodos sin pisar la iteración */
+static void take(tw_node_t *h, tw_node_t *tmp){
+  if(h->next==h){ tmp->next = tmp->prev = tmp; return; }
+  tmp->next = h->next; tmp->prev = h->prev;
+  tmp->next->prev = tmp; tmp->prev->next = tmp;
+  h->next = h->prev = h;
+}
+
+int tw_advance(tw_t *w, uint64_t now, tw_fire_fn fn, void *ctx){
+  int fired = 0;
+  tw_node_t tmp;
+  for(; w->now<=now; w->now++){
+    uint64_t t = w->now;
+    /* Al dar la vuelta el nivel l-1 se reparte el hueco actual del nivel l */
+    for(int l=1; l<TW_LEVELS && ((t >> (TW_BITS*(l-1))) & (TW_SLOTS-1))==0; l++){
+      take(&w->slot[l][(t >> (TW_BITS*l)) & (TW_SLOTS-1)], &tmp);
+      while(tmp.next!=&tmp){ tw_node_t *n = tmp.next; tw_del(n); place(w, n); }
+    }
+    take(&w->slot[0][t & (TW_SLOTS-1)], &tmp);
+    while(tmp.next!=&tmp){ tw_node_t *n = tmp.next; tw_del(n); fired++; fn(n, ctx); }
+  }
+  return fired;
+}
@@ -0,0 +1,34 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+#include <stdint.h>
+
+/* Rueda de temporizadores jerárquica: TW_LEVELS niveles de TW_SLOTS huecos.
+   El nivel l guarda los vencimientos a menos de 64^(l+1) ticks y se reparte
+   en el nivel de abajo cuando éste da la vuelta, así que añadir, quitar y
+   vencer cuestan O(1) sin recorrer nada. Los nodos van dentro del objeto
+   del llamador (lista doblemente enlazada intrusiva); un nodo a cero no
+   está armado. Sin mutex: lo protege el llamador. */
+#define TW_BITS   6
+#define TW_SLOTS  (1u<<TW_BITS)
+#define TW_LEVELS 4
+#define TW_RANGE  (1ull<<(TW_BITS*TW_LEVELS))   /* 2^24 ticks; más lejos se recorta */
+
+typedef struct tw_node { struct tw_node *prev, *next; uint64_t expires; } tw_node_t;
+
+typedef struct {
+  uint64_t now;                          /* próximo tick por procesar */
+  tw_node_t slot[TW_LEVELS][TW_SLOTS];   /* cabeceras de lista */
+} tw_t;
+
+typedef void (*tw_fire_fn)(tw_node_t *n, void *ctx);
+
+void tw_init(tw_t *w, uint64_t now);
+void tw_add(tw_t *w, tw_node_t *n, uint64_t expires);  /* rearma si ya estaba */
+void tw_del(tw_node_t *n);                             /* no hace nada si no está armado */
+static inline int tw_armed(const tw_node_t *n){ return n->next!=0; }
+
+/* Procesa los ticks hasta now inclusive; fn recibe cada nodo ya desarmado y
+   puede añadir o quitar otros. Devuelve cuántos vencieron. */
+int tw_advance(tw_t *w, uint64_t now, tw_fire_fn fn, void *ctx);
+
+#endif
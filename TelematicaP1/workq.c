@@ -0,0 +1,82 @@
+#include "workq.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+typedef struct {
+  void **ring;
+  size_t head, count;
+  long w, cur;      /* peso y crédito del round robin */
+} wq_class_t;
+
+static wq_class_t cls[WQ_CLASSES];
+static size_t cap = 0, total = 0;
+static workq_fn handler = NULL;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  nonempty = PTHREAD_COND_INITIALIZER;
+
+/* Round robin ponderado "suave" (el de nginx): en cada extracción las clases
+   con trabajo suman su peso al crédito, se sirve la de más crédito y ésta
+   paga la suma. Con 8/4/2/1 y todas llenas, de cada 15 se sirven 8 de
+   control, 4 escrituras, 2 NON y 1 lectura, intercaladas; una clase vacía no
+   acumula crédito, así que al llegar no se lleva una ráfaga. Con mtx tomado. */
+static int pick(void){
+  int best = -1; long sum = 0;
+  for(int c=0;c<WQ_CLASSES;c++){
+    if(!cls[c].count) continue;
+    cls[c].cur += cls[c].w; sum += cls[c].w;
+    if(best<0 || cls[c].cur>cls[best].cur) best = c;
+  }
+  cls[best].cur -= sum;
+  return best;
+}
+
+static void *worker_main(void *arg){
+  (void)arg;
+  for(;;){
+    pthread_mutex_lock(&mtx);
+    while(total==0) pthread_cond_wait(&nonempty, &mtx);
+    wq_class_t *q = &cls[pick()];
+    void *item = q->ring[q->head];
+    q->head = (q->head+1) % cap; q->count--; total--;
+    if(!q->count) q->cur = 0;
+    pthread_mutex_unlock(&mtx);
+    handler(item);
+  }
+  return NULL;
+}
+
+int workq_start(size_t capacity, int nworkers, workq_fn fn, const unsigned *weights){
+  static const unsigned defw[WQ_CLASSES] = WQ_DEFAULT_WEIGHTS;
+  if(!capacity || nworkers<=0 || !fn) return -1;
+  if(!weights) weights = defw;
+  for(int c=0;c<WQ_CLASSES;c++){
+    cls[c].ring = (void**)calloc(capacity, sizeof *cls[c].ring);
+    if(!cls[c].ring) return -1;
+    cls[c].w = (long)weights[c];
+  }
+  cap = capacity; handler = fn;
+  for(int i=0;i<nworkers;i++){
+    pthread_t th;
+    if(pthread_create(&th, NULL, worker_main, NULL)!=0) return -1;
+    pthread_detach(th);
+  }
+  return 0;
+}
+
+int workq_push(int c, void *item){
+  if(c<0 || c>=WQ_CLASSES) c = WQ_BULK;
+  wq_class_t *q = &cls[c];
+  pthread_mutex_lock(&mtx);
+  if(q->count==cap){ pthread_mutex_unlock(&mtx); return -1; }
+  q->ring[(q->head+q->count) % cap] = item; q->count++; total++;
+  pthread_cond_signal(&nonempty);
+  pthread_mutex_unlock(&mtx);
+  return 0;
+}
+
+size_t workq_depth(int c){
+  pthread_mutex_lock(&mtx);
+  size_t n = (c>=0 && c<WQ_CLASSES) ? cls[c].count : total;
+  pthread_mutex_unlock(&mtx);
+  return n;
+}
@@ -0,0 +1,26 @@
+#ifndef WORKQ_H
+#define WORKQ_H
+#include <stddef.h>
+
+/* Colas de trabajo acotadas por clase de prioridad + pool fijo de hilos. El
+   hilo receptor clasifica y encola; si la cola de su clase está llena la
+   petición se rechaza en vez de esperar. Los workers reparten el servicio
+   entre las clases con trabajo según sus pesos (round robin ponderado). */
+enum {
+  WQ_CONTROL = 0,  /* ping CoAP, /ping, /.well-known/... */
+  WQ_WRITE,        /* escrituras CON (POST/PUT/DELETE) */
+  WQ_NON,          /* telemetría NON */
+  WQ_BULK,         /* lecturas (GET) y el resto */
+  WQ_CLASSES
+};
+
+#define WQ_DEFAULT_WEIGHTS { 8, 4, 2, 1 }
+
+typedef void (*workq_fn)(void *item);
+
+/* capacity es por clase; weights NULL = WQ_DEFAULT_WEIGHTS. 0 si OK */
+int    workq_start(size_t capacity, int nworkers, workq_fn fn, const unsigned *weights);
+int    workq_push(int cls, void *item);   /* 0 si encolado, -1 si su cola está llena */
+size_t workq_depth(int cls);              /* cls<0 = todas */
+
+#endif